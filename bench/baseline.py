@@ -0,0 +1,31 @@
+# Baseline check shared by the QEMU gates, see README.md
+#
+# A gate turns its run into a report and compares it with the committed
+# baselines/<name>.json. A missing baseline fails the gate. With
+# BENCH_RECORD_BASELINE=1 in the environment the report is written as the
+# new baseline instead, and the test is skipped since nothing was compared.
+
+import json
+import os
+
+import pytest
+
+BASELINE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'baselines')
+RECORD_ENV = 'BENCH_RECORD_BASELINE'
+
+
+def check(name, report, compare):
+    """Fails the test on the regressions compare(report, baseline) returns."""
+    path = os.path.join(BASELINE_DIR, name + '.json')
+    if os.environ.get(RECORD_ENV):
+        os.makedirs(BASELINE_DIR, exist_ok=True)
+        with open(path, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write('\n')
+        pytest.skip('recorded the baseline to {}'.format(path))
+
+    if not os.path.exists(path):
+        pytest.fail('no baseline {}, record one with {}=1 and commit it'.format(path, RECORD_ENV))
+    with open(path) as f:
+        regressions = compare(report, json.load(f))
+    assert not regressions, '\n'.join(regressions)
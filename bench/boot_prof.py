@@ -0,0 +1,111 @@
+#!/usr/bin/env python
+#
+# Boot profile report for the apps using components/boot_prof.
+#
+# Reads the span table from a console log (the BOOT_PROF line) or from the
+# /boot uri of a running target, prints it as a per-span report and, with
+# --baseline, compares the time each span ended at against a previous
+# report. The exit code is non-zero when a span now ends later than the
+# baseline by more than the tolerance plus a fixed slack, or is missing.
+#
+# Only the standard library is used.
+
+import argparse
+import json
+import re
+import sys
+import urllib.request
+
+BOOT_PROF_RE = re.compile(r'BOOT_PROF (\{.*\})')
+
+# span whose end is the time to serve, for the apps with a web server
+SERVE_SPAN = 'httpd start'
+
+
+def parse(document):
+    """Turns the JSON table into a report: reset reason and spans by name, in ms."""
+    table = json.loads(document)
+    spans = {}
+    for span in table['spans']:
+        # a repeated name keeps its first occurrence, the one on the boot path
+        if span['name'] in spans:
+            continue
+        end_us = span['end_us']
+        spans[span['name']] = {
+            'start_ms': round(span['start_us'] / 1000, 1),
+            'end_ms': round(end_us / 1000, 1) if end_us >= 0 else None,
+        }
+    report = {'reset': table['reset'], 'spans': spans}
+    serve = spans.get(SERVE_SPAN)
+    if serve is not None:
+        report['time_to_serve_ms'] = serve['end_ms']
+    return report
+
+
+def parse_log(text):
+    """Report from the last BOOT_PROF line of a console log."""
+    matches = BOOT_PROF_RE.findall(text)
+    if not matches:
+        raise ValueError('no BOOT_PROF line in the log')
+    return parse(matches[-1])
+
+
+def fetch(host, port, timeout=5):
+    with urllib.request.urlopen('http://{}:{}/boot'.format(host, port), timeout=timeout) as resp:
+        return parse(resp.read().decode())
+
+
+def compare(report, baseline, tolerance, slack_ms):
+    """Returns the list of regressions of report against baseline."""
+    regressions = []
+    for name, base in baseline['spans'].items():
+        cur = report['spans'].get(name)
+        if cur is None:
+            regressions.append('{}: missing'.format(name))
+            continue
+        if base['end_ms'] is None:
+            continue
+        if cur['end_ms'] is None:
+            regressions.append('{}: never ended, baseline ended at {} ms'.format(name, base['end_ms']))
+            continue
+        limit = base['end_ms'] * (1 + tolerance) + slack_ms
+        if cur['end_ms'] > limit:
+            regressions.append('{}: ended at {} ms > {} ms (baseline {} ms)'.format(
+                name, cur['end_ms'], round(limit, 1), base['end_ms']))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='boot profile report and regression check')
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--log', help='console log holding a BOOT_PROF line')
+    source.add_argument('--target', help='host:port of a running app serving /boot')
+    parser.add_argument('--output', help='write the JSON report here')
+    parser.add_argument('--baseline', help='report to compare against')
+    parser.add_argument('--tolerance', type=float, default=0.2, help='allowed relative regression')
+    parser.add_argument('--slack-ms', type=float, default=50, help='allowed absolute regression')
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log, errors='replace') as f:
+            report = parse_log(f.read())
+    else:
+        host, port = args.target.rsplit(':', 1)
+        report = fetch(host, int(port))
+
+    text = json.dumps(report, indent=2, sort_keys=True)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(report, json.load(f), args.tolerance, args.slack_ms)
+        for line in regressions:
+            print('REGRESSION ' + line, file=sys.stderr)
+        sys.exit(1 if regressions else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python
+#
+# Report for the mqtt_bench app.
+#
+# The app benchmarks the MQTT client against a broker on the host (mosquitto
+# reached from QEMU over open_eth) and prints its raw results as one
+# MQTT_BENCH line. This reads that line from a console log, turns it into
+# publish rates per QoS level and p50/p99 latency and reconnect times, and
+# with --baseline compares against a previous report. The exit code is
+# non-zero when a rate dropped or a time grew by more than the tolerance,
+# or when more messages were lost than in the baseline.
+#
+# Only the standard library is used.
+
+import argparse
+import contextlib
+import json
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import time
+
+MQTT_BENCH_RE = re.compile(r'MQTT_BENCH (\{.*\})')
+
+
+def percentiles(samples_us):
+    lat = sorted(samples_us)
+
+    def pct(p):
+        if not lat:
+            return None
+        return round(lat[min(len(lat) - 1, int(p * len(lat)))] / 1000.0, 3)
+
+    return {'p50': pct(0.50), 'p99': pct(0.99), 'max': pct(1.0)}
+
+
+def parse(document):
+    """Turns the raw results into a report, rates in msgs/s and times in ms."""
+    raw = json.loads(document)
+    publish = {}
+    for run in raw['publish']:
+        elapsed_s = run['elapsed_us'] / 1e6
+        publish['qos{}'.format(run['qos'])] = {
+            'sent': run['sent'],
+            'failed': run['failed'],
+            'msgs_per_s': round(run['sent'] / elapsed_s, 1) if elapsed_s > 0 else 0.0,
+        }
+    report = {
+        'broker': raw['broker'],
+        'payload': raw['payload'],
+        'messages': raw['messages'],
+        'window': raw['window'],
+        'connect_ms': round(raw['connect_us'] / 1000, 3),
+        'publish': publish,
+    }
+    for name in ('latency', 'reconnect'):
+        times = percentiles(raw[name]['us'])
+        times['samples'] = len(raw[name]['us'])
+        times['lost'] = raw[name]['lost']
+        report[name + '_ms'] = times
+    return report
+
+
+def parse_log(text):
+    """Report from the last MQTT_BENCH line of a console log."""
+    matches = MQTT_BENCH_RE.findall(text)
+    if not matches:
+        raise ValueError('no MQTT_BENCH line in the log')
+    return parse(matches[-1])
+
+
+def compare(report, baseline, tolerance, slack_ms):
+    """Returns the list of regressions of report against baseline."""
+    regressions = []
+    for qos, base in baseline['publish'].items():
+        cur = report['publish'].get(qos)
+        if cur is None:
+            regressions.append('{}: missing'.format(qos))
+            continue
+        if cur['msgs_per_s'] < base['msgs_per_s'] * (1 - tolerance):
+            regressions.append('{}: {} msgs/s < {} msgs/s'.format(qos, cur['msgs_per_s'], base['msgs_per_s']))
+        if cur['failed'] > base['failed']:
+            regressions.append('{}: {} failed, baseline had {}'.format(qos, cur['failed'], base['failed']))
+    for name in ('latency_ms', 'reconnect_ms'):
+        base, cur = baseline[name], report[name]
+        for p in ('p50', 'p99'):
+            b, c = base.get(p), cur.get(p)
+            if b is None:
+                continue
+            if c is None:
+                regressions.append('{}: no {}, baseline had {} ms'.format(name, p, b))
+            elif c > b * (1 + tolerance) + slack_ms:
+                regressions.append('{}: {} {} ms > {} ms'.format(name, p, c, b))
+        if cur['lost'] > base['lost']:
+            regressions.append('{}: {} lost, baseline had {}'.format(name, cur['lost'], base['lost']))
+    return regressions
+
+
+def listening(port, host='127.0.0.1'):
+    with contextlib.closing(socket.socket(socket.AF_INET, socket.SOCK_STREAM)) as s:
+        s.settimeout(0.5)
+        return s.connect_ex((host, port)) == 0
+
+
+@contextlib.contextmanager
+def local_broker(port=1883, timeout=10):
+    """Starts mosquitto on port for the duration, unless a broker already listens there."""
+    if listening(port):
+        yield None
+        return
+    mosquitto = shutil.which('mosquitto')
+    if mosquitto is None:
+        raise RuntimeError('no broker on port {} and mosquitto is not installed'.format(port))
+    # without a config file mosquitto only listens on localhost, which is
+    # where the QEMU user network connects from
+    proc = subprocess.Popen([mosquitto, '-p', str(port)], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.monotonic() + timeout
+        while not listening(port):
+            if proc.poll() is not None or time.monotonic() > deadline:
+                raise RuntimeError('mosquitto did not start on port {}'.format(port))
+            time.sleep(0.1)
+        yield proc
+    finally:
+        proc.terminate()
+        proc.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='mqtt_bench report and regression check')
+    parser.add_argument('--log', required=True, help='console log holding an MQTT_BENCH line, - for stdin')
+    parser.add_argument('--output', help='write the JSON report here')
+    parser.add_argument('--baseline', help='report to compare against')
+    parser.add_argument('--tolerance', type=float, default=0.2, help='allowed relative regression')
+    parser.add_argument('--slack-ms', type=float, default=2, help='allowed absolute regression of the times')
+    args = parser.parse_args()
+
+    if args.log == '-':
+        report = parse_log(sys.stdin.read())
+    else:
+        with open(args.log, errors='replace') as f:
+            report = parse_log(f.read())
+
+    text = json.dumps(report, indent=2, sort_keys=True)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(report, json.load(f), args.tolerance, args.slack_ms)
+        for line in regressions:
+            print('REGRESSION ' + line, file=sys.stderr)
+        sys.exit(1 if regressions else 0)
+
+
+if __name__ == '__main__':
+    main()
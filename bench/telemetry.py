@@ -0,0 +1,269 @@
+#!/usr/bin/env python
+#
+# Host side of components/telemetry_codec.
+#
+# decode: prints binary telemetry payloads as JSON lines. Payloads are hex,
+# one per line, from the arguments or stdin, so a broker can be watched with
+#   mosquitto_sub -h broker.hivemq.com -t /emanuele_topic/telemetry -F %x | python bench/telemetry.py decode
+#
+# bench: encodes samples of a schema as binary, as "name=value" text, as
+# JSON and as the old "hello world banana" string, and reports payload and
+# MQTT PUBLISH sizes plus encode and decode rates. The rates are those of
+# this Python code, the firmware prints its own with telemetry_bench.
+#
+# Schemas come from telemetry_schemas.json next to this file, or --schemas.
+# Only the standard library is used.
+
+import argparse
+import json
+import math
+import os
+import random
+import struct
+import sys
+import time
+
+FORMAT = 0xA1
+DEFAULT_SCHEMAS = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'telemetry_schemas.json')
+
+
+def load_schemas(path):
+    with open(path) as f:
+        return {schema['id']: schema for schema in json.load(f)}
+
+
+def put_varint(out, v):
+    while v >= 0x80:
+        out.append((v & 0x7f) | 0x80)
+        v >>= 7
+    out.append(v)
+
+
+def get_varint(buf, pos):
+    v = 0
+    shift = 0
+    while True:
+        if pos >= len(buf):
+            raise ValueError('truncated varint')
+        b = buf[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if b < 0x80:
+            return v, pos
+
+
+def zigzag(v):
+    return (v << 1) ^ (v >> 63)
+
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+
+def encode(schema, values):
+    """values maps field names to values, as telemetry_encode lays them out."""
+    out = bytearray([FORMAT])
+    put_varint(out, schema['id'])
+    for field in schema['fields']:
+        v = values[field['name']]
+        kind = field['type']
+        if kind == 'uint':
+            put_varint(out, v)
+        elif kind == 'sint':
+            put_varint(out, zigzag(v))
+        elif kind == 'fixed':
+            put_varint(out, zigzag(int(round(v * 10 ** field.get('decimals', 0)))))
+        elif kind == 'float':
+            out += struct.pack('<f', v)
+        elif kind == 'bool':
+            out.append(1 if v else 0)
+        elif kind == 'string':
+            data = v.encode()
+            put_varint(out, len(data))
+            out += data
+        else:
+            raise ValueError('unknown type ' + kind)
+    return bytes(out)
+
+
+def decode(payload, schemas):
+    """Returns (schema name, values) of an encoded payload."""
+    if len(payload) < 2 or payload[0] != FORMAT:
+        raise ValueError('not a telemetry payload')
+    schema_id, pos = get_varint(payload, 1)
+    schema = schemas.get(schema_id)
+    if schema is None:
+        raise ValueError('unknown schema {}'.format(schema_id))
+
+    values = {}
+    for field in schema['fields']:
+        kind = field['type']
+        if kind == 'uint':
+            v, pos = get_varint(payload, pos)
+        elif kind == 'sint':
+            v, pos = get_varint(payload, pos)
+            v = unzigzag(v)
+        elif kind == 'fixed':
+            v, pos = get_varint(payload, pos)
+            v = unzigzag(v) / 10 ** field.get('decimals', 0)
+        elif kind == 'float':
+            if pos + 4 > len(payload):
+                raise ValueError('truncated float')
+            v = struct.unpack_from('<f', payload, pos)[0]
+            pos += 4
+        elif kind == 'bool':
+            if pos >= len(payload):
+                raise ValueError('truncated bool')
+            v = payload[pos] != 0
+            pos += 1
+        elif kind == 'string':
+            n, pos = get_varint(payload, pos)
+            if pos + n > len(payload):
+                raise ValueError('truncated string')
+            v = payload[pos:pos + n].decode(errors='replace')
+            pos += n
+        else:
+            raise ValueError('unknown type ' + kind)
+        values[field['name']] = v
+    if pos != len(payload):
+        raise ValueError('{} trailing bytes'.format(len(payload) - pos))
+    return schema['name'], values
+
+
+def to_text(schema, values):
+    """The "name=value" form of telemetry_to_text."""
+    parts = []
+    for field in schema['fields']:
+        v = values[field['name']]
+        if field['type'] == 'fixed':
+            v = '{:.{}f}'.format(v, field.get('decimals', 0))
+        elif field['type'] == 'bool':
+            v = int(v)
+        parts.append('{}={}'.format(field['name'], v))
+    return ' '.join(parts)
+
+
+def sample(schema, rng, t):
+    """Plausible values for each field, uptime counting up."""
+    values = {}
+    for field in schema['fields']:
+        name = field['name']
+        kind = field['type']
+        if name == 'uptime_ms':
+            values[name] = t
+        elif 'heap' in name:
+            values[name] = rng.randint(150000, 250000)
+        elif name == 'rssi':
+            values[name] = rng.randint(-90, -30)
+        elif kind == 'uint':
+            values[name] = rng.randint(0, 40)
+        elif kind == 'sint':
+            values[name] = rng.randint(-1000, 1000)
+        elif kind in ('fixed', 'float'):
+            values[name] = round(rng.uniform(-40, 85), field.get('decimals', 2))
+        elif kind == 'bool':
+            values[name] = rng.random() < 0.5
+        else:
+            values[name] = rng.choice(['eth', 'wifi'])
+    return values
+
+
+def publish_size(topic, payload_len, qos=1):
+    """Bytes of an MQTT 3.1.1 PUBLISH: fixed header, topic, packet id, payload."""
+    remaining = 2 + len(topic) + (2 if qos else 0) + payload_len
+    length_bytes = 1
+    while remaining >= 128 ** length_bytes:
+        length_bytes += 1
+    return 1 + length_bytes + remaining
+
+
+def rate(fn, items, min_time=0.2):
+    count = 0
+    start = time.perf_counter()
+    while True:
+        for item in items:
+            fn(item)
+        count += len(items)
+        elapsed = time.perf_counter() - start
+        if elapsed >= min_time:
+            return count / elapsed
+
+
+def bench(schema, schemas, count, topic):
+    rng = random.Random(1)
+    samples = [sample(schema, rng, 1000 + i * 5000) for i in range(count)]
+
+    forms = {
+        'banana': (lambda s: 'hello world banana {}'.format(s['uptime_ms']).encode(), None),
+        'text': (lambda s: to_text(schema, s).encode(), lambda p: dict(kv.split('=', 1) for kv in p.decode().split(' '))),
+        'json': (lambda s: json.dumps(s, separators=(',', ':')).encode(), lambda p: json.loads(p)),
+        'binary': (lambda s: encode(schema, s), lambda p: decode(p, schemas)),
+    }
+
+    report = {'schema': schema['name'], 'samples': count, 'topic': topic, 'forms': {}}
+    for name, (enc, dec) in forms.items():
+        payloads = [enc(s) for s in samples]
+        size = sum(len(p) for p in payloads) / count
+        wire = sum(publish_size(topic, len(p)) for p in payloads) / count
+        entry = {
+            'payload_bytes': round(size, 1),
+            'publish_bytes': round(wire, 1),
+            'encode_per_s': round(rate(enc, samples)),
+        }
+        if dec is not None:
+            entry['decode_per_s'] = round(rate(dec, payloads))
+        report['forms'][name] = entry
+
+    # every binary payload decodes back to its sample
+    for s in samples:
+        _, values = decode(encode(schema, s), schemas)
+        for field in schema['fields']:
+            a, b = values[field['name']], s[field['name']]
+            if field['type'] in ('fixed', 'float'):
+                if not math.isclose(a, b, rel_tol=1e-6, abs_tol=10 ** -field.get('decimals', 6)):
+                    raise AssertionError('{}: {} != {}'.format(field['name'], a, b))
+            elif a != b:
+                raise AssertionError('{}: {} != {}'.format(field['name'], a, b))
+
+    binary = report['forms']['binary']['publish_bytes']
+    for entry in report['forms'].values():
+        entry['publish_vs_binary'] = round(entry['publish_bytes'] / binary, 2)
+    return report
+
+
+def main():
+    parser = argparse.ArgumentParser(description='telemetry payload decoder and size benchmark')
+    parser.add_argument('--schemas', default=DEFAULT_SCHEMAS, help='JSON list of schema descriptions')
+    sub = parser.add_subparsers(dest='command', required=True)
+    dec = sub.add_parser('decode', help='decode hex payloads')
+    dec.add_argument('payloads', nargs='*', help='hex payloads, stdin when none')
+    ben = sub.add_parser('bench', help='compare sizes and rates against the text forms')
+    ben.add_argument('--schema', type=int, default=1, help='schema id')
+    ben.add_argument('--count', type=int, default=1000, help='samples')
+    ben.add_argument('--topic', default='/emanuele_topic/telemetry', help='topic for the PUBLISH size')
+    args = parser.parse_args()
+
+    schemas = load_schemas(args.schemas)
+
+    if args.command == 'decode':
+        failed = False
+        for line in args.payloads or sys.stdin:
+            line = line.strip()
+            if not line:
+                continue
+            try:
+                name, values = decode(bytes.fromhex(line), schemas)
+                print(json.dumps({'schema': name, 'values': values}))
+            except ValueError as e:
+                print('{}: {}'.format(line, e), file=sys.stderr)
+                failed = True
+        sys.exit(1 if failed else 0)
+
+    if args.schema not in schemas:
+        parser.error('unknown schema {}'.format(args.schema))
+    print(json.dumps(bench(schemas[args.schema], schemas, args.count, args.topic), indent=2))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,372 @@
+#!/usr/bin/env python
+#
+# Load generator for the websocket_server / ethernet_websocket apps.
+#
+# Runs the scenarios described by JSON files against a running target
+# (usually the QEMU build reached through a forwarded port) and reports
+# throughput and p50/p99/p999 latency per scenario. With --baseline the run
+# is compared to a previous report and the exit code is non-zero when a
+# scenario regressed by more than the tolerance.
+#
+# Only the standard library is used, the HTTP and WebSocket clients below
+# implement just what the firmware speaks.
+
+import argparse
+import asyncio
+import base64
+import glob
+import json
+import os
+import struct
+import sys
+import time
+
+WS_TEXT = 0x1
+WS_BINARY = 0x2
+WS_CLOSE = 0x8
+WS_PING = 0x9
+WS_PONG = 0xA
+
+
+class BenchError(Exception):
+    pass
+
+
+async def read_headers(reader):
+    head = await reader.readuntil(b'\r\n\r\n')
+    lines = head.decode('latin-1').split('\r\n')
+    status = int(lines[0].split(' ')[1])
+    headers = {}
+    for line in lines[1:]:
+        if ':' in line:
+            key, value = line.split(':', 1)
+            headers[key.strip().lower()] = value.strip()
+    return status, headers
+
+
+class HttpClient:
+    """Keep-alive HTTP/1.1 client, enough for GET with fixed or chunked bodies."""
+
+    def __init__(self, host, port):
+        self.host = host
+        self.port = port
+        self.reader = self.writer = None
+
+    async def connect(self):
+        self.reader, self.writer = await asyncio.open_connection(self.host, self.port)
+
+    async def get(self, path, headers=None):
+        request = 'GET {} HTTP/1.1\r\nHost: {}\r\n'.format(path, self.host)
+        for key, value in (headers or {}).items():
+            request += '{}: {}\r\n'.format(key, value)
+        self.writer.write((request + '\r\n').encode('latin-1'))
+        await self.writer.drain()
+
+        status, resp_headers = await read_headers(self.reader)
+        body = b''
+        if resp_headers.get('transfer-encoding', '').lower() == 'chunked':
+            while True:
+                size = int((await self.reader.readline()).split(b';')[0], 16)
+                chunk = await self.reader.readexactly(size + 2)
+                if size == 0:
+                    break
+                body += chunk[:-2]
+        elif 'content-length' in resp_headers:
+            body = await self.reader.readexactly(int(resp_headers['content-length']))
+        return status, resp_headers, body
+
+    async def close(self):
+        if self.writer is not None:
+            self.writer.close()
+            try:
+                await self.writer.wait_closed()
+            except (ConnectionError, OSError):
+                pass
+
+
+class WsClient:
+    """Minimal RFC 6455 client: masked frames out, unfragmented frames in."""
+
+    def __init__(self, host, port, path='/ws'):
+        self.host = host
+        self.port = port
+        self.path = path
+        self.reader = self.writer = None
+
+    async def connect(self):
+        self.reader, self.writer = await asyncio.open_connection(self.host, self.port)
+        key = base64.b64encode(os.urandom(16)).decode('ascii')
+        self.writer.write(('GET {} HTTP/1.1\r\nHost: {}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                           'Sec-WebSocket-Key: {}\r\nSec-WebSocket-Version: 13\r\n\r\n')
+                          .format(self.path, self.host, key).encode('latin-1'))
+        await self.writer.drain()
+        status, _ = await read_headers(self.reader)
+        if status != 101:
+            raise BenchError('websocket handshake failed with {}'.format(status))
+
+    async def send(self, payload, opcode=WS_TEXT):
+        if isinstance(payload, str):
+            payload = payload.encode('utf-8')
+        header = bytes([0x80 | opcode])
+        length = len(payload)
+        if length < 126:
+            header += bytes([0x80 | length])
+        elif length < 65536:
+            header += bytes([0x80 | 126]) + struct.pack('>H', length)
+        else:
+            header += bytes([0x80 | 127]) + struct.pack('>Q', length)
+        mask = os.urandom(4)
+        masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+        self.writer.write(header + mask + masked)
+        await self.writer.drain()
+
+    async def recv(self):
+        """Returns (opcode, payload) of the next data frame, answering pings."""
+        while True:
+            b0, b1 = await self.reader.readexactly(2)
+            opcode = b0 & 0x0F
+            length = b1 & 0x7F
+            if length == 126:
+                length = struct.unpack('>H', await self.reader.readexactly(2))[0]
+            elif length == 127:
+                length = struct.unpack('>Q', await self.reader.readexactly(8))[0]
+            mask = await self.reader.readexactly(4) if b1 & 0x80 else None
+            payload = await self.reader.readexactly(length)
+            if mask:
+                payload = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+
+            if opcode == WS_PING:
+                await self.send(payload, WS_PONG)
+            elif opcode == WS_CLOSE:
+                raise BenchError('server closed the websocket')
+            elif opcode in (WS_TEXT, WS_BINARY):
+                return opcode, payload
+
+    async def close(self):
+        if self.writer is None:
+            return
+        try:
+            await self.send(b'\x03\xe8', WS_CLOSE)
+        except (ConnectionError, OSError):
+            pass
+        self.writer.close()
+        try:
+            await self.writer.wait_closed()
+        except (ConnectionError, OSError):
+            pass
+
+
+class Recorder:
+    def __init__(self):
+        self.latencies = []
+        self.errors = 0
+        self.ops = 0
+        self.start = time.monotonic()
+
+    def add(self, seconds):
+        self.latencies.append(seconds)
+        self.ops += 1
+
+    def report(self, unit):
+        elapsed = time.monotonic() - self.start
+        lat = sorted(self.latencies)
+
+        def pct(p):
+            if not lat:
+                return None
+            return round(lat[min(len(lat) - 1, int(p * len(lat)))] * 1000.0, 3)
+
+        return {
+            'ops': self.ops,
+            'errors': self.errors,
+            'elapsed_s': round(elapsed, 3),
+            'throughput': round(self.ops / elapsed, 2) if elapsed > 0 else 0.0,
+            'unit': unit,
+            'latency_ms': {'p50': pct(0.50), 'p99': pct(0.99), 'p999': pct(0.999)},
+        }
+
+
+def scenario_message(sc):
+    """(payload, opcode) to send: `message_hex` as a binary frame, else `message` as text."""
+    if 'message_hex' in sc:
+        return bytes.fromhex(sc['message_hex']), WS_BINARY
+    return sc.get('message', ''), WS_TEXT
+
+
+async def scenario_http_get(target, sc):
+    """Keep-alive GET loops on `connections` sockets for `duration_s`."""
+    rec = Recorder()
+    deadline = time.monotonic() + sc.get('duration_s', 10)
+    headers = sc.get('headers', {})
+
+    async def worker():
+        client = HttpClient(*target)
+        try:
+            await client.connect()
+            while time.monotonic() < deadline:
+                t0 = time.perf_counter()
+                status, _, _ = await client.get(sc.get('path', '/'), headers)
+                if status not in (200, 304):
+                    rec.errors += 1
+                    continue
+                rec.add(time.perf_counter() - t0)
+        except (BenchError, ConnectionError, OSError, asyncio.IncompleteReadError):
+            rec.errors += 1
+        finally:
+            await client.close()
+
+    await asyncio.gather(*(worker() for _ in range(sc.get('connections', 1))))
+    return rec.report('req/s')
+
+
+async def scenario_ws_roundtrip(target, sc):
+    """One client sends the message and waits for the broadcast, `count` times."""
+    rec = Recorder()
+    payload, opcode = scenario_message(sc)
+    client = WsClient(*target)
+    await client.connect()
+    try:
+        for _ in range(sc.get('count', 100)):
+            t0 = time.perf_counter()
+            await client.send(payload, opcode)
+            await asyncio.wait_for(client.recv(), sc.get('timeout_s', 2))
+            rec.add(time.perf_counter() - t0)
+    except (asyncio.TimeoutError, BenchError, ConnectionError, asyncio.IncompleteReadError):
+        rec.errors += 1
+    finally:
+        await client.close()
+    return rec.report('rtt/s')
+
+
+async def scenario_ws_fanout(target, sc):
+    """`clients` listeners, the first one also sends; latency is send to each delivery."""
+    rec = Recorder()
+    payload, opcode = scenario_message(sc)
+    clients = [WsClient(*target) for _ in range(sc.get('clients', 4))]
+    for client in clients:
+        await client.connect()
+
+    try:
+        for _ in range(sc.get('count', 100)):
+            t0 = time.perf_counter()
+            await clients[0].send(payload, opcode)
+
+            async def deliver(client):
+                await client.recv()
+                rec.add(time.perf_counter() - t0)
+
+            results = await asyncio.gather(
+                *(asyncio.wait_for(deliver(c), sc.get('timeout_s', 2)) for c in clients),
+                return_exceptions=True)
+            rec.errors += sum(1 for r in results if isinstance(r, Exception))
+    finally:
+        for client in clients:
+            await client.close()
+    return rec.report('deliveries/s')
+
+
+async def scenario_churn(target, sc):
+    """Open a websocket, handshake and close it, on `connections` loops."""
+    rec = Recorder()
+    deadline = time.monotonic() + sc.get('duration_s', 10)
+
+    async def worker():
+        while time.monotonic() < deadline:
+            client = WsClient(*target)
+            t0 = time.perf_counter()
+            try:
+                await asyncio.wait_for(client.connect(), sc.get('timeout_s', 2))
+                rec.add(time.perf_counter() - t0)
+            except (asyncio.TimeoutError, BenchError, ConnectionError, OSError, asyncio.IncompleteReadError):
+                rec.errors += 1
+            finally:
+                await client.close()
+
+    await asyncio.gather(*(worker() for _ in range(sc.get('connections', 1))))
+    return rec.report('conn/s')
+
+
+SCENARIOS = {
+    'http_get': scenario_http_get,
+    'ws_roundtrip': scenario_ws_roundtrip,
+    'ws_fanout': scenario_ws_fanout,
+    'churn': scenario_churn,
+}
+
+
+def load_scenarios(paths):
+    scenarios = []
+    for path in paths:
+        files = sorted(glob.glob(os.path.join(path, '*.json'))) if os.path.isdir(path) else [path]
+        for name in files:
+            with open(name) as f:
+                sc = json.load(f)
+            sc.setdefault('name', os.path.splitext(os.path.basename(name))[0])
+            if sc.get('type') not in SCENARIOS:
+                raise BenchError('{}: unknown scenario type {}'.format(name, sc.get('type')))
+            scenarios.append(sc)
+    return scenarios
+
+
+def run_scenarios(scenarios, host, port):
+    results = {}
+    for sc in scenarios:
+        print('running {} ({})'.format(sc['name'], sc['type']), file=sys.stderr)
+        try:
+            results[sc['name']] = asyncio.run(SCENARIOS[sc['type']]((host, port), sc))
+        except (BenchError, ConnectionError, OSError, asyncio.IncompleteReadError) as e:
+            results[sc['name']] = {'failed': str(e)}
+    return results
+
+
+def compare(results, baseline, tolerance):
+    """Returns the list of regressions of results against baseline."""
+    regressions = []
+    for name, base in baseline.items():
+        cur = results.get(name)
+        if cur is None or 'failed' in base:
+            continue
+        if 'failed' in cur:
+            regressions.append('{}: failed ({})'.format(name, cur['failed']))
+            continue
+        if cur['throughput'] < base['throughput'] * (1 - tolerance):
+            regressions.append('{}: throughput {} < {} {}'.format(
+                name, cur['throughput'], base['throughput'], cur['unit']))
+        for p in ('p50', 'p99'):
+            b, c = base['latency_ms'].get(p), cur['latency_ms'].get(p)
+            if b is not None and c is not None and c > b * (1 + tolerance):
+                regressions.append('{}: {} latency {} ms > {} ms'.format(name, p, c, b))
+        if cur['errors'] > base['errors']:
+            regressions.append('{}: {} errors, baseline had {}'.format(name, cur['errors'], base['errors']))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='HTTP/WebSocket load generator for the web server apps')
+    parser.add_argument('scenarios', nargs='*',
+                        default=[os.path.join(os.path.dirname(os.path.abspath(__file__)), 'scenarios')],
+                        help='scenario files or directories (default: bench/scenarios)')
+    parser.add_argument('--target', default='localhost:8080', help='host:port of the server')
+    parser.add_argument('--output', help='write the JSON report here')
+    parser.add_argument('--baseline', help='report to compare against')
+    parser.add_argument('--tolerance', type=float, default=0.2, help='allowed relative regression')
+    args = parser.parse_args()
+
+    host, port = args.target.rsplit(':', 1)
+    results = run_scenarios(load_scenarios(args.scenarios), host, int(port))
+    report = json.dumps(results, indent=2, sort_keys=True)
+    print(report)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report + '\n')
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        for line in regressions:
+            print('REGRESSION ' + line, file=sys.stderr)
+        sys.exit(1 if regressions else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,127 @@
+/*
+ * boot_prof.c
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "boot_prof.h"
+
+typedef struct
+{
+    const char *name;
+    int64_t start_us;
+    int64_t end_us; // -1 while open
+} boot_prof_span_t;
+
+static boot_prof_span_t spans[BOOT_PROF_MAX_SPANS];
+static int span_count;
+static portMUX_TYPE spans_lock = portMUX_INITIALIZER_UNLOCKED;
+
+int boot_prof_begin(const char *name)
+{
+    int64_t now_us = esp_timer_get_time();
+    int span = -1;
+
+    taskENTER_CRITICAL(&spans_lock);
+    if (span_count < BOOT_PROF_MAX_SPANS)
+    {
+        span = span_count++;
+        spans[span].name = name;
+        spans[span].start_us = now_us;
+        spans[span].end_us = -1;
+    }
+    taskEXIT_CRITICAL(&spans_lock);
+    return span;
+}
+
+void boot_prof_end(int span)
+{
+    if (span >= 0)
+    {
+        spans[span].end_us = esp_timer_get_time();
+    }
+}
+
+void boot_prof_mark(const char *name)
+{
+    int span = boot_prof_begin(name);
+    if (span >= 0)
+    {
+        spans[span].end_us = spans[span].start_us;
+    }
+}
+
+static const char *boot_prof_reset_reason(void)
+{
+    switch (esp_reset_reason())
+    {
+    case ESP_RST_POWERON:
+        return "poweron";
+    case ESP_RST_SW:
+        return "sw";
+    case ESP_RST_PANIC:
+        return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+        return "wdt";
+    case ESP_RST_DEEPSLEEP:
+        return "deepsleep";
+    case ESP_RST_BROWNOUT:
+        return "brownout";
+    default:
+        return "other";
+    }
+}
+
+// writes entry i of the JSON document: the header for -1, then one span each
+static int boot_prof_json_entry(int i, int count, char *buf, size_t len)
+{
+    if (i < 0)
+    {
+        return snprintf(buf, len, "{\"reset\":\"%s\",\"spans\":[", boot_prof_reset_reason());
+    }
+    // a snapshot, the span may be closed while we print it
+    boot_prof_span_t span = spans[i];
+    return snprintf(buf, len, "{\"name\":\"%s\",\"start_us\":%" PRId64 ",\"end_us\":%" PRId64 "}%s", span.name,
+                    span.start_us, span.end_us, i + 1 < count ? "," : "]}");
+}
+
+void boot_prof_dump(void)
+{
+    char buf[96];
+    int count = span_count;
+
+    printf("BOOT_PROF ");
+    for (int i = -1; i < count; i++)
+    {
+        boot_prof_json_entry(i, count, buf, sizeof(buf));
+        fputs(buf, stdout);
+    }
+    if (count == 0)
+    {
+        fputs("]}", stdout);
+    }
+    fputs("\n", stdout);
+}
+
+esp_err_t boot_prof_handler(httpd_req_t *req)
+{
+    char buf[96];
+    int count = span_count;
+
+    httpd_resp_set_type(req, "application/json");
+    for (int i = -1; i < count; i++)
+    {
+        boot_prof_json_entry(i, count, buf, sizeof(buf));
+        httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    }
+    if (count == 0)
+    {
+        httpd_resp_send_chunk(req, "]}", HTTPD_RESP_USE_STRLEN);
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
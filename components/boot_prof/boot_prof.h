@@ -0,0 +1,43 @@
+/*
+ * boot_prof.h
+ *
+ * Boot phase profiler. Named spans are timestamped with esp_timer_get_time,
+ * microseconds since the app started, into a static table of
+ * BOOT_PROF_MAX_SPANS entries, so recording costs no allocation and is safe
+ * from any task. The table is printed as one JSON line, prefixed with
+ * BOOT_PROF, for the QEMU gate in bench/boot_prof.py, and served as JSON by
+ * boot_prof_handler. The reset reason goes with it, a boot after an OTA
+ * restart reads "sw".
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+#define BOOT_PROF_MAX_SPANS 32
+
+/**
+ * Opens a span. name must be a string literal, or live as long.
+ *
+ * @return the span for boot_prof_end, -1 when the table is full.
+ */
+int boot_prof_begin(const char *name);
+
+void boot_prof_end(int span);
+
+/**
+ * Records an instant, a span that ends where it begins.
+ */
+void boot_prof_mark(const char *name);
+
+/**
+ * Prints the table on the console as a single BOOT_PROF {...} line.
+ */
+void boot_prof_dump(void);
+
+/**
+ * Uri handler serving the table as JSON.
+ */
+esp_err_t boot_prof_handler(httpd_req_t *req);
@@ -0,0 +1,393 @@
+/*
+ * delta_ota.c
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "rom/miniz.h"
+#include "delta_ota.h"
+
+#define DELTA_OTA_MAGIC "DLTA"
+#define DELTA_OTA_VERSION 1
+#define INFLATE_FLAGS (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_COMPUTE_ADLER32)
+
+static const char *TAG = "delta_ota";
+
+/** Patch header, see delta_ota.py */
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t base_size;
+    uint32_t target_size;
+    uint8_t base_sha256[32];
+    uint8_t target_sha256[32];
+} delta_ota_header_t;
+
+_Static_assert(sizeof(delta_ota_header_t) == 80, "delta_ota_header_t must match the patch header layout");
+
+struct delta_ota
+{
+    const esp_partition_t *base;   // running
+    const esp_partition_t *target; // written
+    esp_ota_handle_t ota;
+    bool ota_started;
+    mbedtls_sha256_context sha; // of the image written
+    int64_t start_us;
+    size_t patch_len;
+    esp_err_t err;
+
+    delta_ota_header_t header;
+    size_t header_len;
+
+    tinfl_decompressor inflator;
+    uint8_t window[TINFL_LZ_DICT_SIZE]; // inflated records, wrapping
+    size_t window_pos;
+    bool inflated; // the zlib stream ended
+
+    uint8_t record[12]; // u32 diff_len, u32 extra_len, i32 seek
+    size_t record_len;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+    uint32_t pos;     // in the base
+    uint32_t written; // image bytes produced
+
+    uint8_t block[DELTA_OTA_BLOCK_SIZE];
+    size_t block_len;
+};
+
+esp_err_t delta_ota_begin(delta_ota_handle_t *handle)
+{
+    const esp_partition_t *base = esp_ota_get_running_partition();
+    const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+    if (base == NULL || target == NULL)
+    {
+        ESP_LOGE(TAG, "no OTA partition to update");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct delta_ota *d = calloc(1, sizeof(*d));
+    if (d == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    d->base = base;
+    d->target = target;
+    d->start_us = esp_timer_get_time();
+    mbedtls_sha256_init(&d->sha);
+    tinfl_init(&d->inflator);
+
+    ESP_LOGI(TAG, "patching %s into %s", base->label, target->label);
+    *handle = d;
+    return ESP_OK;
+}
+
+// checks the patch is for the running image, then starts writing the next one
+static esp_err_t delta_ota_start(struct delta_ota *d)
+{
+    const delta_ota_header_t *h = &d->header;
+    if (memcmp(h->magic, DELTA_OTA_MAGIC, sizeof(h->magic)) != 0 || h->version != DELTA_OTA_VERSION)
+    {
+        ESP_LOGE(TAG, "not a version %d patch", DELTA_OTA_VERSION);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (h->base_size > d->base->size)
+    {
+        ESP_LOGE(TAG, "patch for a %" PRIu32 " byte image, %s holds %" PRIu32, h->base_size, d->base->label,
+                 d->base->size);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (h->target_size > d->target->size)
+    {
+        ESP_LOGE(TAG, "%" PRIu32 " byte image does not fit %s", h->target_size, d->target->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // the block is free until the records start, hash the base through it
+    mbedtls_sha256_starts(&d->sha, 0);
+    for (uint32_t offset = 0; offset < h->base_size; offset += sizeof(d->block))
+    {
+        size_t n = h->base_size - offset < sizeof(d->block) ? h->base_size - offset : sizeof(d->block);
+        esp_err_t err = esp_partition_read(d->base, offset, d->block, n);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        mbedtls_sha256_update(&d->sha, d->block, n);
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&d->sha, sha256);
+    if (memcmp(sha256, h->base_sha256, sizeof(sha256)) != 0)
+    {
+        ESP_LOGE(TAG, "patch is for another image than the one in %s", d->base->label);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    esp_err_t err = esp_ota_begin(d->target, OTA_WITH_SEQUENTIAL_WRITES, &d->ota);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    d->ota_started = true;
+    mbedtls_sha256_starts(&d->sha, 0);
+    return ESP_OK;
+}
+
+static esp_err_t delta_ota_flush(struct delta_ota *d)
+{
+    if (d->block_len == 0)
+    {
+        return ESP_OK;
+    }
+    mbedtls_sha256_update(&d->sha, d->block, d->block_len);
+    esp_err_t err = esp_ota_write(d->ota, d->block, d->block_len);
+    d->block_len = 0;
+    return err;
+}
+
+static esp_err_t delta_ota_record(struct delta_ota *d)
+{
+    memcpy(&d->diff_left, d->record, 4);
+    memcpy(&d->extra_left, d->record + 4, 4);
+    memcpy(&d->seek, d->record + 8, 4);
+
+    int64_t next = (int64_t)d->pos + d->diff_left + d->seek;
+    if ((uint64_t)d->pos + d->diff_left > d->header.base_size || next < 0 || next > d->header.base_size ||
+        (uint64_t)d->written + d->diff_left + d->extra_left > d->header.target_size)
+    {
+        ESP_LOGE(TAG, "record out of bounds at image offset %" PRIu32, d->written);
+        return ESP_FAIL;
+    }
+    if (d->diff_left == 0)
+    {
+        d->pos = next;
+    }
+    return ESP_OK;
+}
+
+// runs the inflated records
+static esp_err_t delta_ota_apply(struct delta_ota *d, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n;
+        if (d->diff_left == 0 && d->extra_left == 0)
+        {
+            if (d->written == d->header.target_size)
+            {
+                ESP_LOGE(TAG, "records past the end of the image");
+                return ESP_FAIL;
+            }
+            n = sizeof(d->record) - d->record_len < len ? sizeof(d->record) - d->record_len : len;
+            memcpy(d->record + d->record_len, data, n);
+            d->record_len += n;
+            data += n;
+            len -= n;
+            if (d->record_len < sizeof(d->record))
+            {
+                break;
+            }
+            d->record_len = 0;
+            esp_err_t err = delta_ota_record(d);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            continue;
+        }
+
+        uint8_t *out = d->block + d->block_len;
+        n = sizeof(d->block) - d->block_len;
+        if (n > len)
+        {
+            n = len;
+        }
+        if (d->diff_left > 0)
+        {
+            // the base bytes go straight into the block, the diff is added in place
+            if (n > d->diff_left)
+            {
+                n = d->diff_left;
+            }
+            esp_err_t err = esp_partition_read(d->base, d->pos, out, n);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                out[i] += data[i];
+            }
+            d->pos += n;
+            d->diff_left -= n;
+            if (d->diff_left == 0)
+            {
+                d->pos += d->seek;
+            }
+        }
+        else
+        {
+            if (n > d->extra_left)
+            {
+                n = d->extra_left;
+            }
+            memcpy(out, data, n);
+            d->extra_left -= n;
+        }
+        data += n;
+        len -= n;
+        d->written += n;
+        d->block_len += n;
+        if (d->block_len == sizeof(d->block))
+        {
+            esp_err_t err = delta_ota_flush(d);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t delta_ota_inflate(struct delta_ota *d, const uint8_t *data, size_t len)
+{
+    if (d->inflated)
+    {
+        ESP_LOGE(TAG, "data after the end of the patch");
+        return ESP_FAIL;
+    }
+
+    while (true)
+    {
+        size_t in = len;
+        size_t out = sizeof(d->window) - d->window_pos;
+        tinfl_status status = tinfl_decompress(&d->inflator, data, &in, d->window, d->window + d->window_pos, &out,
+                                               INFLATE_FLAGS);
+        data += in;
+        len -= in;
+
+        esp_err_t err = delta_ota_apply(d, d->window + d->window_pos, out);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        d->window_pos = (d->window_pos + out) & (sizeof(d->window) - 1);
+
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "cannot inflate the patch: %d", (int)status);
+            return ESP_FAIL;
+        }
+        if (status == TINFL_STATUS_DONE)
+        {
+            d->inflated = true;
+            if (len > 0)
+            {
+                ESP_LOGE(TAG, "data after the end of the patch");
+                return ESP_FAIL;
+            }
+            return ESP_OK;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0)
+        {
+            return ESP_OK;
+        }
+    }
+}
+
+esp_err_t delta_ota_write(delta_ota_handle_t d, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    if (d->err != ESP_OK)
+    {
+        return d->err;
+    }
+    d->patch_len += len;
+
+    if (d->header_len < sizeof(d->header))
+    {
+        size_t n = sizeof(d->header) - d->header_len < len ? sizeof(d->header) - d->header_len : len;
+        memcpy((uint8_t *)&d->header + d->header_len, bytes, n);
+        d->header_len += n;
+        bytes += n;
+        len -= n;
+        if (d->header_len < sizeof(d->header))
+        {
+            return ESP_OK;
+        }
+        d->err = delta_ota_start(d);
+        if (d->err != ESP_OK)
+        {
+            return d->err;
+        }
+    }
+
+    if (len > 0)
+    {
+        d->err = delta_ota_inflate(d, bytes, len);
+    }
+    return d->err;
+}
+
+esp_err_t delta_ota_end(delta_ota_handle_t d)
+{
+    esp_err_t err = d->err;
+    if (err == ESP_OK && (!d->inflated || d->written != d->header.target_size || d->record_len > 0 ||
+                          d->diff_left > 0 || d->extra_left > 0))
+    {
+        ESP_LOGE(TAG, "patch ended early, %" PRIu32 " of %" PRIu32 " bytes of the image", d->written,
+                 d->header_len == sizeof(d->header) ? d->header.target_size : 0);
+        err = ESP_FAIL;
+    }
+    if (err == ESP_OK)
+    {
+        err = delta_ota_flush(d);
+    }
+    if (err == ESP_OK)
+    {
+        uint8_t sha256[32];
+        mbedtls_sha256_finish(&d->sha, sha256);
+        if (memcmp(sha256, d->header.target_sha256, sizeof(sha256)) != 0)
+        {
+            ESP_LOGE(TAG, "image differs from the target of the patch");
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    if (err == ESP_OK)
+    {
+        // validates the image, and releases the handle either way
+        d->ota_started = false;
+        err = esp_ota_end(d->ota);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_ota_set_boot_partition(d->target);
+    }
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(TAG, "%u byte patch applied, %" PRIu32 " byte image in %s in %" PRId64 " ms", (unsigned)d->patch_len,
+                 d->written, d->target->label, (esp_timer_get_time() - d->start_us) / 1000);
+    }
+    delta_ota_abort(d);
+    return err;
+}
+
+void delta_ota_abort(delta_ota_handle_t d)
+{
+    if (d->ota_started)
+    {
+        esp_ota_abort(d->ota);
+    }
+    mbedtls_sha256_free(&d->sha);
+    free(d);
+}
@@ -0,0 +1,51 @@
+/*
+ * delta_ota.h
+ *
+ * Updates the firmware from a binary patch built by delta_ota.py against the
+ * running image, instead of downloading the whole new image. The patch is
+ * applied as it is downloaded: inflated with the tinfl decoder in ROM, its
+ * records read the running partition and write the rebuilt image to the next
+ * OTA partition, ota_0 or ota_1. Neither the patch nor the image is held in
+ * RAM, an update takes the 32 KB inflate window and a write block.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+
+// bytes written to flash at once
+#define DELTA_OTA_BLOCK_SIZE 4096
+
+typedef struct delta_ota *delta_ota_handle_t;
+
+/**
+ * Starts an update of the running image. Allocates the update state, about
+ * 48 KB, until delta_ota_end or delta_ota_abort.
+ */
+esp_err_t delta_ota_begin(delta_ota_handle_t *handle);
+
+/**
+ * Applies the next len bytes of the patch.
+ *
+ * @return ESP_ERR_INVALID_VERSION when the patch is for another image than
+ *         the running one, ESP_ERR_NOT_SUPPORTED when it is not a patch,
+ *         ESP_ERR_INVALID_SIZE when the image does not fit the partition,
+ *         ESP_FAIL when it is corrupt. Later calls return the same error.
+ */
+esp_err_t delta_ota_write(delta_ota_handle_t handle, const void *data, size_t len);
+
+/**
+ * Checks that the whole patch was applied and rebuilt its image, then sets
+ * the image to boot on the next restart. The handle is freed, also on error.
+ *
+ * @return the error of delta_ota_write, ESP_ERR_INVALID_CRC when the image
+ *         differs from the one the patch was built for, or the error of
+ *         esp_ota_end.
+ */
+esp_err_t delta_ota_end(delta_ota_handle_t handle);
+
+/**
+ * Drops the update, the partition being written is left invalid.
+ */
+void delta_ota_abort(delta_ota_handle_t handle);
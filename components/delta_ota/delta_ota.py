@@ -0,0 +1,256 @@
+#!/usr/bin/env python
+#
+# Builds the binary patches applied by the delta_ota component.
+#
+# A patch turns the image the device runs (the base) into the next one (the
+# target). Rebuilding firmware moves code and data around, which changes
+# every address that points across the move: the bytes differ, but mostly
+# by the same small amounts. As in bsdiff, the target is described as
+# regions of the base, stored as the bytewise difference to them, which is
+# mostly zeros, and literal bytes in between:
+#
+#   header   magic "DLTA", u16 version, u16 reserved,
+#            u32 base_size, u32 target_size,
+#            base_sha256[32], target_sha256[32]
+#   body     zlib stream of records until target_size bytes are produced:
+#            u32 diff_len, u32 extra_len, i32 seek
+#            diff_len bytes, target = base[pos + i] + diff[i] mod 256
+#            extra_len bytes copied to the target as they are
+#            then pos += diff_len + seek
+#
+# pos starts at 0. Little endian. The zlib stream is inflated on the device
+# with the tinfl decoder in ROM, into its 32 KB window.
+#
+# diff writes a patch and checks it by applying it, apply applies one and
+# manifest adds it to the OTA manifest, keyed by the base version:
+#
+#   "patches": {"1": {"uri": "...", "size": 12345}}
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import zlib
+
+MAGIC = b'DLTA'
+VERSION = 1
+HEADER = struct.Struct('<4sHHII32s32s')
+RECORD = struct.Struct('<IIi')
+
+SEED = 8         # bytes hashed to find match candidates
+STRIDE = 4       # base positions indexed, every STRIDE bytes
+MIN_MATCH = 24   # exact bytes a region starts from
+GIVE_UP = 32     # an approximate region ends once its score falls this far
+
+
+def build_index(base):
+    index = {}
+    for i in range(0, len(base) - SEED + 1, STRIDE):
+        index.setdefault(base[i:i + SEED], i)
+    return index
+
+
+def exact_len(base, pos, target, start, limit):
+    """Length of the common prefix of base[pos:] and target[start:limit]."""
+    n = min(limit - start, len(base) - pos)
+    step = 64
+    length = 0
+    while length < n:
+        k = min(step, n - length)
+        if base[pos + length:pos + length + k] == target[start + length:start + length + k]:
+            length += k
+            step *= 2
+            continue
+        if k == 1:
+            break
+        step = k // 2
+    return length
+
+
+def extend(base, pos, target, start, limit, direction):
+    """Bytes a region can grow by from base[pos] and target[start] in direction.
+
+    Like bsdiff, a region keeps the length where twice its matching bytes
+    minus its length peaks, so it runs through short differences between
+    mostly identical bytes.
+    """
+    score = best_score = best = 0
+    i = 0
+    while True:
+        p, t = pos + i * direction, start + i * direction
+        if direction < 0:
+            p, t = p - 1, t - 1
+        if p < 0 or p >= len(base) or t < limit[0] or t >= limit[1]:
+            break
+        i += 1
+        score += 1 if base[p] == target[t] else -1
+        if score > best_score:
+            best_score, best = score, i
+        elif score < best_score - GIVE_UP:
+            break
+    return best
+
+
+def find_regions(base, target):
+    """(target_start, base_start, length) of the base regions the target is made of."""
+    index = build_index(base)
+    regions = []
+    done = 0     # target bytes covered by regions
+    delta = 0    # base - target offset of the last region
+    t = 0
+    while t + SEED <= len(target):
+        # a region in line with the last one saves a seek, try it first
+        candidates = [t + delta] if 0 <= t + delta < len(base) else []
+        p = index.get(target[t:t + SEED])
+        if p is not None:
+            candidates.append(p)
+
+        best = None
+        for p in candidates:
+            back = 0
+            while back < min(p, t - done) and base[p - back - 1] == target[t - back - 1]:
+                back += 1
+            length = back + exact_len(base, p, target, t, len(target))
+            if length >= MIN_MATCH and (best is None or length > best[2]):
+                best = (t - back, p - back, length)
+        if best is None:
+            t += 1
+            continue
+
+        start, pos, length = best
+        grow = extend(base, pos, target, start, (done, len(target)), -1)
+        start, pos, length = start - grow, pos - grow, length + grow
+        length += extend(base, pos + length, target, start + length, (0, len(target)), 1)
+        regions.append((start, pos, length))
+        done = t = start + length
+        delta = pos - start
+    return regions
+
+
+def make_records(base, target, regions):
+    body = bytearray()
+    pos = 0
+    # target bytes before the first region, and the seek to it, go in a
+    # record with no diff
+    first, seek = regions[0][:2] if regions else (len(target), 0)
+    if first > 0 or seek > 0:
+        body += RECORD.pack(0, first, seek)
+        body += target[:first]
+        pos = seek
+    for i, (start, base_start, length) in enumerate(regions):
+        end = start + length
+        next_start, next_pos = regions[i + 1][:2] if i + 1 < len(regions) else (len(target), base_start + length)
+        assert pos == base_start
+        body += RECORD.pack(length, next_start - end, next_pos - (base_start + length))
+        body += bytes((target[start + j] - base[base_start + j]) & 0xff for j in range(length))
+        body += target[end:next_start]
+        pos = next_pos
+    return bytes(body)
+
+
+def diff(base, target, level=9):
+    records = make_records(base, target, find_regions(base, target))
+    header = HEADER.pack(MAGIC, VERSION, 0, len(base), len(target),
+                         hashlib.sha256(base).digest(), hashlib.sha256(target).digest())
+    return header + zlib.compress(records, level)
+
+
+def apply(base, patch):
+    """Reference implementation of what the device does, raises ValueError on a bad patch."""
+    if len(patch) < HEADER.size:
+        raise ValueError('patch too short')
+    magic, version, _, base_size, target_size, base_sha, target_sha = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('not a version {} patch'.format(VERSION))
+    if base_size > len(base) or hashlib.sha256(base[:base_size]).digest() != base_sha:
+        raise ValueError('patch is for another base image')
+
+    records = zlib.decompress(patch[HEADER.size:])
+    target = bytearray()
+    pos = i = 0
+    while len(target) < target_size:
+        diff_len, extra_len, seek = RECORD.unpack_from(records, i)
+        i += RECORD.size
+        if pos + diff_len > base_size or len(target) + diff_len + extra_len > target_size:
+            raise ValueError('record out of bounds')
+        target += bytes((base[pos + j] + records[i + j]) & 0xff for j in range(diff_len))
+        i += diff_len
+        target += records[i:i + extra_len]
+        i += extra_len
+        pos += diff_len + seek
+        if not 0 <= pos <= base_size:
+            raise ValueError('seek out of the base')
+    if i != len(records) or hashlib.sha256(target).digest() != target_sha:
+        raise ValueError('patch does not produce its target')
+    return bytes(target)
+
+
+def read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def cmd_diff(args):
+    base, target = read(args.base), read(args.target)
+    patch = diff(base, target)
+    if apply(base, patch) != target:
+        sys.exit('patch does not reproduce the target')
+    with open(args.patch, 'wb') as f:
+        f.write(patch)
+    full = len(zlib.compress(target, 9))
+    print('patch: {} bytes, image {} bytes ({} compressed), {:.1f}x smaller than the image'.format(
+        len(patch), len(target), full, len(target) / len(patch)))
+
+
+def cmd_apply(args):
+    try:
+        target = apply(read(args.base), read(args.patch))
+    except (ValueError, struct.error, zlib.error) as e:
+        sys.exit('{}: {}'.format(args.patch, e))
+    with open(args.target, 'wb') as f:
+        f.write(target)
+    print('target: {} bytes'.format(len(target)))
+
+
+def cmd_manifest(args):
+    with open(args.manifest) as f:
+        manifest = json.load(f)
+    manifest.setdefault('patches', {})[str(args.base_version)] = {
+        'uri': args.uri,
+        'size': len(read(args.patch)),
+    }
+    with open(args.manifest, 'w') as f:
+        json.dump(manifest, f, indent='\t')
+        f.write('\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build and apply delta OTA patches')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('diff', help='write the patch from base to target')
+    p.add_argument('base', help='image the devices run')
+    p.add_argument('target', help='image to update them to')
+    p.add_argument('patch', help='patch to write')
+    p.set_defaults(run=cmd_diff)
+
+    p = sub.add_parser('apply', help='rebuild the target from base and patch')
+    p.add_argument('base')
+    p.add_argument('patch')
+    p.add_argument('target', help='image to write')
+    p.set_defaults(run=cmd_apply)
+
+    p = sub.add_parser('manifest', help='advertise the patch in the OTA manifest')
+    p.add_argument('manifest', help='e.g. ota_folder/ota_fw_version.json')
+    p.add_argument('patch')
+    p.add_argument('--base-version', type=int, required=True, help='firmware version the patch applies to')
+    p.add_argument('--uri', required=True, help='where the devices download the patch')
+    p.set_defaults(run=cmd_manifest)
+
+    args = parser.parse_args()
+    args.run(args)
+
+
+if __name__ == '__main__':
+    main()
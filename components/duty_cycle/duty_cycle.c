@@ -0,0 +1,268 @@
+/*
+ * duty_cycle.c
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "duty_cycle.h"
+
+#define DUTY_CYCLE_MAGIC 0x44435931 // "DCY1"
+#define PERIOD_US (CONFIG_DUTY_CYCLE_PERIOD_S * 1000000ULL)
+// a wake due sooner than this is skipped rather than slept for
+#define MIN_SLEEP_US 100000ULL
+
+static const char *TAG = "duty_cycle";
+
+typedef struct __attribute__((packed))
+{
+    uint16_t len;
+    uint32_t time_s; // duty_cycle_time_ms / 1000 when taken
+} duty_cycle_record_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint64_t next_wake_us; // on the RTC clock, 0 until the first sleep
+    uint16_t used;         // bytes of buffer
+    uint16_t count;        // records in it
+    uint16_t failures;     // sessions in a row that delivered nothing
+    uint32_t retry_s;      // no session before this, after a failure
+    duty_cycle_stats_t stats;
+    uint8_t buffer[CONFIG_DUTY_CYCLE_BUFFER_SIZE];
+} duty_cycle_rtc_t;
+
+// RTC slow memory, kept through deep sleep
+static RTC_DATA_ATTR duty_cycle_rtc_t rtc;
+
+static duty_cycle_wake_t wake;
+static int64_t radio_start_us;
+
+static uint64_t duty_cycle_time_us(void)
+{
+    // gettimeofday runs on the RTC clock, which keeps counting in deep sleep
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+uint64_t duty_cycle_time_ms(void)
+{
+    return duty_cycle_time_us() / 1000;
+}
+
+static duty_cycle_record_t *duty_cycle_record(size_t i)
+{
+    size_t off = 0;
+    while (i-- > 0)
+    {
+        off += sizeof(duty_cycle_record_t) + ((duty_cycle_record_t *)(rtc.buffer + off))->len;
+    }
+    return (duty_cycle_record_t *)(rtc.buffer + off);
+}
+
+static void duty_cycle_remove(size_t n)
+{
+    if (n >= rtc.count)
+    {
+        rtc.used = 0;
+        rtc.count = 0;
+        return;
+    }
+    size_t off = (uint8_t *)duty_cycle_record(n) - rtc.buffer;
+    memmove(rtc.buffer, rtc.buffer + off, rtc.used - off);
+    rtc.used -= off;
+    rtc.count -= n;
+}
+
+static bool duty_cycle_valid(void)
+{
+    if (rtc.magic != DUTY_CYCLE_MAGIC || rtc.used > sizeof(rtc.buffer))
+    {
+        return false;
+    }
+    size_t off = 0;
+    for (size_t i = 0; i < rtc.count; i++)
+    {
+        if (off + sizeof(duty_cycle_record_t) > rtc.used)
+        {
+            return false;
+        }
+        off += sizeof(duty_cycle_record_t) + ((duty_cycle_record_t *)(rtc.buffer + off))->len;
+    }
+    return off == rtc.used;
+}
+
+duty_cycle_wake_t duty_cycle_init(void)
+{
+    switch (esp_sleep_get_wakeup_cause())
+    {
+    case ESP_SLEEP_WAKEUP_UNDEFINED:
+        wake = DUTY_CYCLE_WAKE_POWER_ON;
+        break;
+    case ESP_SLEEP_WAKEUP_TIMER:
+        wake = DUTY_CYCLE_WAKE_TIMER;
+        break;
+    default:
+        wake = DUTY_CYCLE_WAKE_EXTERNAL;
+        break;
+    }
+
+    if (!duty_cycle_valid())
+    {
+        memset(&rtc, 0, sizeof(rtc));
+        rtc.magic = DUTY_CYCLE_MAGIC;
+    }
+    if (wake == DUTY_CYCLE_WAKE_POWER_ON)
+    {
+        // the RTC clock restarted, the schedule starts over
+        rtc.next_wake_us = 0;
+        rtc.retry_s = 0;
+    }
+    rtc.stats.wakes++;
+
+    ESP_LOGI(TAG, "wake %" PRIu32 " (%s), %d samples buffered", rtc.stats.wakes,
+             wake == DUTY_CYCLE_WAKE_TIMER ? "timer" : wake == DUTY_CYCLE_WAKE_EXTERNAL ? "external" : "power on",
+             rtc.count);
+    return wake;
+}
+
+esp_err_t duty_cycle_add(const void *sample, size_t len)
+{
+    size_t need = sizeof(duty_cycle_record_t) + len;
+    if (need > sizeof(rtc.buffer))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    while (rtc.used + need > sizeof(rtc.buffer))
+    {
+        duty_cycle_remove(1);
+        rtc.stats.dropped++;
+    }
+
+    duty_cycle_record_t *rec = (duty_cycle_record_t *)(rtc.buffer + rtc.used);
+    rec->len = len;
+    rec->time_s = duty_cycle_time_ms() / 1000;
+    memcpy(rec + 1, sample, len);
+    rtc.used += need;
+    rtc.count++;
+    rtc.stats.samples++;
+    return ESP_OK;
+}
+
+bool duty_cycle_due(void)
+{
+    if (wake != DUTY_CYCLE_WAKE_TIMER)
+    {
+        return true;
+    }
+    uint32_t now_s = duty_cycle_time_ms() / 1000;
+    if (rtc.count == 0 || now_s < rtc.retry_s)
+    {
+        return false;
+    }
+    if (rtc.count >= CONFIG_DUTY_CYCLE_BATCH)
+    {
+        return true;
+    }
+    uint32_t age_s = now_s - duty_cycle_record(0)->time_s;
+    return age_s >= CONFIG_DUTY_CYCLE_DEADLINE_S;
+}
+
+size_t duty_cycle_count(void)
+{
+    return rtc.count;
+}
+
+const void *duty_cycle_get(size_t i, size_t *len)
+{
+    if (i >= rtc.count)
+    {
+        return NULL;
+    }
+    duty_cycle_record_t *rec = duty_cycle_record(i);
+    *len = rec->len;
+    return rec + 1;
+}
+
+void duty_cycle_radio_begin(void)
+{
+    radio_start_us = esp_timer_get_time();
+    rtc.stats.sessions++;
+}
+
+void duty_cycle_radio_end(size_t sent)
+{
+    uint32_t elapsed = esp_timer_get_time() - radio_start_us;
+
+    sent = sent < rtc.count ? sent : rtc.count;
+    duty_cycle_remove(sent);
+    rtc.stats.sent += sent;
+    rtc.stats.radio_on_us += elapsed;
+    rtc.stats.last_session_us = elapsed;
+    if (rtc.stats.sent > 0)
+    {
+        rtc.stats.radio_us_per_sample = rtc.stats.radio_on_us / rtc.stats.sent;
+    }
+
+    if (sent == 0 && rtc.count > 0)
+    {
+        // no network: back off, doubling up to the deadline, instead of
+        // paying for a failed session on every wake
+        uint32_t backoff_s = CONFIG_DUTY_CYCLE_PERIOD_S;
+        for (int i = 0; i < rtc.failures && backoff_s < CONFIG_DUTY_CYCLE_DEADLINE_S; i++)
+        {
+            backoff_s *= 2;
+        }
+        if (backoff_s > CONFIG_DUTY_CYCLE_DEADLINE_S && CONFIG_DUTY_CYCLE_DEADLINE_S > CONFIG_DUTY_CYCLE_PERIOD_S)
+        {
+            backoff_s = CONFIG_DUTY_CYCLE_DEADLINE_S;
+        }
+        rtc.failures++;
+        rtc.retry_s = duty_cycle_time_ms() / 1000 + backoff_s;
+        ESP_LOGW(TAG, "session failed %d times in a row, next one in %" PRIu32 " s", rtc.failures, backoff_s);
+    }
+    else
+    {
+        rtc.failures = 0;
+        rtc.retry_s = 0;
+    }
+
+    ESP_LOGI(TAG, "radio on for %" PRIu32 " ms, %d samples sent, %" PRIu32 " ms per sample over %" PRIu32 " sessions",
+             elapsed / 1000, (int)sent, rtc.stats.radio_us_per_sample / 1000, rtc.stats.sessions);
+}
+
+void duty_cycle_sleep(void)
+{
+    uint64_t now = duty_cycle_time_us();
+    uint64_t next = rtc.next_wake_us;
+
+    if (next == 0 || next > now + PERIOD_US)
+    {
+        // first sleep, or the clock was set back: anchor the schedule here
+        next = now + PERIOD_US;
+    }
+    else if (next < now + MIN_SLEEP_US)
+    {
+        // the wake ran into the next slots, skip them instead of catching up
+        next += ((now + MIN_SLEEP_US - next) / PERIOD_US + 1) * PERIOD_US;
+    }
+    rtc.next_wake_us = next;
+
+    ESP_LOGI(TAG, "awake for %lld ms, sleeping %" PRIu64 " ms with %d samples buffered",
+             esp_timer_get_time() / 1000, (next - now) / 1000, rtc.count);
+    esp_sleep_enable_timer_wakeup(next - now);
+    esp_deep_sleep_start();
+}
+
+void duty_cycle_get_stats(duty_cycle_stats_t *stats)
+{
+    *stats = rtc.stats;
+    stats->buffered = rtc.count;
+}
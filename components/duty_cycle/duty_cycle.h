@@ -0,0 +1,93 @@
+/*
+ * duty_cycle.h
+ *
+ * Deep sleep duty cycle for battery nodes. The node wakes on a timer once
+ * every DUTY_CYCLE_PERIOD_S, takes a sample and goes back to sleep. Samples
+ * are kept in RTC slow memory, which survives deep sleep, and the radio is
+ * only turned on when DUTY_CYCLE_BATCH of them are waiting, when the oldest
+ * one reaches DUTY_CYCLE_DEADLINE_S, on power on, or when an external
+ * wake source (a button) woke the node. One radio session then carries the
+ * whole batch. After a session that delivered nothing the next one is
+ * put off, twice as long each time up to the deadline, unless a button or
+ * power on asks for one.
+ *
+ * The radio-on time is measured per session and divided by the samples it
+ * delivered, which together with the wake count is the energy proxy to
+ * tune the period and batch size with.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum
+{
+    DUTY_CYCLE_WAKE_POWER_ON, // or any reset that is not a deep sleep wake
+    DUTY_CYCLE_WAKE_TIMER,
+    DUTY_CYCLE_WAKE_EXTERNAL, // ext0, ext1, touch, ulp: the user wants data now
+} duty_cycle_wake_t;
+
+typedef struct
+{
+    uint32_t wakes;               // since power on
+    uint32_t sessions;            // radio sessions
+    uint32_t samples;             // taken
+    uint32_t sent;                // delivered by a session
+    uint32_t dropped;             // pushed out of a full buffer
+    uint32_t buffered;            // waiting right now
+    uint64_t radio_on_us;         // over all sessions
+    uint32_t last_session_us;
+    uint32_t radio_us_per_sample; // radio_on_us / sent
+} duty_cycle_stats_t;
+
+/**
+ * Counts the wake and works out its cause. Call first thing in app_main.
+ */
+duty_cycle_wake_t duty_cycle_init(void);
+
+/**
+ * Buffers one sample, stamped with the current time.
+ *
+ * @return ESP_ERR_INVALID_SIZE when it can never fit the buffer.
+ */
+esp_err_t duty_cycle_add(const void *sample, size_t len);
+
+/**
+ * @return true when this wake should run a radio session.
+ */
+bool duty_cycle_due(void);
+
+size_t duty_cycle_count(void);
+
+/**
+ * Returns buffered sample i, oldest first, and its length.
+ */
+const void *duty_cycle_get(size_t i, size_t *len);
+
+/**
+ * Milliseconds since power on on the RTC clock, which keeps counting in deep
+ * sleep, for sample time stamps.
+ */
+uint64_t duty_cycle_time_ms(void);
+
+/**
+ * Marks the radio turned on.
+ */
+void duty_cycle_radio_begin(void);
+
+/**
+ * Marks the radio turned off and removes the first sent samples, the ones
+ * the session delivered.
+ */
+void duty_cycle_radio_end(size_t sent);
+
+/**
+ * Arms the timer for the next sample and enters deep sleep. Other wake
+ * sources are left as configured. Does not return.
+ */
+void duty_cycle_sleep(void) __attribute__((noreturn));
+
+void duty_cycle_get_stats(duty_cycle_stats_t *stats);
@@ -0,0 +1,627 @@
+/*
+ * json_stream.c
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "json_stream.h"
+
+#if JSON_STREAM_MAX_PATH >= UINT8_MAX || JSON_STREAM_MAX_DEPTH >= UINT8_MAX
+#error "json_stream keeps path lengths and depth in 8 bits"
+#endif
+
+static const char *TAG = "json_stream";
+
+enum
+{
+    JS_VALUE,        // a value is expected
+    JS_ARRAY_FIRST,  // after [, a value or ]
+    JS_OBJECT_FIRST, // after {, a key or }
+    JS_KEY,          // after a , in an object
+    JS_COLON,
+    JS_NEXT, // after a value, a , or the end of its container
+    JS_STRING,
+    JS_ESCAPE,
+    JS_UNICODE,
+    JS_LITERAL,
+    JS_DONE, // the document is complete, only white space may follow
+    JS_ERROR,
+};
+
+// number grammar: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+enum
+{
+    NUM_SIGN,     // after -
+    NUM_ZERO,     // a leading 0
+    NUM_INT,
+    NUM_DOT,
+    NUM_FRAC,
+    NUM_EXP,      // after e
+    NUM_EXP_SIGN,
+    NUM_EXP_DIGITS,
+    NUM_WORD,     // true, false or null
+};
+
+static bool js_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static esp_err_t js_fail(json_stream_t *js, esp_err_t err, const char *why)
+{
+    ESP_LOGE(TAG, "%s at byte %d", why, (int)js->offset);
+    js->state = JS_ERROR;
+    js->err = err;
+    return err;
+}
+
+static bool js_in_array(const json_stream_t *js)
+{
+    uint8_t level = js->depth - 1;
+    return js->containers[level / 8] & (1 << (level % 8));
+}
+
+// field the value starting now goes to
+static int16_t js_match(const json_stream_t *js)
+{
+    if (js->depth == 0 || js->arrays > 0 || js->path_len > JSON_STREAM_MAX_PATH)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < js->field_count; i++)
+    {
+        const char *path = js->fields[i].path;
+        if (strlen(path) == js->path_len && memcmp(path, js->path, js->path_len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void js_path_append(json_stream_t *js, char c)
+{
+    if (js->path_len < JSON_STREAM_MAX_PATH)
+    {
+        js->path[js->path_len++] = c;
+    }
+    else
+    {
+        js->path_len = JSON_STREAM_MAX_PATH + 1;
+    }
+}
+
+static esp_err_t js_push(json_stream_t *js, bool array)
+{
+    if (js->depth == JSON_STREAM_MAX_DEPTH)
+    {
+        return js_fail(js, ESP_ERR_NOT_SUPPORTED, "nested too deep");
+    }
+    uint8_t bit = 1 << (js->depth % 8);
+    if (array)
+    {
+        js->containers[js->depth / 8] |= bit;
+        js->arrays++;
+    }
+    else
+    {
+        js->containers[js->depth / 8] &= ~bit;
+    }
+    js->base[js->depth++] = js->path_len;
+    js->state = array ? JS_ARRAY_FIRST : JS_OBJECT_FIRST;
+    return ESP_OK;
+}
+
+static void js_value_end(json_stream_t *js)
+{
+    js->field = -1;
+    js->state = js->depth == 0 ? JS_DONE : JS_NEXT;
+}
+
+static esp_err_t js_pop(json_stream_t *js, bool array)
+{
+    if (js_in_array(js) != array)
+    {
+        return js_fail(js, ESP_FAIL, array ? "] closing an object" : "} closing an array");
+    }
+    js->arrays -= array;
+    js->depth--;
+    js_value_end(js);
+    return ESP_OK;
+}
+
+static void js_key_begin(json_stream_t *js)
+{
+    js->path_len = js->base[js->depth - 1];
+    if (js->path_len > 0)
+    {
+        js_path_append(js, '.');
+    }
+    js->key = true;
+    js->surrogate = 0;
+    js->state = JS_STRING;
+}
+
+static void js_string_byte(json_stream_t *js, char c)
+{
+    if (js->key)
+    {
+        js_path_append(js, c);
+        return;
+    }
+    if (js->field < 0)
+    {
+        return;
+    }
+    const json_stream_field_t *field = &js->fields[js->field];
+    if (js->len + 1 < field->size)
+    {
+        ((char *)js->out + field->offset)[js->len++] = c;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "%s longer than %d bytes, skipped", field->path, (int)field->size - 1);
+        js->field = -1;
+    }
+}
+
+// as UTF-8
+static void js_string_code(json_stream_t *js, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        js_string_byte(js, cp);
+    }
+    else if (cp < 0x800)
+    {
+        js_string_byte(js, 0xC0 | (cp >> 6));
+        js_string_byte(js, 0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        js_string_byte(js, 0xE0 | (cp >> 12));
+        js_string_byte(js, 0x80 | ((cp >> 6) & 0x3F));
+        js_string_byte(js, 0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        js_string_byte(js, 0xF0 | (cp >> 18));
+        js_string_byte(js, 0x80 | ((cp >> 12) & 0x3F));
+        js_string_byte(js, 0x80 | ((cp >> 6) & 0x3F));
+        js_string_byte(js, 0x80 | (cp & 0x3F));
+    }
+}
+
+// a high surrogate not followed by a low one stands for nothing valid
+static void js_string_lone_surrogate(json_stream_t *js)
+{
+    if (js->surrogate != 0)
+    {
+        js->surrogate = 0;
+        js_string_code(js, 0xFFFD);
+    }
+}
+
+static void js_string_end(json_stream_t *js)
+{
+    js_string_lone_surrogate(js);
+    if (js->key)
+    {
+        js->key = false;
+        js->state = JS_COLON;
+        return;
+    }
+    if (js->field >= 0)
+    {
+        const json_stream_field_t *field = &js->fields[js->field];
+        ((char *)js->out + field->offset)[js->len] = '\0';
+        js->found |= 1u << js->field;
+    }
+    js_value_end(js);
+}
+
+static void js_store(json_stream_t *js)
+{
+    const json_stream_field_t *field = &js->fields[js->field];
+    void *member = js->out + field->offset;
+    const char *text = js->literal;
+
+    if (js->number == NUM_WORD)
+    {
+        if (field->type == JSON_STREAM_BOOL && text[0] != 'n')
+        {
+            *(bool *)member = text[0] == 't';
+            js->found |= 1u << js->field;
+        }
+        return;
+    }
+    double value = strtod(text, NULL);
+    if (field->type == JSON_STREAM_DOUBLE)
+    {
+        *(double *)member = value;
+        js->found |= 1u << js->field;
+    }
+    else if (field->type == JSON_STREAM_INT && value == floor(value) && value >= INT_MIN && value <= INT_MAX)
+    {
+        *(int *)member = value;
+        js->found |= 1u << js->field;
+    }
+}
+
+static esp_err_t js_literal_end(json_stream_t *js)
+{
+    static const char *const words[] = {"true", "false", "null"};
+
+    if (js->number == NUM_WORD)
+    {
+        bool known = false;
+        for (int i = 0; i < 3; i++)
+        {
+            known |= js->len == strlen(words[i]) && memcmp(js->literal, words[i], js->len) == 0;
+        }
+        if (!known)
+        {
+            return js_fail(js, ESP_FAIL, "unknown literal");
+        }
+    }
+    else if (js->number != NUM_ZERO && js->number != NUM_INT && js->number != NUM_FRAC &&
+             js->number != NUM_EXP_DIGITS)
+    {
+        return js_fail(js, ESP_FAIL, "bad number");
+    }
+
+    if (js->field >= 0)
+    {
+        if (js->len < JSON_STREAM_MAX_LITERAL)
+        {
+            js->literal[js->len] = '\0';
+            js_store(js);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "%s longer than %d digits, skipped", js->fields[js->field].path,
+                     JSON_STREAM_MAX_LITERAL - 1);
+        }
+    }
+    js_value_end(js);
+    return ESP_OK;
+}
+
+// next byte of a literal, false when c is not part of it
+static bool js_literal_byte(json_stream_t *js, char c)
+{
+    bool digit = c >= '0' && c <= '9';
+    switch (js->number)
+    {
+    case NUM_WORD:
+        if (c < 'a' || c > 'z')
+        {
+            return false;
+        }
+        break;
+    case NUM_SIGN:
+        if (!digit)
+        {
+            return false;
+        }
+        js->number = c == '0' ? NUM_ZERO : NUM_INT;
+        break;
+    case NUM_ZERO:
+    case NUM_INT:
+        if (digit && js->number == NUM_INT)
+        {
+            break;
+        }
+        if (c == '.')
+        {
+            js->number = NUM_DOT;
+        }
+        else if (c == 'e' || c == 'E')
+        {
+            js->number = NUM_EXP;
+        }
+        else
+        {
+            return false;
+        }
+        break;
+    case NUM_DOT:
+    case NUM_FRAC:
+        if (digit)
+        {
+            js->number = NUM_FRAC;
+        }
+        else if (js->number == NUM_FRAC && (c == 'e' || c == 'E'))
+        {
+            js->number = NUM_EXP;
+        }
+        else
+        {
+            return false;
+        }
+        break;
+    case NUM_EXP:
+        if (c == '+' || c == '-')
+        {
+            js->number = NUM_EXP_SIGN;
+            break;
+        }
+        // fall through
+    case NUM_EXP_SIGN:
+    case NUM_EXP_DIGITS:
+        if (!digit)
+        {
+            return false;
+        }
+        js->number = NUM_EXP_DIGITS;
+        break;
+    }
+    if (js->len < JSON_STREAM_MAX_LITERAL)
+    {
+        js->literal[js->len] = c;
+    }
+    js->len++;
+    return true;
+}
+
+static esp_err_t js_value_begin(json_stream_t *js, char c)
+{
+    js->field = js_match(js);
+    js->len = 0;
+
+    switch (c)
+    {
+    case '{':
+        return js_push(js, false);
+    case '[':
+        return js_push(js, true);
+    case '"':
+        if (js->field >= 0 && js->fields[js->field].type != JSON_STREAM_STRING)
+        {
+            js->field = -1;
+        }
+        js->key = false;
+        js->surrogate = 0;
+        js->state = JS_STRING;
+        return ESP_OK;
+    default:
+        if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            js->number = NUM_SIGN;
+            if (c != '-')
+            {
+                js_literal_byte(js, c);
+            }
+            else
+            {
+                js->literal[js->len++] = c;
+            }
+        }
+        else if (c >= 'a' && c <= 'z')
+        {
+            js->number = NUM_WORD;
+            js_literal_byte(js, c);
+        }
+        else
+        {
+            return js_fail(js, ESP_FAIL, "unexpected character");
+        }
+        if (js->field >= 0 && js->fields[js->field].type == JSON_STREAM_STRING)
+        {
+            js->field = -1;
+        }
+        js->state = JS_LITERAL;
+        return ESP_OK;
+    }
+}
+
+static int js_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static esp_err_t js_unicode(json_stream_t *js, char c)
+{
+    int digit = js_hex(c);
+    if (digit < 0)
+    {
+        return js_fail(js, ESP_FAIL, "bad \\u escape");
+    }
+    js->unicode = js->unicode << 4 | digit;
+    if (++js->hex < 4)
+    {
+        return ESP_OK;
+    }
+
+    uint32_t cp = js->unicode;
+    js->state = JS_STRING;
+    if (cp >= 0xDC00 && cp < 0xE000 && js->surrogate != 0)
+    {
+        cp = 0x10000 + ((uint32_t)(js->surrogate - 0xD800) << 10) + (cp - 0xDC00);
+        js->surrogate = 0;
+        js_string_code(js, cp);
+        return ESP_OK;
+    }
+    js_string_lone_surrogate(js);
+    if (cp >= 0xD800 && cp < 0xDC00)
+    {
+        js->surrogate = cp;
+    }
+    else
+    {
+        js_string_code(js, cp >= 0xDC00 && cp < 0xE000 ? 0xFFFD : cp);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t js_escape(json_stream_t *js, char c)
+{
+    static const char from[] = "\"\\/bfnrt";
+    static const char to[] = "\"\\/\b\f\n\r\t";
+
+    if (c == 'u')
+    {
+        js->unicode = 0;
+        js->hex = 0;
+        js->state = JS_UNICODE;
+        return ESP_OK;
+    }
+    const char *p = c != '\0' ? strchr(from, c) : NULL;
+    if (p == NULL)
+    {
+        return js_fail(js, ESP_FAIL, "bad escape");
+    }
+    js_string_lone_surrogate(js);
+    js_string_byte(js, to[p - from]);
+    js->state = JS_STRING;
+    return ESP_OK;
+}
+
+static esp_err_t js_byte(json_stream_t *js, char c)
+{
+    switch (js->state)
+    {
+    case JS_STRING:
+        if (c == '"')
+        {
+            js_string_end(js);
+        }
+        else if (c == '\\')
+        {
+            js->state = JS_ESCAPE;
+        }
+        else if ((uint8_t)c < 0x20)
+        {
+            return js_fail(js, ESP_FAIL, "control character in a string");
+        }
+        else
+        {
+            js_string_lone_surrogate(js);
+            js_string_byte(js, c);
+        }
+        return ESP_OK;
+    case JS_ESCAPE:
+        return js_escape(js, c);
+    case JS_UNICODE:
+        return js_unicode(js, c);
+    case JS_LITERAL:
+        if (js_literal_byte(js, c))
+        {
+            return ESP_OK;
+        }
+        if (js_literal_end(js) != ESP_OK)
+        {
+            return js->err;
+        }
+        // c ends the literal, and is read again after it
+        return js_byte(js, c);
+    default:
+        break;
+    }
+
+    if (js_space(c))
+    {
+        return ESP_OK;
+    }
+    switch (js->state)
+    {
+    case JS_VALUE:
+        return js_value_begin(js, c);
+    case JS_ARRAY_FIRST:
+        return c == ']' ? js_pop(js, true) : js_value_begin(js, c);
+    case JS_OBJECT_FIRST:
+        if (c == '}')
+        {
+            return js_pop(js, false);
+        }
+        // fall through
+    case JS_KEY:
+        if (c != '"')
+        {
+            return js_fail(js, ESP_FAIL, "expected a key");
+        }
+        js_key_begin(js);
+        return ESP_OK;
+    case JS_COLON:
+        if (c != ':')
+        {
+            return js_fail(js, ESP_FAIL, "expected :");
+        }
+        js->state = JS_VALUE;
+        return ESP_OK;
+    case JS_NEXT:
+        if (c == ',')
+        {
+            js->state = js_in_array(js) ? JS_VALUE : JS_KEY;
+            return ESP_OK;
+        }
+        if (c == ']' || c == '}')
+        {
+            return js_pop(js, c == ']');
+        }
+        return js_fail(js, ESP_FAIL, "expected , or the end of a container");
+    case JS_DONE:
+        return js_fail(js, ESP_FAIL, "data after the end of the document");
+    default:
+        return js->err;
+    }
+}
+
+void json_stream_init(json_stream_t *js, const json_stream_field_t *fields, size_t field_count, void *out)
+{
+    memset(js, 0, sizeof(*js));
+    js->fields = fields;
+    js->field_count = field_count < JSON_STREAM_MAX_FIELDS ? field_count : JSON_STREAM_MAX_FIELDS;
+    js->out = out;
+    js->field = -1;
+    js->state = JS_VALUE;
+    js->err = ESP_OK;
+}
+
+esp_err_t json_stream_feed(json_stream_t *js, const void *data, size_t len)
+{
+    const char *p = data;
+    for (size_t i = 0; i < len && js->state != JS_ERROR; i++, js->offset++)
+    {
+        js_byte(js, p[i]);
+    }
+    return js->err;
+}
+
+esp_err_t json_stream_finish(json_stream_t *js)
+{
+    // a number at the top level only ends with the document
+    if (js->state == JS_LITERAL)
+    {
+        js_literal_end(js);
+    }
+    if (js->state == JS_ERROR)
+    {
+        return js->err;
+    }
+    if (js->state != JS_DONE)
+    {
+        return js_fail(js, ESP_FAIL, "document cut short");
+    }
+    return ESP_OK;
+}
+
+bool json_stream_has(const json_stream_t *js, size_t i)
+{
+    return i < js->field_count && (js->found & (1u << i));
+}
@@ -0,0 +1,98 @@
+/*
+ * json_stream.h
+ *
+ * Streaming JSON reader. The document is fed in chunks of any size, as they
+ * come off the network, and goes through a byte at a time state machine:
+ * no heap, no copy of the document, the same memory whatever its size.
+ * Only the fields declared in a table are kept, converted into members of a
+ * struct of the caller. Everything else is checked for syntax and skipped.
+ *
+ * A field is named by its keys from the root, "version" or "image.uri".
+ * Values inside arrays are not addressable. Objects and arrays nest up to
+ * JSON_STREAM_MAX_DEPTH levels. Paths longer than JSON_STREAM_MAX_PATH and
+ * numbers longer than JSON_STREAM_MAX_LITERAL are read, but never match.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define JSON_STREAM_MAX_DEPTH 16
+#define JSON_STREAM_MAX_PATH 64
+#define JSON_STREAM_MAX_LITERAL 32
+#define JSON_STREAM_MAX_FIELDS 32
+
+typedef enum
+{
+    JSON_STREAM_INT,    // int, integral numbers only
+    JSON_STREAM_DOUBLE, // double
+    JSON_STREAM_BOOL,   // bool
+    JSON_STREAM_STRING, // char[size], unescaped and NUL terminated
+} json_stream_type_t;
+
+typedef struct
+{
+    const char *path;
+    json_stream_type_t type;
+    size_t offset; // of the member in the output struct
+    size_t size;   // of the member, bounds strings
+} json_stream_field_t;
+
+/** Declares the field at path read into member of struct type st */
+#define JSON_STREAM_FIELD(path, type, st, member) \
+    {(path), (type), offsetof(st, member), sizeof(((st *)0)->member)}
+
+typedef struct
+{
+    const json_stream_field_t *fields;
+    size_t field_count;
+    uint8_t *out;
+    uint32_t found; // bit per field that was read
+
+    uint8_t state;
+    uint8_t number; // where a number literal is in its grammar
+    uint8_t depth;
+    uint8_t arrays;                                      // enclosing arrays
+    uint8_t containers[(JSON_STREAM_MAX_DEPTH + 7) / 8]; // bit set for an array
+    uint8_t base[JSON_STREAM_MAX_DEPTH];                 // path length of each container
+    uint8_t path_len;                                    // JSON_STREAM_MAX_PATH + 1 once too long
+    char path[JSON_STREAM_MAX_PATH];
+    bool key;          // the string being read is a key
+    int16_t field;     // field the value being read goes to, -1 for none
+    uint16_t surrogate; // high half of a \u pair, waiting for the low one
+    uint16_t unicode;
+    uint8_t hex;       // digits of \u read so far
+    size_t len;        // of the string or literal so far
+    char literal[JSON_STREAM_MAX_LITERAL];
+    size_t offset;     // bytes fed, for errors
+    esp_err_t err;
+} json_stream_t;
+
+/**
+ * Starts a document. The fields are read into out, which is not cleared:
+ * members keep their value when the document does not have the field.
+ */
+void json_stream_init(json_stream_t *js, const json_stream_field_t *fields, size_t field_count, void *out);
+
+/**
+ * Parses the next len bytes of the document.
+ *
+ * @return ESP_FAIL on a syntax error, ESP_ERR_NOT_SUPPORTED when nested
+ *         too deep. Later calls return the same error.
+ */
+esp_err_t json_stream_feed(json_stream_t *js, const void *data, size_t len);
+
+/**
+ * Ends the document.
+ *
+ * @return ESP_OK when exactly one whole value was fed.
+ */
+esp_err_t json_stream_finish(json_stream_t *js);
+
+/**
+ * @return true when field i was in the document, with the declared type.
+ */
+bool json_stream_has(const json_stream_t *js, size_t i);
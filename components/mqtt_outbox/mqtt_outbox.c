@@ -0,0 +1,786 @@
+/*
+ * mqtt_outbox.c
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "mqtt_outbox.h"
+
+#define OUTBOX_SECTOR_SIZE 4096
+#define OUTBOX_MAX_SECTORS 64
+#define OUTBOX_SECTOR_MAGIC 0x3158424F // "OBX1"
+#define OUTBOX_RECORD_MAGIC 0x4D52
+#define OUTBOX_ERASED_MAGIC 0xFFFF
+#define OUTBOX_ALIGN(n) (((n) + 3) & ~(size_t)3)
+#define OUTBOX_NVS_NAMESPACE "mqtt_outbox"
+#define OUTBOX_NVS_TAIL "tail"
+#define OUTBOX_EVENT_QUEUE_LEN (CONFIG_MQTT_OUTBOX_BATCH + 8)
+
+static const char *TAG = "mqtt_outbox";
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t erase_count;
+} outbox_sector_hdr_t;
+
+/** Record as laid out in staging and in flash, followed by topic and payload */
+typedef struct
+{
+    uint16_t magic;
+    uint8_t topic_len;
+    uint8_t reserved;
+    uint16_t len;
+    uint16_t reserved2;
+    uint32_t seq;
+    uint32_t crc32; // of the header up to here, topic and payload
+} outbox_record_hdr_t;
+
+_Static_assert(sizeof(outbox_record_hdr_t) == 16, "outbox_record_hdr_t must match the flash layout");
+
+#define OUTBOX_RECORD_MAX OUTBOX_ALIGN(sizeof(outbox_record_hdr_t) + CONFIG_MQTT_OUTBOX_MAX_RECORD)
+
+typedef struct
+{
+    uint32_t erase_count;
+    uint32_t first_seq; // 0 while the sector holds no record
+    uint32_t last_seq;
+    uint32_t end;       // offset of the next write, the sector size once nothing fits
+} outbox_sector_t;
+
+typedef enum
+{
+    OUTBOX_EV_QUEUED,
+    OUTBOX_EV_CONNECTED,
+    OUTBOX_EV_DISCONNECTED,
+    OUTBOX_EV_PUBLISHED,
+} outbox_event_id_t;
+
+typedef struct
+{
+    outbox_event_id_t id;
+    int msg_id;
+} outbox_event_t;
+
+typedef struct
+{
+    int msg_id;
+    uint32_t seq;
+    bool acked;
+} outbox_inflight_t;
+
+// next record to replay, in a flash sector or in staging
+typedef struct
+{
+    bool valid;
+    bool staged;
+    size_t sector;
+    uint32_t off;
+} outbox_cursor_t;
+
+static const esp_partition_t *partition;
+static esp_mqtt_client_handle_t client;
+static SemaphoreHandle_t lock;
+static QueueHandle_t events;
+// set when an event did not fit the queue, the task then resyncs from the tail
+static volatile bool events_lost;
+
+// everything below is guarded by lock
+static outbox_sector_t sectors[OUTBOX_MAX_SECTORS];
+static size_t sector_count;
+static size_t head;
+static uint32_t next_seq = 1;
+static uint32_t tail; // highest acked seq
+static uint32_t persisted_tail;
+static uint32_t lost; // highest seq overwritten before it was acked
+
+static uint8_t staging[CONFIG_MQTT_OUTBOX_STAGING_SIZE] __attribute__((aligned(4)));
+static size_t staging_len;
+
+static bool connected;
+static uint32_t send_seq; // next seq to publish
+static outbox_cursor_t cursor;
+static outbox_inflight_t inflight[CONFIG_MQTT_OUTBOX_BATCH];
+static int inflight_count;
+static uint8_t record[OUTBOX_RECORD_MAX] __attribute__((aligned(4)));
+static char topic[256];
+
+static mqtt_outbox_stats_t stats;
+
+static size_t outbox_record_size(const outbox_record_hdr_t *rec)
+{
+    return OUTBOX_ALIGN(sizeof(*rec) + rec->topic_len + rec->len);
+}
+
+static uint32_t outbox_record_crc(const outbox_record_hdr_t *rec)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)rec, offsetof(outbox_record_hdr_t, crc32));
+    return esp_rom_crc32_le(crc, (const uint8_t *)(rec + 1), rec->topic_len + rec->len);
+}
+
+static uint32_t outbox_pending(void)
+{
+    return next_seq - 1 - (lost > tail ? lost : tail);
+}
+
+static size_t outbox_sector_addr(size_t sector)
+{
+    return sector * OUTBOX_SECTOR_SIZE;
+}
+
+// loads the record at off of sector into record, false if there is no intact one
+static bool outbox_read_record(size_t sector, uint32_t off)
+{
+    outbox_record_hdr_t *rec = (outbox_record_hdr_t *)record;
+
+    if (off + sizeof(*rec) > OUTBOX_SECTOR_SIZE ||
+        esp_partition_read(partition, outbox_sector_addr(sector) + off, rec, sizeof(*rec)) != ESP_OK)
+    {
+        return false;
+    }
+    if (rec->magic != OUTBOX_RECORD_MAGIC || rec->topic_len + rec->len > CONFIG_MQTT_OUTBOX_MAX_RECORD ||
+        off + outbox_record_size(rec) > OUTBOX_SECTOR_SIZE)
+    {
+        return false;
+    }
+    if (esp_partition_read(partition, outbox_sector_addr(sector) + off + sizeof(*rec), rec + 1,
+                           rec->topic_len + rec->len) != ESP_OK)
+    {
+        return false;
+    }
+    return rec->crc32 == outbox_record_crc(rec);
+}
+
+static void outbox_scan_sector(size_t i)
+{
+    outbox_sector_t *s = &sectors[i];
+    outbox_sector_hdr_t hdr;
+
+    memset(s, 0, sizeof(*s));
+    if (esp_partition_read(partition, outbox_sector_addr(i), &hdr, sizeof(hdr)) != ESP_OK ||
+        hdr.magic != OUTBOX_SECTOR_MAGIC)
+    {
+        // never formatted, or the erase was cut: full, so that it is erased before use
+        s->end = OUTBOX_SECTOR_SIZE;
+        return;
+    }
+
+    s->erase_count = hdr.erase_count;
+    s->end = sizeof(hdr);
+    while (outbox_read_record(i, s->end))
+    {
+        const outbox_record_hdr_t *rec = (const outbox_record_hdr_t *)record;
+        if (s->first_seq == 0)
+        {
+            s->first_seq = rec->seq;
+        }
+        s->last_seq = rec->seq;
+        s->end += outbox_record_size(rec);
+    }
+
+    // anything but erased flash after the last record is a torn write, nothing more goes here
+    uint16_t magic = OUTBOX_ERASED_MAGIC;
+    if (s->end + sizeof(magic) <= OUTBOX_SECTOR_SIZE)
+    {
+        esp_partition_read(partition, outbox_sector_addr(i) + s->end, &magic, sizeof(magic));
+    }
+    if (magic != OUTBOX_ERASED_MAGIC)
+    {
+        ESP_LOGW(TAG, "sector %d ends with a torn record", (int)i);
+        s->end = OUTBOX_SECTOR_SIZE;
+    }
+}
+
+// makes sector i an empty formatted sector, what it still held unacked is lost
+static esp_err_t outbox_prepare_sector(size_t i)
+{
+    outbox_sector_t *s = &sectors[i];
+
+    if (s->last_seq > tail)
+    {
+        uint32_t from = s->first_seq > tail ? s->first_seq : tail + 1;
+        stats.dropped += s->last_seq - from + 1;
+        lost = s->last_seq;
+        ESP_LOGW(TAG, "ring full, dropping messages %" PRIu32 "..%" PRIu32, from, s->last_seq);
+    }
+    cursor.valid = false;
+
+    // formatted and empty, spare the erase
+    if (s->end != sizeof(outbox_sector_hdr_t))
+    {
+        outbox_sector_hdr_t hdr = {
+            .magic = OUTBOX_SECTOR_MAGIC,
+            .erase_count = s->erase_count + 1};
+        esp_err_t err = esp_partition_erase_range(partition, outbox_sector_addr(i), OUTBOX_SECTOR_SIZE);
+        if (err == ESP_OK)
+        {
+            err = esp_partition_write(partition, outbox_sector_addr(i), &hdr, sizeof(hdr));
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "sector %d not formatted: %s", (int)i, esp_err_to_name(err));
+            return err;
+        }
+        s->erase_count = hdr.erase_count;
+    }
+    s->first_seq = 0;
+    s->last_seq = 0;
+    s->end = sizeof(outbox_sector_hdr_t);
+    return ESP_OK;
+}
+
+// the least worn sector holding nothing unacked, the first one after head
+// among equals. Replay finds sectors by seq, so any order works. When every
+// other sector holds unacked messages the ring is full and the one with the
+// oldest is reused
+static size_t outbox_next_sector(void)
+{
+    size_t least_worn = sector_count;
+    size_t oldest = sector_count;
+
+    for (size_t n = 1; n < sector_count; n++)
+    {
+        size_t i = (head + n) % sector_count;
+        const outbox_sector_t *s = &sectors[i];
+        if (s->last_seq <= tail)
+        {
+            if (least_worn == sector_count || s->erase_count < sectors[least_worn].erase_count)
+            {
+                least_worn = i;
+            }
+        }
+        else if (oldest == sector_count || s->first_seq < sectors[oldest].first_seq)
+        {
+            oldest = i;
+        }
+    }
+    return least_worn < sector_count ? least_worn : oldest;
+}
+
+static esp_err_t outbox_rotate(void)
+{
+    size_t next = outbox_next_sector();
+    esp_err_t err = outbox_prepare_sector(next);
+    if (err == ESP_OK)
+    {
+        head = next;
+    }
+    return err;
+}
+
+// drops the staged records that are acked already, they are always a prefix
+static void outbox_trim_staging(void)
+{
+    size_t off = 0;
+    while (off < staging_len && ((const outbox_record_hdr_t *)(staging + off))->seq <= tail)
+    {
+        off += outbox_record_size((const outbox_record_hdr_t *)(staging + off));
+    }
+    if (off > 0)
+    {
+        memmove(staging, staging + off, staging_len - off);
+        staging_len -= off;
+        cursor.valid = false;
+    }
+}
+
+// appends the unacked staged records to the ring, one write per sector they land in
+static esp_err_t outbox_flush_staging(void)
+{
+    esp_err_t err = ESP_OK;
+    size_t off = 0;
+
+    outbox_trim_staging();
+    while (off < staging_len && err == ESP_OK)
+    {
+        outbox_sector_t *s = &sectors[head];
+        const outbox_record_hdr_t *first = (const outbox_record_hdr_t *)(staging + off);
+        const outbox_record_hdr_t *last = first;
+        size_t run = 0;
+
+        while (off + run < staging_len)
+        {
+            const outbox_record_hdr_t *rec = (const outbox_record_hdr_t *)(staging + off + run);
+            size_t size = outbox_record_size(rec);
+            if (s->end + run + size > OUTBOX_SECTOR_SIZE)
+            {
+                break;
+            }
+            last = rec;
+            run += size;
+        }
+        if (run == 0)
+        {
+            err = outbox_rotate();
+            continue;
+        }
+
+        err = esp_partition_write(partition, outbox_sector_addr(head) + s->end, staging + off, run);
+        if (err == ESP_OK)
+        {
+            if (s->first_seq == 0)
+            {
+                s->first_seq = first->seq;
+            }
+            s->last_seq = last->seq;
+            s->end += run;
+            off += run;
+            stats.stored += last->seq - first->seq + 1;
+            stats.flash_writes++;
+        }
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "flush failed: %s", esp_err_to_name(err));
+    }
+    // keep what did not make it to flash
+    memmove(staging, staging + off, staging_len - off);
+    staging_len -= off;
+    cursor.valid = false;
+    return err;
+}
+
+// points cursor at the first record with a seq of at least send_seq
+static bool outbox_seek(void)
+{
+    // flash first, the sector with the smallest last seq that still reaches send_seq
+    size_t best = sector_count;
+    for (size_t i = 0; i < sector_count; i++)
+    {
+        if (sectors[i].first_seq != 0 && sectors[i].last_seq >= send_seq &&
+            (best == sector_count || sectors[i].last_seq < sectors[best].last_seq))
+        {
+            best = i;
+        }
+    }
+
+    if (best < sector_count)
+    {
+        cursor.staged = false;
+        cursor.sector = best;
+        cursor.off = sizeof(outbox_sector_hdr_t);
+        while (cursor.off < sectors[best].end && outbox_read_record(best, cursor.off))
+        {
+            const outbox_record_hdr_t *rec = (const outbox_record_hdr_t *)record;
+            if (rec->seq >= send_seq)
+            {
+                cursor.valid = true;
+                return true;
+            }
+            cursor.off += outbox_record_size(rec);
+        }
+    }
+
+    cursor.staged = true;
+    cursor.off = 0;
+    while (cursor.off < staging_len)
+    {
+        const outbox_record_hdr_t *rec = (const outbox_record_hdr_t *)(staging + cursor.off);
+        if (rec->seq >= send_seq)
+        {
+            break;
+        }
+        cursor.off += outbox_record_size(rec);
+    }
+    // caught up is valid too, appends land right at the cursor
+    cursor.valid = true;
+    return cursor.off < staging_len;
+}
+
+// loads the next record to replay into record and moves past it, NULL when caught up
+static const outbox_record_hdr_t *outbox_next(void)
+{
+    const outbox_record_hdr_t *rec = (const outbox_record_hdr_t *)record;
+
+    if (!cursor.valid)
+    {
+        outbox_seek();
+    }
+
+    if (!cursor.staged)
+    {
+        if (cursor.off < sectors[cursor.sector].end && outbox_read_record(cursor.sector, cursor.off))
+        {
+            cursor.off += outbox_record_size(rec);
+            return rec;
+        }
+        // end of the sector, the next one in sequence is found by seq
+        if (!outbox_seek())
+        {
+            return NULL;
+        }
+        if (!cursor.staged)
+        {
+            cursor.off += outbox_record_size(rec);
+            return rec;
+        }
+    }
+
+    if (cursor.off >= staging_len)
+    {
+        return NULL;
+    }
+    size_t size = outbox_record_size((const outbox_record_hdr_t *)(staging + cursor.off));
+    memcpy(record, staging + cursor.off, size);
+    cursor.off += size;
+    return rec;
+}
+
+static void outbox_persist_tail(void)
+{
+    uint32_t flash_last = 0;
+    for (size_t i = 0; i < sector_count; i++)
+    {
+        if (sectors[i].last_seq > flash_last)
+        {
+            flash_last = sectors[i].last_seq;
+        }
+    }
+    // messages acked while only staged are gone after a reset anyway
+    if (persisted_tail >= flash_last || persisted_tail == tail)
+    {
+        return;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u32(nvs, OUTBOX_NVS_TAIL, tail);
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "tail not persisted: %s", esp_err_to_name(err));
+        return;
+    }
+    persisted_tail = tail;
+}
+
+// publishes the next batch, once the previous one is fully acked
+static void outbox_pump(void)
+{
+    if (!connected || client == NULL || inflight_count > 0)
+    {
+        return;
+    }
+
+    while (inflight_count < CONFIG_MQTT_OUTBOX_BATCH)
+    {
+        const outbox_record_hdr_t *rec = outbox_next();
+        if (rec == NULL)
+        {
+            break;
+        }
+
+        const char *payload = (const char *)(rec + 1) + rec->topic_len;
+        memcpy(topic, rec + 1, rec->topic_len);
+        topic[rec->topic_len] = '\0';
+        // only queued for the MQTT task, a zero length makes the client take
+        // strlen of the payload
+        int msg_id = esp_mqtt_client_enqueue(client, topic, rec->len ? payload : "", rec->len, 1, 0, true);
+        if (msg_id < 0)
+        {
+            // sent again on the next event
+            cursor.valid = false;
+            break;
+        }
+
+        inflight[inflight_count].msg_id = msg_id;
+        inflight[inflight_count].seq = rec->seq;
+        inflight[inflight_count].acked = false;
+        inflight_count++;
+        send_seq = rec->seq + 1;
+        stats.sent++;
+    }
+}
+
+static void outbox_acked(int msg_id)
+{
+    for (int i = 0; i < inflight_count; i++)
+    {
+        if (inflight[i].msg_id == msg_id)
+        {
+            inflight[i].acked = true;
+            break;
+        }
+    }
+
+    // the tail only moves over an acked prefix, replay order is kept
+    int done = 0;
+    while (done < inflight_count && inflight[done].acked)
+    {
+        tail = inflight[done].seq;
+        done++;
+    }
+    if (done == 0)
+    {
+        return;
+    }
+    stats.acked += done;
+    inflight_count -= done;
+    memmove(inflight, inflight + done, inflight_count * sizeof(inflight[0]));
+
+    if (inflight_count == 0)
+    {
+        outbox_persist_tail();
+        outbox_trim_staging();
+    }
+}
+
+// replay restarts after the tail, what was in flight is sent again
+static void outbox_rewind(void)
+{
+    inflight_count = 0;
+    send_seq = tail + 1;
+    cursor.valid = false;
+}
+
+static void outbox_task(void *arg)
+{
+    outbox_event_t event;
+
+    while (true)
+    {
+        xQueueReceive(events, &event, portMAX_DELAY);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (events_lost)
+        {
+            events_lost = false;
+            outbox_rewind();
+        }
+        switch (event.id)
+        {
+        case OUTBOX_EV_CONNECTED:
+            connected = true;
+            outbox_rewind();
+            ESP_LOGI(TAG, "connected, replaying from %" PRIu32 ", %" PRIu32 " pending", send_seq,
+                     outbox_pending());
+            break;
+        case OUTBOX_EV_DISCONNECTED:
+            connected = false;
+            outbox_rewind();
+            break;
+        case OUTBOX_EV_PUBLISHED:
+            outbox_acked(event.msg_id);
+            break;
+        default:
+            break;
+        }
+        outbox_pump();
+        xSemaphoreGive(lock);
+    }
+}
+
+static void outbox_post(outbox_event_id_t id, int msg_id)
+{
+    outbox_event_t event = {
+        .id = id,
+        .msg_id = msg_id};
+    if (events == NULL)
+    {
+        return;
+    }
+    if (xQueueSend(events, &event, 0) != pdTRUE)
+    {
+        events_lost = true;
+    }
+}
+
+esp_err_t mqtt_outbox_init(const char *partition_label)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "partition %s not found", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    sector_count = partition->size / OUTBOX_SECTOR_SIZE;
+    if (sector_count > OUTBOX_MAX_SECTORS)
+    {
+        ESP_LOGW(TAG, "using %d of the %d sectors of %s", OUTBOX_MAX_SECTORS, (int)sector_count, partition_label);
+        sector_count = OUTBOX_MAX_SECTORS;
+    }
+    if (sector_count < 2)
+    {
+        ESP_LOGE(TAG, "partition %s needs at least 2 sectors", partition_label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    nvs_handle_t nvs;
+    if (nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        nvs_get_u32(nvs, OUTBOX_NVS_TAIL, &tail);
+        nvs_close(nvs);
+    }
+    persisted_tail = tail;
+
+    uint32_t newest = 0;
+    uint32_t oldest = UINT32_MAX;
+    size_t least_worn = 0;
+    for (size_t i = 0; i < sector_count; i++)
+    {
+        outbox_scan_sector(i);
+        if (sectors[i].last_seq > newest)
+        {
+            newest = sectors[i].last_seq;
+            head = i;
+        }
+        if (sectors[i].first_seq != 0 && sectors[i].last_seq > tail && sectors[i].first_seq < oldest)
+        {
+            oldest = sectors[i].first_seq;
+        }
+        if (sectors[i].erase_count < sectors[least_worn].erase_count)
+        {
+            least_worn = i;
+        }
+    }
+    if (newest == 0)
+    {
+        // empty ring, start on the least worn sector instead of always on the first one
+        head = least_worn;
+        esp_err_t err = outbox_prepare_sector(head);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    next_seq = (newest > tail ? newest : tail) + 1;
+    if (oldest != UINT32_MAX && oldest > tail + 1)
+    {
+        // the ring wrapped over unacked records before the reset
+        lost = oldest - 1;
+    }
+    send_seq = tail + 1;
+
+    lock = xSemaphoreCreateMutex();
+    events = xQueueCreate(OUTBOX_EVENT_QUEUE_LEN, sizeof(outbox_event_t));
+    if (lock == NULL || events == NULL ||
+        xTaskCreate(outbox_task, "mqtt_outbox", 4096, NULL, 5, NULL) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "%d sectors in %s, %" PRIu32 " messages pending from %" PRIu32, (int)sector_count,
+             partition_label, outbox_pending(), send_seq);
+    return ESP_OK;
+}
+
+void mqtt_outbox_attach(esp_mqtt_client_handle_t mqtt_client)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    client = mqtt_client;
+    xSemaphoreGive(lock);
+}
+
+void mqtt_outbox_handle_event(esp_mqtt_event_handle_t event)
+{
+    switch (event->event_id)
+    {
+    case MQTT_EVENT_CONNECTED:
+        outbox_post(OUTBOX_EV_CONNECTED, 0);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        outbox_post(OUTBOX_EV_DISCONNECTED, 0);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        outbox_post(OUTBOX_EV_PUBLISHED, event->msg_id);
+        break;
+    default:
+        break;
+    }
+}
+
+esp_err_t mqtt_outbox_publish(const char *topic_name, const void *data, size_t len)
+{
+    size_t topic_len = strlen(topic_name);
+    size_t size = OUTBOX_ALIGN(sizeof(outbox_record_hdr_t) + topic_len + len);
+
+    if (topic_len == 0 || topic_len > UINT8_MAX || topic_len + len > CONFIG_MQTT_OUTBOX_MAX_RECORD ||
+        size > sizeof(staging))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (staging_len + size > sizeof(staging))
+    {
+        err = outbox_flush_staging();
+    }
+    if (err == ESP_OK)
+    {
+        outbox_record_hdr_t *rec = (outbox_record_hdr_t *)(staging + staging_len);
+        memset(rec, 0, size);
+        rec->magic = OUTBOX_RECORD_MAGIC;
+        rec->topic_len = topic_len;
+        rec->len = len;
+        rec->seq = next_seq++;
+        memcpy(rec + 1, topic_name, topic_len);
+        memcpy((uint8_t *)(rec + 1) + topic_len, data, len);
+        rec->crc32 = outbox_record_crc(rec);
+        staging_len += size;
+        stats.queued++;
+    }
+    xSemaphoreGive(lock);
+
+    if (err == ESP_OK)
+    {
+        outbox_post(OUTBOX_EV_QUEUED, 0);
+    }
+    return err;
+}
+
+esp_err_t mqtt_outbox_flush(void)
+{
+    if (lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = outbox_flush_staging();
+    xSemaphoreGive(lock);
+    return err;
+}
+
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *out)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    out->pending = outbox_pending();
+    out->erase_min = UINT32_MAX;
+    out->erase_max = 0;
+    for (size_t i = 0; i < sector_count; i++)
+    {
+        if (sectors[i].erase_count < out->erase_min)
+        {
+            out->erase_min = sectors[i].erase_count;
+        }
+        if (sectors[i].erase_count > out->erase_max)
+        {
+            out->erase_max = sectors[i].erase_count;
+        }
+    }
+    xSemaphoreGive(lock);
+}
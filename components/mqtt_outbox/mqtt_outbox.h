@@ -0,0 +1,78 @@
+/*
+ * mqtt_outbox.h
+ *
+ * Store-and-forward outbox for MQTT publishes. Every message gets a sequence
+ * number and is kept until the broker acknowledges it, across disconnects,
+ * deep sleep and resets, so a flaky link delays data instead of losing it.
+ *
+ * Messages are staged in RAM first. When the staging buffer fills up, or on
+ * mqtt_outbox_flush before sleeping, the unacknowledged ones are appended to
+ * a ring of flash sectors in a dedicated data partition with a single write
+ * per sector they land in. Every sector carries an erase counter, and the
+ * next one written is the least worn of those holding no unacknowledged
+ * message, so sectors pinned by a long outage catch up once it is over. When
+ * every sector holds unacknowledged messages the oldest sector is reused and
+ * its messages are counted as dropped.
+ *
+ * Once MQTT_EVENT_CONNECTED fires the outbox replays in order, oldest first,
+ * in batches of MQTT_OUTBOX_BATCH QoS 1 publishes. The PUBACKs advance the
+ * tail, which is persisted in NVS once per batch, and only when the batch
+ * reached into flash. Delivery is at least once: a batch cut by a disconnect
+ * is sent again.
+ *
+ * Publishing and replay run in the outbox task, which hands messages to the
+ * client with esp_mqtt_client_enqueue and never waits on the network. The
+ * MQTT event handler only forwards events to it, so it never blocks the MQTT
+ * task.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+typedef struct
+{
+    uint32_t queued;       // messages accepted
+    uint32_t pending;      // queued and not acknowledged yet
+    uint32_t sent;         // publishes, replays included
+    uint32_t acked;
+    uint32_t dropped;      // overwritten in a full ring before being acked
+    uint32_t stored;       // messages written to flash
+    uint32_t flash_writes; // write calls they took
+    uint32_t erase_min;    // erase counts over the ring sectors
+    uint32_t erase_max;
+} mqtt_outbox_stats_t;
+
+/**
+ * Scans the ring in the data partition with the given label and starts the
+ * outbox task. Call after nvs_flash_init().
+ */
+esp_err_t mqtt_outbox_init(const char *partition_label);
+
+/**
+ * Sets the client the outbox publishes through. Call before the client is
+ * started, from then on pass its events to mqtt_outbox_handle_event.
+ */
+void mqtt_outbox_attach(esp_mqtt_client_handle_t client);
+
+/**
+ * Forwards CONNECTED, DISCONNECTED and PUBLISHED to the outbox, call it from
+ * the MQTT event handler.
+ */
+void mqtt_outbox_handle_event(esp_mqtt_event_handle_t event);
+
+/**
+ * Queues a message, published with QoS 1 as soon as the client is connected.
+ * Can be called from any task, also while offline.
+ */
+esp_err_t mqtt_outbox_publish(const char *topic, const void *data, size_t len);
+
+/**
+ * Writes the staged messages to flash, call before deep sleep.
+ */
+esp_err_t mqtt_outbox_flush(void);
+
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
@@ -0,0 +1,353 @@
+/*
+ * mqtt_pipeline.c
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "mqtt_pipeline.h"
+
+#if (CONFIG_MQTT_PIPELINE_SLOTS & (CONFIG_MQTT_PIPELINE_SLOTS - 1)) != 0
+#error "MQTT_PIPELINE_SLOTS must be a power of two"
+#endif
+
+#define SLOT_MASK (CONFIG_MQTT_PIPELINE_SLOTS - 1)
+#define SLOT_CANCELLED UINT16_MAX
+
+static const char *TAG = "mqtt_pipeline";
+
+// bounded queue after Dmitry Vyukov: a slot is free for the producer at
+// position pos when its sequence equals pos, and ready for the consumer when
+// it equals pos + 1. Producers race for positions with a CAS, the single
+// sender owns dequeue_pos.
+typedef struct
+{
+    uint32_t sequence;
+    int16_t topic;
+    uint16_t len;
+    uint8_t data[CONFIG_MQTT_PIPELINE_SLOT_SIZE];
+} pipeline_slot_t;
+
+typedef struct
+{
+    const char *name;
+    int qos;
+} pipeline_topic_t;
+
+static pipeline_slot_t slots[CONFIG_MQTT_PIPELINE_SLOTS];
+static uint32_t enqueue_pos;
+static uint32_t dequeue_pos;
+
+static pipeline_topic_t topics[CONFIG_MQTT_PIPELINE_MAX_TOPICS];
+static int topic_count;
+static portMUX_TYPE topics_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static mqtt_pipeline_sink_t sink;
+static void *sink_ctx;
+static TaskHandle_t sender;
+static mqtt_pipeline_stats_t stats;
+
+static esp_err_t pipeline_enqueue(const char *topic, const void *data, size_t len, int qos, void *ctx)
+{
+    // a zero length makes the client take strlen of the payload
+    int msg_id = esp_mqtt_client_enqueue(ctx, topic, len ? data : "", len, qos, 0, true);
+    return msg_id < 0 ? ESP_FAIL : ESP_OK;
+}
+
+static void pipeline_count(uint32_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void pipeline_wake(void)
+{
+    if (sender == NULL)
+    {
+        return;
+    }
+    if (xPortInIsrContext())
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(sender, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+    else
+    {
+        xTaskNotifyGive(sender);
+    }
+}
+
+void *mqtt_pipeline_claim(mqtt_pipeline_topic_t topic)
+{
+    if (topic < 0 || topic >= __atomic_load_n(&topic_count, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    pipeline_slot_t *slot;
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (true)
+    {
+        slot = &slots[pos & SLOT_MASK];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            // lost the race, pos now holds the current position
+        }
+        else if (diff < 0)
+        {
+            // the sender has not freed this slot yet: full
+            pipeline_count(&stats.rejected);
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    // depth as seen by this producer, claimed slots included
+    uint32_t depth = pos + 1 - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&stats.peak_depth, __ATOMIC_RELAXED);
+    while (depth > peak &&
+           !__atomic_compare_exchange_n(&stats.peak_depth, &peak, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    slot->topic = topic;
+    return slot->data;
+}
+
+static void pipeline_release(void *buf, uint16_t len)
+{
+    pipeline_slot_t *slot = (pipeline_slot_t *)((uint8_t *)buf - offsetof(pipeline_slot_t, data));
+    // the sequence still holds the claimed position, nobody else writes it
+    uint32_t pos = slot->sequence;
+
+    slot->len = len;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    // the sender only sleeps once it found the slot at dequeue_pos not ready
+    if (__atomic_load_n(&dequeue_pos, __ATOMIC_SEQ_CST) == pos)
+    {
+        pipeline_wake();
+    }
+}
+
+void mqtt_pipeline_commit(void *buf, size_t len)
+{
+    if (len > CONFIG_MQTT_PIPELINE_SLOT_SIZE)
+    {
+        pipeline_release(buf, SLOT_CANCELLED);
+        pipeline_count(&stats.rejected);
+        return;
+    }
+    pipeline_release(buf, len);
+    pipeline_count(&stats.published);
+}
+
+void mqtt_pipeline_cancel(void *buf)
+{
+    pipeline_release(buf, SLOT_CANCELLED);
+}
+
+esp_err_t mqtt_pipeline_publish(mqtt_pipeline_topic_t topic, const void *data, size_t len)
+{
+    if (len > CONFIG_MQTT_PIPELINE_SLOT_SIZE)
+    {
+        pipeline_count(&stats.rejected);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    void *buf = mqtt_pipeline_claim(topic);
+    if (buf == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(buf, data, len);
+    mqtt_pipeline_commit(buf, len);
+    return ESP_OK;
+}
+
+esp_err_t mqtt_pipeline_printf(mqtt_pipeline_topic_t topic, const char *format, ...)
+{
+    char *buf = mqtt_pipeline_claim(topic);
+    if (buf == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, CONFIG_MQTT_PIPELINE_SLOT_SIZE, format, args);
+    va_end(args);
+
+    if (len < 0 || len >= CONFIG_MQTT_PIPELINE_SLOT_SIZE)
+    {
+        mqtt_pipeline_cancel(buf);
+        pipeline_count(&stats.rejected);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    mqtt_pipeline_commit(buf, len);
+    return ESP_OK;
+}
+
+// hands up to one batch to the sink, returns how many slots it freed
+static int pipeline_drain_batch(void)
+{
+    int count = 0;
+
+    while (count < CONFIG_MQTT_PIPELINE_BATCH)
+    {
+        uint32_t pos = dequeue_pos;
+        pipeline_slot_t *slot = &slots[pos & SLOT_MASK];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+        {
+            // empty, or claimed and not committed yet
+            break;
+        }
+
+        if (slot->len != SLOT_CANCELLED)
+        {
+            const pipeline_topic_t *topic = &topics[slot->topic];
+            mqtt_pipeline_sink_t fn = __atomic_load_n(&sink, __ATOMIC_ACQUIRE);
+            if (fn != NULL && fn(topic->name, slot->data, slot->len, topic->qos, sink_ctx) == ESP_OK)
+            {
+                stats.sent++;
+            }
+            else
+            {
+                stats.failed++;
+            }
+        }
+
+        // frees the slot for the producer that wraps around to it
+        __atomic_store_n(&slot->sequence, pos + CONFIG_MQTT_PIPELINE_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&dequeue_pos, pos + 1, __ATOMIC_SEQ_CST);
+        count++;
+    }
+    return count;
+}
+
+static bool pipeline_ready(void)
+{
+    uint32_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&slots[pos & SLOT_MASK].sequence, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+static void pipeline_sender(void *arg)
+{
+    while (true)
+    {
+        if (!pipeline_ready())
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            if (CONFIG_MQTT_PIPELINE_LINGER_MS > 0)
+            {
+                vTaskDelay(pdMS_TO_TICKS(CONFIG_MQTT_PIPELINE_LINGER_MS));
+            }
+            continue;
+        }
+
+        if (pipeline_drain_batch() > 0)
+        {
+            stats.batches++;
+        }
+        // producers of the same priority get a turn between batches
+        taskYIELD();
+    }
+}
+
+esp_err_t mqtt_pipeline_init(void)
+{
+    if (sender != NULL)
+    {
+        return ESP_OK;
+    }
+    for (uint32_t i = 0; i < CONFIG_MQTT_PIPELINE_SLOTS; i++)
+    {
+        slots[i].sequence = i;
+    }
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    stats.capacity = CONFIG_MQTT_PIPELINE_SLOTS;
+
+    if (xTaskCreate(pipeline_sender, "mqtt_pipeline", 4096, NULL, 5, &sender) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "%d slots of %d bytes", CONFIG_MQTT_PIPELINE_SLOTS, CONFIG_MQTT_PIPELINE_SLOT_SIZE);
+    return ESP_OK;
+}
+
+mqtt_pipeline_topic_t mqtt_pipeline_register_topic(const char *topic, int qos)
+{
+    mqtt_pipeline_topic_t handle = MQTT_PIPELINE_TOPIC_INVALID;
+
+    taskENTER_CRITICAL(&topics_mux);
+    for (int i = 0; i < topic_count; i++)
+    {
+        if (strcmp(topics[i].name, topic) == 0 && topics[i].qos == qos)
+        {
+            handle = i;
+            break;
+        }
+    }
+    if (handle == MQTT_PIPELINE_TOPIC_INVALID && topic_count < CONFIG_MQTT_PIPELINE_MAX_TOPICS)
+    {
+        topics[topic_count].name = topic;
+        topics[topic_count].qos = qos;
+        handle = topic_count;
+        // published after the entry, claim reads the count first
+        __atomic_store_n(&topic_count, topic_count + 1, __ATOMIC_RELEASE);
+    }
+    taskEXIT_CRITICAL(&topics_mux);
+
+    if (handle == MQTT_PIPELINE_TOPIC_INVALID)
+    {
+        ESP_LOGE(TAG, "no handle left for %s", topic);
+    }
+    return handle;
+}
+
+void mqtt_pipeline_attach(esp_mqtt_client_handle_t client)
+{
+    mqtt_pipeline_set_sink(pipeline_enqueue, client);
+}
+
+void mqtt_pipeline_set_sink(mqtt_pipeline_sink_t fn, void *ctx)
+{
+    sink_ctx = ctx;
+    __atomic_store_n(&sink, fn, __ATOMIC_RELEASE);
+}
+
+esp_err_t mqtt_pipeline_drain(uint32_t timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    while (__atomic_load_n(&dequeue_pos, __ATOMIC_ACQUIRE) != __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE))
+    {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout_ms))
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(1);
+    }
+    return ESP_OK;
+}
+
+void mqtt_pipeline_get_stats(mqtt_pipeline_stats_t *out)
+{
+    *out = stats;
+    out->published = __atomic_load_n(&stats.published, __ATOMIC_RELAXED);
+    out->rejected = __atomic_load_n(&stats.rejected, __ATOMIC_RELAXED);
+    out->depth = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,112 @@
+/*
+ * mqtt_pipeline.h
+ *
+ * Non-blocking publish path for sampling tasks. Topics are registered once
+ * and referred to by handle afterwards. A message is written by its producer
+ * straight into a fixed-size slot of a lock-free queue: claim a slot, fill
+ * it, commit it. Producers never allocate, never take a lock and never wait.
+ * When every slot is taken the message is rejected and counted.
+ *
+ * A single sender task drains the queue in batches of MQTT_PIPELINE_BATCH
+ * into a sink. The default sink is esp_mqtt_client_enqueue, which only
+ * queues the message for the MQTT task, so a slow broker backs up the queue
+ * instead of stalling the producers. The queue depth and its peak are kept
+ * in the stats for monitoring.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+typedef int mqtt_pipeline_topic_t;
+
+#define MQTT_PIPELINE_TOPIC_INVALID (-1)
+
+/**
+ * Takes one message off the queue, called by the sender task.
+ */
+typedef esp_err_t (*mqtt_pipeline_sink_t)(const char *topic, const void *data, size_t len, int qos, void *ctx);
+
+typedef struct
+{
+    uint32_t capacity;   // slots
+    uint32_t depth;      // messages waiting for the sender right now
+    uint32_t peak_depth;
+    uint32_t published;  // messages committed by producers
+    uint32_t rejected;   // found no free slot
+    uint32_t sent;       // taken by the sink
+    uint32_t failed;     // refused by the sink, dropped
+    uint32_t batches;
+} mqtt_pipeline_stats_t;
+
+/**
+ * Sets up the queue and starts the sender task.
+ */
+esp_err_t mqtt_pipeline_init(void);
+
+/**
+ * Registers a topic, at startup, before anything is published to it. The
+ * string must stay valid.
+ *
+ * @return the handle, MQTT_PIPELINE_TOPIC_INVALID when the table is full.
+ */
+mqtt_pipeline_topic_t mqtt_pipeline_register_topic(const char *topic, int qos);
+
+/**
+ * Sends through esp_mqtt_client_enqueue on client.
+ */
+void mqtt_pipeline_attach(esp_mqtt_client_handle_t client);
+
+/**
+ * Sends through sink instead, e.g. into a store-and-forward outbox.
+ */
+void mqtt_pipeline_set_sink(mqtt_pipeline_sink_t sink, void *ctx);
+
+/**
+ * Claims a slot for a message on topic. Fill at most MQTT_PIPELINE_SLOT_SIZE
+ * bytes of the returned buffer and pass it to mqtt_pipeline_commit, or to
+ * mqtt_pipeline_cancel: the sender waits for a claimed slot, do not hold it.
+ * Safe from any task and from ISRs.
+ *
+ * @return the payload buffer, NULL when the queue is full.
+ */
+void *mqtt_pipeline_claim(mqtt_pipeline_topic_t topic);
+
+/**
+ * Hands a claimed slot holding len bytes over to the sender.
+ */
+void mqtt_pipeline_commit(void *buf, size_t len);
+
+/**
+ * Gives a claimed slot back without sending it.
+ */
+void mqtt_pipeline_cancel(void *buf);
+
+/**
+ * Copies data into a slot and commits it.
+ *
+ * @return ESP_ERR_NO_MEM when the queue is full, ESP_ERR_INVALID_SIZE when
+ *         len does not fit a slot.
+ */
+esp_err_t mqtt_pipeline_publish(mqtt_pipeline_topic_t topic, const void *data, size_t len);
+
+/**
+ * Formats straight into a slot and commits it. Output that does not fit a
+ * slot is not sent.
+ *
+ * @return as mqtt_pipeline_publish.
+ */
+esp_err_t mqtt_pipeline_printf(mqtt_pipeline_topic_t topic, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Waits until the sender emptied the queue, e.g. before deep sleep.
+ *
+ * @return ESP_ERR_TIMEOUT when messages are still queued after timeout_ms.
+ */
+esp_err_t mqtt_pipeline_drain(uint32_t timeout_ms);
+
+void mqtt_pipeline_get_stats(mqtt_pipeline_stats_t *stats);
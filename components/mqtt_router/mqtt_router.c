@@ -0,0 +1,551 @@
+/*
+ * mqtt_router.c
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "mqtt_router.h"
+
+#if CONFIG_MQTT_ROUTER_MAX_NODES > UINT16_MAX || CONFIG_MQTT_ROUTER_MAX_ROUTES >= UINT16_MAX
+#error "mqtt_router indexes nodes and routes with 16 bits"
+#endif
+
+// twice the nodes keeps the probe sequences short and the table never full
+#define ROUTER_CHILD_SLOTS (2 * CONFIG_MQTT_ROUTER_MAX_NODES)
+// node 0 is the root, which is nobody's child, and route 0 is unused: 0
+// means none in every link
+#define ROUTER_NONE 0
+
+static const char *TAG = "mqtt_router";
+
+typedef struct
+{
+    const char *level; // points into the filter that created the node
+    uint16_t level_len;
+    uint16_t plus;     // child for +
+    uint16_t hash;     // child for #
+    uint16_t routes;   // first route ending here
+} router_node_t;
+
+typedef struct
+{
+    uint16_t parent;
+    uint16_t child;
+} router_child_t;
+
+typedef struct
+{
+    const char *filter;
+    int qos;
+    mqtt_router_handler_t handler; // NULL for a stream
+    const mqtt_router_sink_t *sink;
+    void *ctx;
+    uint16_t node;
+    uint16_t next; // next route on the same node
+} router_route_t;
+
+static router_node_t nodes[CONFIG_MQTT_ROUTER_MAX_NODES];
+static uint16_t node_count = 1;
+static router_child_t children[ROUTER_CHILD_SLOTS];
+static router_route_t routes[CONFIG_MQTT_ROUTER_MAX_ROUTES + 1];
+static uint16_t route_count;
+
+static esp_mqtt_client_handle_t client;
+static bool connected;
+static mqtt_router_stats_t stats;
+
+typedef struct
+{
+    uint16_t route;
+    esp_err_t err; // of the sink, it gets no more data once set
+} router_match_t;
+
+// routes matching the message being received, a message only arrives
+// after the last fragment of the previous one
+static struct
+{
+    bool open;        // fragments still to come
+    bool reassemble;  // handlers run on buf once it is complete
+    int topic_len;
+    size_t offset;    // next fragment expected
+    size_t total;
+    uint16_t count;
+    router_match_t match[CONFIG_MQTT_ROUTER_MAX_ROUTES];
+} rx;
+
+#if CONFIG_MQTT_ROUTER_REASSEMBLY_SIZE > 0
+// topic, then payload
+static char rx_buf[CONFIG_MQTT_ROUTER_REASSEMBLY_SIZE];
+#endif
+
+// FNV-1a over the level, seeded with the parent
+static uint32_t router_hash_seed(uint16_t parent)
+{
+    return 2166136261u ^ parent;
+}
+
+static uint32_t router_hash_step(uint32_t h, char c)
+{
+    return (h ^ (uint8_t)c) * 16777619u;
+}
+
+static uint16_t router_find_child(uint16_t parent, const char *level, size_t len, uint32_t h)
+{
+    for (uint32_t i = h % ROUTER_CHILD_SLOTS; children[i].child != ROUTER_NONE; i = (i + 1) % ROUTER_CHILD_SLOTS)
+    {
+        const router_node_t *node = &nodes[children[i].child];
+        if (children[i].parent == parent && node->level_len == len && memcmp(node->level, level, len) == 0)
+        {
+            return children[i].child;
+        }
+    }
+    return ROUTER_NONE;
+}
+
+static uint16_t router_new_node(const char *level, size_t len)
+{
+    if (node_count == CONFIG_MQTT_ROUTER_MAX_NODES || len > UINT16_MAX)
+    {
+        return ROUTER_NONE;
+    }
+    router_node_t *node = &nodes[node_count];
+    node->level = level;
+    node->level_len = len;
+    return node_count++;
+}
+
+// finds or creates the child of parent for one filter level
+static uint16_t router_add_child(uint16_t parent, const char *level, size_t len)
+{
+    if (len == 1 && (level[0] == '+' || level[0] == '#'))
+    {
+        uint16_t *link = level[0] == '+' ? &nodes[parent].plus : &nodes[parent].hash;
+        if (*link == ROUTER_NONE)
+        {
+            *link = router_new_node(level, len);
+        }
+        return *link;
+    }
+
+    uint32_t h = router_hash_seed(parent);
+    for (size_t i = 0; i < len; i++)
+    {
+        h = router_hash_step(h, level[i]);
+    }
+    uint16_t child = router_find_child(parent, level, len, h);
+    if (child != ROUTER_NONE)
+    {
+        return child;
+    }
+
+    child = router_new_node(level, len);
+    if (child == ROUTER_NONE)
+    {
+        return ROUTER_NONE;
+    }
+    uint32_t i = h % ROUTER_CHILD_SLOTS;
+    while (children[i].child != ROUTER_NONE)
+    {
+        i = (i + 1) % ROUTER_CHILD_SLOTS;
+    }
+    children[i].parent = parent;
+    children[i].child = child;
+    return child;
+}
+
+// + and # only as a whole level, # only as the last one
+static bool router_filter_valid(const char *filter)
+{
+    size_t len = strlen(filter);
+    if (len == 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        bool level_start = i == 0 || filter[i - 1] == '/';
+        bool level_end = i + 1 == len || filter[i + 1] == '/';
+        if (filter[i] == '+' && !(level_start && level_end))
+        {
+            return false;
+        }
+        if (filter[i] == '#' && !(level_start && i + 1 == len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void router_subscribe(uint16_t node)
+{
+    int qos = 0;
+    for (uint16_t r = nodes[node].routes; r != ROUTER_NONE; r = routes[r].next)
+    {
+        qos = routes[r].qos > qos ? routes[r].qos : qos;
+    }
+    const char *filter = routes[nodes[node].routes].filter;
+    int msg_id = esp_mqtt_client_subscribe(client, filter, qos);
+    ESP_LOGI(TAG, "subscribed %s, qos %d, msg_id=%d", filter, qos, msg_id);
+}
+
+static esp_err_t router_add(const char *filter, int qos, mqtt_router_handler_t handler,
+                            const mqtt_router_sink_t *sink, void *ctx)
+{
+    if (!router_filter_valid(filter))
+    {
+        ESP_LOGE(TAG, "bad filter %s", filter);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (route_count == CONFIG_MQTT_ROUTER_MAX_ROUTES)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint16_t node = 0;
+    const char *level = filter;
+    while (true)
+    {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+        node = router_add_child(node, level, len);
+        if (node == ROUTER_NONE)
+        {
+            ESP_LOGE(TAG, "no trie node left for %s", filter);
+            return ESP_ERR_NO_MEM;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        level = end + 1;
+    }
+
+    uint16_t r = ++route_count;
+    routes[r] = (router_route_t){
+        .filter = filter,
+        .qos = qos,
+        .handler = handler,
+        .sink = sink,
+        .ctx = ctx,
+        .node = node};
+
+    // appended, handlers of one filter run in the order they were added
+    uint16_t *link = &nodes[node].routes;
+    while (*link != ROUTER_NONE)
+    {
+        link = &routes[*link].next;
+    }
+    *link = r;
+
+    if (client != NULL && connected)
+    {
+        router_subscribe(node);
+    }
+    return ESP_OK;
+}
+
+esp_err_t mqtt_router_add(const char *filter, int qos, mqtt_router_handler_t handler, void *ctx)
+{
+    if (handler == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return router_add(filter, qos, handler, NULL, ctx);
+}
+
+esp_err_t mqtt_router_add_stream(const char *filter, int qos, const mqtt_router_sink_t *sink, void *ctx)
+{
+    if (sink == NULL || sink->data == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return router_add(filter, qos, NULL, sink, ctx);
+}
+
+static void router_collect(uint16_t r)
+{
+    for (; r != ROUTER_NONE; r = routes[r].next)
+    {
+        rx.match[rx.count++] = (router_match_t){.route = r, .err = ESP_OK};
+    }
+}
+
+// matches the level of topic starting at pos below node, pos past the end
+// once every level was consumed, and collects the routes into rx
+static void router_match(uint16_t node, const char *topic, int len, int pos)
+{
+    const router_node_t *n = &nodes[node];
+    // wildcards at the root do not match topics starting with $
+    bool wildcards = !(node == 0 && len > 0 && topic[0] == '$');
+
+    // # matches the parent level too: "a/#" takes "a"
+    if (wildcards && n->hash != ROUTER_NONE)
+    {
+        router_collect(nodes[n->hash].routes);
+    }
+    if (pos > len)
+    {
+        router_collect(n->routes);
+        return;
+    }
+
+    int end = pos;
+    uint32_t h = router_hash_seed(node);
+    while (end < len && topic[end] != '/')
+    {
+        h = router_hash_step(h, topic[end]);
+        end++;
+    }
+
+    uint16_t child = router_find_child(node, topic + pos, end - pos, h);
+    if (child != ROUTER_NONE)
+    {
+        router_match(child, topic, len, end + 1);
+    }
+    if (wildcards && n->plus != ROUTER_NONE)
+    {
+        router_match(n->plus, topic, len, end + 1);
+    }
+}
+
+// the sinks that declined the message or failed are skipped from then on
+static void router_sink_begin(const char *topic, int topic_len, size_t total)
+{
+    for (uint16_t i = 0; i < rx.count; i++)
+    {
+        const router_route_t *route = &routes[rx.match[i].route];
+        if (route->sink != NULL && route->sink->begin != NULL)
+        {
+            rx.match[i].err = route->sink->begin(topic, topic_len, total, route->ctx);
+        }
+    }
+}
+
+static void router_sink_data(const char *data, size_t len, size_t offset)
+{
+    for (uint16_t i = 0; i < rx.count; i++)
+    {
+        const router_route_t *route = &routes[rx.match[i].route];
+        if (route->sink != NULL && rx.match[i].err == ESP_OK)
+        {
+            rx.match[i].err = route->sink->data(data, len, offset, route->ctx);
+        }
+    }
+}
+
+static int router_sink_end(esp_err_t result)
+{
+    int calls = 0;
+    for (uint16_t i = 0; i < rx.count; i++)
+    {
+        const router_route_t *route = &routes[rx.match[i].route];
+        if (route->sink == NULL)
+        {
+            continue;
+        }
+        if (route->sink->end != NULL)
+        {
+            route->sink->end(result != ESP_OK ? result : rx.match[i].err, route->ctx);
+        }
+        calls += rx.match[i].err == ESP_OK;
+    }
+    return calls;
+}
+
+static int router_run_handlers(esp_mqtt_event_handle_t event)
+{
+    int calls = 0;
+    for (uint16_t i = 0; i < rx.count; i++)
+    {
+        const router_route_t *route = &routes[rx.match[i].route];
+        if (route->handler != NULL)
+        {
+            route->handler(event, route->ctx);
+            calls++;
+        }
+    }
+    return calls;
+}
+
+static void router_match_topic(const char *topic, int topic_len)
+{
+    rx.count = 0;
+    router_match(0, topic, topic_len, 0);
+
+    stats.messages++;
+    if (rx.count == 0)
+    {
+        stats.unmatched++;
+        ESP_LOGW(TAG, "no route for %.*s", topic_len, topic);
+    }
+}
+
+int mqtt_router_dispatch(esp_mqtt_event_handle_t event)
+{
+    router_match_topic(event->topic, event->topic_len);
+
+    // a whole message goes through the sinks in one piece
+    router_sink_begin(event->topic, event->topic_len, event->data_len);
+    router_sink_data(event->data, event->data_len, 0);
+    int calls = router_sink_end(ESP_OK) + router_run_handlers(event);
+
+    stats.calls += calls;
+    return calls;
+}
+
+static bool router_has_handlers(void)
+{
+    for (uint16_t i = 0; i < rx.count; i++)
+    {
+        if (routes[rx.match[i].route].handler != NULL)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void router_abort(const char *why)
+{
+    ESP_LOGW(TAG, "message cut at %d of %d bytes: %s", (int)rx.offset, (int)rx.total, why);
+    router_sink_end(ESP_FAIL);
+    stats.aborted++;
+    rx.open = false;
+}
+
+// first fragment of a message larger than the client buffer
+static void router_rx_begin(esp_mqtt_event_handle_t event)
+{
+    router_match_topic(event->topic, event->topic_len);
+    rx.open = true;
+    rx.offset = 0;
+    rx.total = event->total_data_len;
+    rx.topic_len = event->topic_len;
+    rx.reassemble = false;
+
+    if (router_has_handlers())
+    {
+#if CONFIG_MQTT_ROUTER_REASSEMBLY_SIZE > 0
+        rx.reassemble = (size_t)event->topic_len + rx.total <= sizeof(rx_buf);
+        if (rx.reassemble)
+        {
+            memcpy(rx_buf, event->topic, event->topic_len);
+        }
+#endif
+        if (!rx.reassemble)
+        {
+            // only the streams see it
+            stats.oversized++;
+            ESP_LOGW(TAG, "%d bytes on %.*s do not fit the reassembly buffer, handlers skipped", (int)rx.total,
+                     event->topic_len, event->topic);
+        }
+    }
+    router_sink_begin(event->topic, event->topic_len, rx.total);
+}
+
+static void router_receive(esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset == 0 && rx.open)
+    {
+        router_abort("a new message started");
+    }
+    if (event->current_data_offset == 0 && event->data_len >= event->total_data_len)
+    {
+        mqtt_router_dispatch(event);
+        return;
+    }
+
+    stats.fragments++;
+    if (event->current_data_offset == 0)
+    {
+        router_rx_begin(event);
+    }
+    else if (!rx.open)
+    {
+        // the start was lost, or the message was already given up on
+        return;
+    }
+    else if ((size_t)event->current_data_offset != rx.offset)
+    {
+        router_abort("fragment out of order");
+        return;
+    }
+
+    router_sink_data(event->data, event->data_len, rx.offset);
+#if CONFIG_MQTT_ROUTER_REASSEMBLY_SIZE > 0
+    if (rx.reassemble)
+    {
+        memcpy(rx_buf + rx.topic_len + rx.offset, event->data, event->data_len);
+    }
+#endif
+    rx.offset += event->data_len;
+    if (rx.offset < rx.total)
+    {
+        return;
+    }
+
+    rx.open = false;
+    int calls = router_sink_end(ESP_OK);
+#if CONFIG_MQTT_ROUTER_REASSEMBLY_SIZE > 0
+    if (rx.reassemble)
+    {
+        // the handlers get the last event, pointed at the whole message
+        esp_mqtt_event_t whole = *event;
+        whole.topic = rx_buf;
+        whole.topic_len = rx.topic_len;
+        whole.data = rx_buf + rx.topic_len;
+        whole.data_len = rx.total;
+        whole.current_data_offset = 0;
+        calls += router_run_handlers(&whole);
+        stats.reassembled++;
+    }
+#endif
+    stats.calls += calls;
+}
+
+void mqtt_router_attach(esp_mqtt_client_handle_t mqtt_client)
+{
+    client = mqtt_client;
+    connected = false;
+}
+
+void mqtt_router_handle_event(esp_mqtt_event_handle_t event)
+{
+    switch (event->event_id)
+    {
+    case MQTT_EVENT_CONNECTED:
+        connected = true;
+        for (uint16_t node = 0; node < node_count; node++)
+        {
+            if (nodes[node].routes != ROUTER_NONE)
+            {
+                router_subscribe(node);
+            }
+        }
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        connected = false;
+        if (rx.open)
+        {
+            router_abort("disconnected");
+        }
+        break;
+    case MQTT_EVENT_DATA:
+        // a message larger than the client buffer comes in fragments, only
+        // the first one carries the topic
+        router_receive(event);
+        break;
+    default:
+        break;
+    }
+}
+
+void mqtt_router_get_stats(mqtt_router_stats_t *out)
+{
+    *out = stats;
+    out->nodes = node_count;
+    out->routes = route_count;
+}
@@ -0,0 +1,98 @@
+/*
+ * mqtt_router.h
+ *
+ * Dispatches MQTT_EVENT_DATA to handlers registered on topic filters, with
+ * the + and # wildcards. Filters are stored in a trie with one node per
+ * topic level. The children of a node are found through a hash table keyed
+ * by parent and level, so matching an incoming topic costs one pass over
+ * its bytes whatever the number of filters, plus one branch per + along the
+ * way. The topic is matched in place in the event, nothing is copied.
+ *
+ * Every filter is subscribed on the broker on MQTT_EVENT_CONNECTED, so
+ * routes survive reconnects and can be registered before the client starts.
+ *
+ * A message larger than the client buffer arrives as several DATA events,
+ * and only the first one carries the topic. Stream routes get such a message
+ * piece by piece through a sink, as it comes in, so a config file or a
+ * firmware chunk can go straight to flash or a parser with no buffer the
+ * size of the message. Handler routes get whole messages only. Fragmented
+ * ones are reassembled for them, topic included, in a static buffer of
+ * MQTT_ROUTER_REASSEMBLY_SIZE bytes. Messages that do not fit are only
+ * given to the streams.
+ *
+ * Routes are registered at startup or from a handler, and handlers run in
+ * the MQTT task.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+typedef void (*mqtt_router_handler_t)(esp_mqtt_event_handle_t event, void *ctx);
+
+/**
+ * Receives one message in order, in as many data calls as it came in. An
+ * error from begin or data ends the delivery to that sink. Any callback but
+ * data may be NULL.
+ */
+typedef struct
+{
+    // the topic is only valid during the call
+    esp_err_t (*begin)(const char *topic, int topic_len, size_t total_len, void *ctx);
+    esp_err_t (*data)(const char *data, size_t len, size_t offset, void *ctx);
+    // ESP_OK once every byte was taken, else what stopped it: the error of
+    // the sink, or ESP_FAIL when the message was cut by a disconnect
+    void (*end)(esp_err_t result, void *ctx);
+} mqtt_router_sink_t;
+
+typedef struct
+{
+    uint16_t nodes;     // trie nodes in use
+    uint16_t routes;
+    uint32_t messages;  // MQTT_EVENT_DATA dispatched
+    uint32_t unmatched; // of which no route took
+    uint32_t calls;     // handler calls and streams delivered
+    uint32_t fragments; // DATA events of messages that came in pieces
+    uint32_t reassembled;
+    uint32_t oversized; // fragmented messages too large for the handlers
+    uint32_t aborted;   // cut before the last fragment
+} mqtt_router_stats_t;
+
+/**
+ * Routes messages matching filter to handler. The filter string must stay
+ * valid. Subscribes right away when the client is connected.
+ *
+ * @return ESP_ERR_INVALID_ARG for a malformed filter, ESP_ERR_NO_MEM when
+ *         the trie or the route table is full.
+ */
+esp_err_t mqtt_router_add(const char *filter, int qos, mqtt_router_handler_t handler, void *ctx);
+
+/**
+ * Like mqtt_router_add, for a route that streams messages into sink. The
+ * sink must stay valid.
+ */
+esp_err_t mqtt_router_add_stream(const char *filter, int qos, const mqtt_router_sink_t *sink, void *ctx);
+
+/**
+ * Sets the client to subscribe through, then pass its events to
+ * mqtt_router_handle_event.
+ */
+void mqtt_router_attach(esp_mqtt_client_handle_t client);
+
+/**
+ * Subscribes every filter on CONNECTED and dispatches DATA, call it from the
+ * MQTT event handler.
+ */
+void mqtt_router_handle_event(esp_mqtt_event_handle_t event);
+
+/**
+ * Delivers a whole message to every route matching the topic of event, in
+ * one piece.
+ *
+ * @return how many handlers ran and streams took it.
+ */
+int mqtt_router_dispatch(esp_mqtt_event_handle_t event);
+
+void mqtt_router_get_stats(mqtt_router_stats_t *stats);
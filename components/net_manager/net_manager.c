@@ -0,0 +1,338 @@
+/*
+ * net_manager.c
+ */
+
+#include <string.h>
+#include "esp_eth.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/event_groups.h"
+#include "sdkconfig.h"
+#include "boot_prof.h"
+#include "net_manager.h"
+
+#define NET_MANAGER_READY_BIT BIT0
+
+ESP_EVENT_DEFINE_BASE(NET_MANAGER_EVENT);
+
+static const char *TAG = "net_manager";
+
+typedef struct
+{
+    esp_netif_t *netif; // NULL when the link is not enabled
+    bool up;            // link has an ip
+    esp_netif_ip_info_t ip_info;
+} net_link_state_t;
+
+// only touched from the default event loop task, after net_manager_start
+static net_link_state_t links[NET_LINK_COUNT];
+static net_link_t active = NET_LINK_NONE;
+static EventGroupHandle_t net_event_group;
+static esp_timer_handle_t wifi_retry_timer;
+static uint32_t wifi_backoff_ms;
+// first ip of each link, for the boot profile
+static const char *got_ip_marks[NET_LINK_COUNT] = {"eth got ip", "wifi got ip"};
+
+const char *net_manager_link_name(net_link_t link)
+{
+    switch (link)
+    {
+    case NET_LINK_ETH:
+        return "eth";
+    case NET_LINK_WIFI:
+        return "wifi";
+    default:
+        return "none";
+    }
+}
+
+static void net_manager_post(net_manager_event_id_t id)
+{
+    net_manager_event_t event = {
+        .link = active};
+    if (active != NET_LINK_NONE)
+    {
+        event.ip_info = links[active].ip_info;
+    }
+
+    // we run in the event loop task, blocking on its own full queue would deadlock
+    if (esp_event_post(NET_MANAGER_EVENT, id, &event, sizeof(event), 0) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "event loop full, network event %d lost", id);
+    }
+}
+
+static void net_manager_link_up(net_link_t link, const esp_netif_ip_info_t *ip_info)
+{
+    if (got_ip_marks[link] != NULL)
+    {
+        boot_prof_mark(got_ip_marks[link]);
+        got_ip_marks[link] = NULL;
+    }
+    links[link].up = true;
+    links[link].ip_info = *ip_info;
+    ESP_LOGI(TAG, "%s got ip " IPSTR ", mask " IPSTR ", gw " IPSTR, net_manager_link_name(link),
+             IP2STR(&ip_info->ip), IP2STR(&ip_info->netmask), IP2STR(&ip_info->gw));
+
+    if (active == NET_LINK_NONE)
+    {
+        active = link;
+        esp_netif_set_default_netif(links[link].netif);
+        xEventGroupSetBits(net_event_group, NET_MANAGER_READY_BIT);
+        ESP_LOGI(TAG, "network ready on %s", net_manager_link_name(link));
+        net_manager_post(NET_MANAGER_EVENT_READY);
+    }
+}
+
+static void net_manager_link_down(net_link_t link)
+{
+    if (!links[link].up)
+    {
+        return;
+    }
+    links[link].up = false;
+    ESP_LOGW(TAG, "%s down", net_manager_link_name(link));
+
+    if (link != active)
+    {
+        return;
+    }
+
+    net_link_t other = link == NET_LINK_ETH ? NET_LINK_WIFI : NET_LINK_ETH;
+    if (links[other].up)
+    {
+        active = other;
+        esp_netif_set_default_netif(links[other].netif);
+        ESP_LOGI(TAG, "failover to %s", net_manager_link_name(other));
+        net_manager_post(NET_MANAGER_EVENT_SWITCHED);
+    }
+    else
+    {
+        active = NET_LINK_NONE;
+        xEventGroupClearBits(net_event_group, NET_MANAGER_READY_BIT);
+        ESP_LOGW(TAG, "network lost");
+        net_manager_post(NET_MANAGER_EVENT_LOST);
+    }
+}
+
+static void net_manager_wifi_retry(void *arg)
+{
+    esp_wifi_connect();
+}
+
+static void net_manager_wifi_reconnect(void)
+{
+    if (wifi_backoff_ms == 0)
+    {
+        esp_wifi_connect();
+        wifi_backoff_ms = 1000;
+        return;
+    }
+
+    ESP_LOGI(TAG, "wifi reconnect in %d ms", (int)wifi_backoff_ms);
+    esp_timer_start_once(wifi_retry_timer, wifi_backoff_ms * 1000ULL);
+    wifi_backoff_ms *= 2;
+    if (wifi_backoff_ms > CONFIG_NET_MANAGER_WIFI_MAX_BACKOFF_MS)
+    {
+        wifi_backoff_ms = CONFIG_NET_MANAGER_WIFI_MAX_BACKOFF_MS;
+    }
+}
+
+static void net_manager_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (event_base == ETH_EVENT)
+    {
+        uint8_t mac_addr[6] = {0};
+        esp_eth_handle_t eth_handle = *(esp_eth_handle_t *)event_data;
+
+        switch (event_id)
+        {
+        case ETHERNET_EVENT_CONNECTED:
+            esp_eth_ioctl(eth_handle, ETH_CMD_G_MAC_ADDR, mac_addr);
+            ESP_LOGI(TAG, "eth link up, HW addr %02x:%02x:%02x:%02x:%02x:%02x",
+                     mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+            break;
+        case ETHERNET_EVENT_DISCONNECTED:
+            // the ip is only dropped after IP_LOST_TIMER, the link is gone now
+            net_manager_link_down(NET_LINK_ETH);
+            break;
+        default:
+            break;
+        }
+    }
+    else if (event_base == WIFI_EVENT)
+    {
+        switch (event_id)
+        {
+        case WIFI_EVENT_STA_START:
+            esp_wifi_connect();
+            break;
+        case WIFI_EVENT_STA_CONNECTED:
+            ESP_LOGI(TAG, "wifi associated");
+            break;
+        case WIFI_EVENT_STA_DISCONNECTED:
+            net_manager_link_down(NET_LINK_WIFI);
+            net_manager_wifi_reconnect();
+            break;
+        default:
+            break;
+        }
+    }
+    else if (event_base == IP_EVENT)
+    {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+
+        switch (event_id)
+        {
+        case IP_EVENT_ETH_GOT_IP:
+            net_manager_link_up(NET_LINK_ETH, &event->ip_info);
+            break;
+        case IP_EVENT_STA_GOT_IP:
+            wifi_backoff_ms = 0;
+            net_manager_link_up(NET_LINK_WIFI, &event->ip_info);
+            break;
+        case IP_EVENT_ETH_LOST_IP:
+            net_manager_link_down(NET_LINK_ETH);
+            break;
+        case IP_EVENT_STA_LOST_IP:
+            net_manager_link_down(NET_LINK_WIFI);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static esp_err_t net_manager_start_eth(const net_manager_config_t *config)
+{
+    eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
+    eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+#if CONFIG_ETH_USE_OPENETH
+    // QEMU: open_eth MAC, any PHY driver answers its MDIO
+    phy_config.autonego_timeout_ms = 100;
+    esp_eth_mac_t *mac = esp_eth_mac_new_openeth(&mac_config);
+    esp_eth_phy_t *phy = esp_eth_phy_new_dp83848(&phy_config);
+#elif CONFIG_ETH_USE_ESP32_EMAC
+    eth_esp32_emac_config_t esp32_emac_config = ETH_ESP32_EMAC_DEFAULT_CONFIG();
+    esp32_emac_config.smi_mdc_gpio_num = config->eth_mdc_gpio;
+    esp32_emac_config.smi_mdio_gpio_num = config->eth_mdio_gpio;
+    esp_eth_mac_t *mac = esp_eth_mac_new_esp32(&esp32_emac_config, &mac_config);
+
+    phy_config.phy_addr = config->eth_phy_addr;
+    phy_config.reset_gpio_num = config->eth_phy_reset_gpio;
+    esp_eth_phy_t *phy = esp_eth_phy_new_lan87xx(&phy_config);
+#else
+    ESP_LOGE(TAG, "no ethernet MAC enabled in sdkconfig");
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+
+    esp_eth_config_t eth_config = ETH_DEFAULT_CONFIG(mac, phy);
+    esp_eth_handle_t eth_handle = NULL;
+    esp_err_t err = esp_eth_driver_install(&eth_config, &eth_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "ethernet driver install failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    esp_netif_config_t netif_config = ESP_NETIF_DEFAULT_ETH();
+    esp_netif_t *netif = esp_netif_new(&netif_config);
+
+    if (config->eth_static_ip != NULL)
+    {
+        esp_netif_dhcpc_stop(netif);
+        err = esp_netif_set_ip_info(netif, config->eth_static_ip);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "static ip not set: %s", esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    err = esp_netif_attach(netif, esp_eth_new_netif_glue(eth_handle));
+    if (err == ESP_OK)
+    {
+        err = esp_eth_start(eth_handle);
+    }
+    links[NET_LINK_ETH].netif = netif;
+    return err;
+}
+
+static esp_err_t net_manager_start_wifi(const net_manager_config_t *config)
+{
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = net_manager_wifi_retry,
+        .name = "wifi_retry"};
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &wifi_retry_timer));
+
+    links[NET_LINK_WIFI].netif = esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    esp_err_t err = esp_wifi_init(&init_config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "wifi init failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    wifi_config_t wifi_config = {0};
+    strlcpy((char *)wifi_config.sta.ssid, config->wifi_ssid, sizeof(wifi_config.sta.ssid));
+    strlcpy((char *)wifi_config.sta.password, config->wifi_password, sizeof(wifi_config.sta.password));
+    wifi_config.sta.threshold.authmode = config->wifi_password[0] ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    return esp_wifi_start();
+}
+
+esp_err_t net_manager_start(const net_manager_config_t *config)
+{
+    net_event_group = xEventGroupCreate();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    esp_err_t err = esp_event_loop_create_default();
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+    {
+        return err;
+    }
+
+    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, net_manager_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, net_manager_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, net_manager_event_handler, NULL));
+
+    // both links come up in parallel, whichever gets an ip first wins
+    esp_err_t eth_err = ESP_ERR_NOT_SUPPORTED;
+    esp_err_t wifi_err = ESP_ERR_NOT_SUPPORTED;
+    if (config->eth)
+    {
+        int span = boot_prof_begin("eth start");
+        eth_err = net_manager_start_eth(config);
+        boot_prof_end(span);
+    }
+    if (config->wifi)
+    {
+        int span = boot_prof_begin("wifi start");
+        wifi_err = net_manager_start_wifi(config);
+        boot_prof_end(span);
+    }
+
+    if (eth_err != ESP_OK && wifi_err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "no link could be started");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "started:%s%s", eth_err == ESP_OK ? " eth" : "", wifi_err == ESP_OK ? " wifi" : "");
+    return ESP_OK;
+}
+
+bool net_manager_wait_ready(TickType_t timeout)
+{
+    return xEventGroupWaitBits(net_event_group, NET_MANAGER_READY_BIT, pdFALSE, pdTRUE, timeout) &
+           NET_MANAGER_READY_BIT;
+}
+
+net_link_t net_manager_active_link(void)
+{
+    return active;
+}
@@ -0,0 +1,93 @@
+/*
+ * net_manager.h
+ *
+ * Brings up Ethernet (ESP32 EMAC + LAN87xx, or open_eth under QEMU) and
+ * Wi-Fi STA in parallel. The first link that gets an IP becomes the active
+ * one and the default route. When it goes down the manager fails over to the
+ * other link if that one has an IP, and keeps reconnecting the lost one.
+ *
+ * The rest of the app only listens to NET_MANAGER_EVENT:
+ *  - NET_MANAGER_EVENT_READY, once connectivity is there, again after a LOST
+ *  - NET_MANAGER_EVENT_SWITCHED, the active link changed without a gap
+ *  - NET_MANAGER_EVENT_LOST, no link left
+ * READY and SWITCHED carry a net_manager_event_t.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "freertos/FreeRTOS.h"
+
+ESP_EVENT_DECLARE_BASE(NET_MANAGER_EVENT);
+
+typedef enum
+{
+    NET_MANAGER_EVENT_READY,
+    NET_MANAGER_EVENT_SWITCHED,
+    NET_MANAGER_EVENT_LOST,
+} net_manager_event_id_t;
+
+typedef enum
+{
+    NET_LINK_NONE = -1,
+    NET_LINK_ETH = 0,
+    NET_LINK_WIFI = 1,
+    NET_LINK_COUNT,
+} net_link_t;
+
+typedef struct
+{
+    net_link_t link;
+    esp_netif_ip_info_t ip_info;
+} net_manager_event_t;
+
+typedef struct
+{
+    bool eth;
+    int eth_mdc_gpio;
+    int eth_mdio_gpio;
+    int eth_phy_addr;
+    int eth_phy_reset_gpio;
+    const esp_netif_ip_info_t *eth_static_ip; // NULL for dhcp
+
+    bool wifi;
+    const char *wifi_ssid;
+    const char *wifi_password;
+} net_manager_config_t;
+
+#define NET_MANAGER_DEFAULT_CONFIG() \
+    {                                \
+        .eth = false,                \
+        .eth_mdc_gpio = 23,          \
+        .eth_mdio_gpio = 18,         \
+        .eth_phy_addr = 0,           \
+        .eth_phy_reset_gpio = -1,    \
+        .eth_static_ip = NULL,       \
+        .wifi = false,               \
+        .wifi_ssid = NULL,           \
+        .wifi_password = NULL,       \
+    }
+
+/**
+ * Initializes esp_netif and the default event loop and starts every link
+ * enabled in config. Returns right away, connectivity is announced with
+ * NET_MANAGER_EVENT_READY. Wi-Fi needs nvs_flash_init() first.
+ */
+esp_err_t net_manager_start(const net_manager_config_t *config);
+
+/**
+ * Waits until a link has an IP.
+ *
+ * @return true if the network is ready, false on timeout.
+ */
+bool net_manager_wait_ready(TickType_t timeout);
+
+/**
+ * Link that carries the default route, NET_LINK_NONE while offline.
+ */
+net_link_t net_manager_active_link(void);
+
+const char *net_manager_link_name(net_link_t link);
@@ -0,0 +1,437 @@
+/*
+ * ota_resume.c
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "ota_resume.h"
+
+#define OTA_RESUME_MAGIC 0x4f525331 // "ORS1"
+#define OTA_RESUME_NVS_NAMESPACE "ota_resume"
+#define OTA_RESUME_NVS_KEY "checkpoint"
+#define SECTOR_SIZE 4096 // flash erase unit
+#define CHECKPOINT_BYTES (((CONFIG_OTA_RESUME_CHECKPOINT_KB * 1024) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE)
+#define ETAG_LEN 80
+#define MAX_REDIRECTS 5
+#define FIRST_BACKOFF_MS 1000
+#define MAX_BACKOFF_MS 30000
+
+static const char *TAG = "ota_resume";
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t url_crc;    // of the url the image comes from
+    uint32_t partition;  // address of the partition written
+    uint32_t image_size; // 0 until the first answer
+    uint32_t offset;     // bytes written, whole sectors until the last one
+    uint8_t sha256[32];  // of those bytes
+    char etag[ETAG_LEN]; // of the image, empty when the server sends none
+} ota_resume_checkpoint_t;
+
+typedef struct
+{
+    const esp_partition_t *partition;
+    ota_resume_checkpoint_t cp; // progress, stored in NVS as it is
+    mbedtls_sha256_context sha; // of the bytes written
+    uint32_t saved;             // offset of the checkpoint in NVS
+    size_t block_len;
+    int64_t deadline_us;
+
+    // headers of the answer being read
+    bool has_range;
+    uint32_t range_start;
+    uint32_t range_total;
+    char etag[ETAG_LEN];
+} ota_resume_t;
+
+// the sector being downloaded, kept off the stack of the caller
+static uint8_t block[SECTOR_SIZE];
+static ota_resume_stats_t stats;
+
+static void ota_resume_digest(ota_resume_t *s, uint8_t sha256[32])
+{
+    // finishes a copy, the running hash goes on
+    mbedtls_sha256_context copy;
+    mbedtls_sha256_init(&copy);
+    mbedtls_sha256_clone(&copy, &s->sha);
+    mbedtls_sha256_finish(&copy, sha256);
+    mbedtls_sha256_free(&copy);
+}
+
+static void ota_resume_save(ota_resume_t *s)
+{
+    ota_resume_digest(s, s->cp.sha256);
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, OTA_RESUME_NVS_KEY, &s->cp, sizeof(s->cp));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "could not store the checkpoint: %s", esp_err_to_name(err));
+        return;
+    }
+    s->saved = s->cp.offset;
+}
+
+// the download starts over from the first byte
+static void ota_resume_restart(ota_resume_t *s)
+{
+    s->cp.image_size = 0;
+    s->cp.offset = 0;
+    s->cp.etag[0] = '\0';
+    s->saved = 0;
+    s->block_len = 0;
+    mbedtls_sha256_starts(&s->sha, 0);
+}
+
+static bool ota_resume_load(ota_resume_t *s)
+{
+    ota_resume_checkpoint_t cp;
+    size_t len = sizeof(cp);
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;
+    }
+    bool found = nvs_get_blob(nvs, OTA_RESUME_NVS_KEY, &cp, &len) == ESP_OK && len == sizeof(cp);
+    nvs_close(nvs);
+    if (!found || cp.magic != OTA_RESUME_MAGIC || cp.url_crc != s->cp.url_crc ||
+        cp.partition != s->cp.partition || cp.offset == 0 || cp.offset >= cp.image_size ||
+        cp.image_size > s->partition->size || cp.offset % SECTOR_SIZE != 0)
+    {
+        return false;
+    }
+
+    // the partition must still hold what the checkpoint covers, the hash
+    // goes on from there
+    mbedtls_sha256_starts(&s->sha, 0);
+    for (uint32_t offset = 0; offset < cp.offset; offset += SECTOR_SIZE)
+    {
+        if (esp_partition_read(s->partition, offset, block, SECTOR_SIZE) != ESP_OK)
+        {
+            return false;
+        }
+        mbedtls_sha256_update(&s->sha, block, SECTOR_SIZE);
+    }
+    uint8_t sha256[32];
+    ota_resume_digest(s, sha256);
+    if (memcmp(sha256, cp.sha256, sizeof(sha256)) != 0)
+    {
+        ESP_LOGW(TAG, "%s no longer holds the checkpoint, starting over", s->partition->label);
+        return false;
+    }
+
+    s->cp = cp;
+    s->saved = cp.offset;
+    ESP_LOGI(TAG, "resuming at %" PRIu32 " of %" PRIu32 " bytes", cp.offset, cp.image_size);
+    return true;
+}
+
+static esp_err_t ota_resume_http_event(esp_http_client_event_t *evt)
+{
+    ota_resume_t *s = evt->user_data;
+    if (evt->event_id != HTTP_EVENT_ON_HEADER)
+    {
+        return ESP_OK;
+    }
+    if (strcasecmp(evt->header_key, "Content-Range") == 0)
+    {
+        unsigned long start, end, total;
+        s->has_range = sscanf(evt->header_value, "bytes %lu-%lu/%lu", &start, &end, &total) == 3;
+        s->range_start = start;
+        s->range_total = total;
+    }
+    else if (strcasecmp(evt->header_key, "ETag") == 0)
+    {
+        strlcpy(s->etag, evt->header_value, sizeof(s->etag));
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_resume_flush(ota_resume_t *s)
+{
+    esp_err_t err = esp_partition_erase_range(s->partition, s->cp.offset, SECTOR_SIZE);
+    if (err == ESP_OK)
+    {
+        err = esp_partition_write(s->partition, s->cp.offset, block, s->block_len);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    mbedtls_sha256_update(&s->sha, block, s->block_len);
+    s->cp.offset += s->block_len;
+    s->block_len = 0;
+    if (s->cp.offset - s->saved >= CHECKPOINT_BYTES && s->cp.offset < s->cp.image_size)
+    {
+        ota_resume_save(s);
+    }
+    return ESP_OK;
+}
+
+// sends the Range request, following redirects
+static esp_err_t ota_resume_open(ota_resume_t *s, esp_http_client_handle_t client, int *status, int64_t *length)
+{
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%" PRIu32 "-", s->cp.offset);
+    esp_http_client_set_header(client, "Range", range);
+
+    for (int redirects = 0;; redirects++)
+    {
+        s->has_range = false;
+        s->etag[0] = '\0';
+        esp_err_t err = esp_http_client_open(client, 0);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        *length = esp_http_client_fetch_headers(client);
+        if (*length < 0)
+        {
+            return ESP_FAIL;
+        }
+        *status = esp_http_client_get_status_code(client);
+        if ((*status != 301 && *status != 302 && *status != 303 && *status != 307 && *status != 308) ||
+            redirects == MAX_REDIRECTS)
+        {
+            return ESP_OK;
+        }
+        esp_http_client_set_redirection(client);
+        esp_http_client_close(client);
+    }
+}
+
+/**
+ * Downloads from the offset reached.
+ *
+ * @return ESP_OK once the whole image is written, ESP_ERR_INVALID_STATE when
+ *         the download started over and must be requested again.
+ */
+static esp_err_t ota_resume_request(ota_resume_t *s, esp_http_client_handle_t client)
+{
+    // what was received past the last whole sector is requested again
+    s->block_len = 0;
+    stats.requests++;
+
+    int status;
+    int64_t length;
+    esp_err_t err = ota_resume_open(s, client, &status, &length);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    uint32_t total;
+    if (status == 206 && s->has_range && s->range_start == s->cp.offset)
+    {
+        total = s->range_total;
+    }
+    else if (status == 200 && length > 0)
+    {
+        if (s->cp.offset > 0)
+        {
+            ESP_LOGW(TAG, "server ignores Range, downloading from the start");
+            ota_resume_restart(s);
+            stats.restarts++;
+        }
+        total = length;
+    }
+    else if (status == 416)
+    {
+        // the image shrank below the offset
+        total = 0;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "unexpected answer, status %d", status);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (s->cp.image_size != 0 &&
+        (total != s->cp.image_size || (s->cp.etag[0] != '\0' && strcmp(s->cp.etag, s->etag) != 0)))
+    {
+        ESP_LOGW(TAG, "image changed on the server, starting over");
+        ota_resume_restart(s);
+        stats.restarts++;
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (total == 0 || total > s->partition->size)
+    {
+        ESP_LOGE(TAG, "%" PRIu32 " byte image does not fit %s", total, s->partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    s->cp.image_size = total;
+    strlcpy(s->cp.etag, s->etag, sizeof(s->cp.etag));
+    stats.image_size = total;
+
+    while (s->cp.offset + s->block_len < total)
+    {
+        if (esp_timer_get_time() > s->deadline_us)
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+        size_t want = SECTOR_SIZE - s->block_len;
+        if (want > total - s->cp.offset - s->block_len)
+        {
+            want = total - s->cp.offset - s->block_len;
+        }
+        int n = esp_http_client_read(client, (char *)block + s->block_len, want);
+        if (n <= 0)
+        {
+            // the connection dropped or timed out
+            return ESP_FAIL;
+        }
+        stats.downloaded += n;
+        s->block_len += n;
+        if (s->block_len == SECTOR_SIZE || s->cp.offset + s->block_len == total)
+        {
+            err = ota_resume_flush(s);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_resume_update(const ota_resume_config_t *config)
+{
+    memset(&stats, 0, sizeof(stats));
+    int64_t start_us = esp_timer_get_time();
+
+    ota_resume_t s = {
+        .partition = esp_ota_get_next_update_partition(NULL),
+        .deadline_us = start_us + CONFIG_OTA_RESUME_DEADLINE_S * 1000000LL,
+    };
+    if (s.partition == NULL)
+    {
+        ESP_LOGE(TAG, "no OTA partition to update");
+        return ESP_ERR_NOT_FOUND;
+    }
+    s.cp.magic = OTA_RESUME_MAGIC;
+    s.cp.url_crc = esp_rom_crc32_le(0, (const uint8_t *)config->url, strlen(config->url));
+    s.cp.partition = s.partition->address;
+
+    mbedtls_sha256_init(&s.sha);
+    if (!ota_resume_load(&s))
+    {
+        ota_resume_restart(&s);
+    }
+    stats.resumed_from = s.cp.offset;
+
+    esp_http_client_config_t http_config = {
+        .url = config->url,
+        .cert_pem = config->cert_pem,
+        .timeout_ms = CONFIG_OTA_RESUME_TIMEOUT_MS,
+        .keep_alive_enable = true,
+        .event_handler = ota_resume_http_event,
+        .user_data = &s,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&http_config);
+    if (client == NULL)
+    {
+        mbedtls_sha256_free(&s.sha);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err;
+    int failures = 0;
+    uint32_t backoff_ms = FIRST_BACKOFF_MS;
+    while (true)
+    {
+        uint32_t offset = s.cp.offset;
+        err = ota_resume_request(&s, client);
+        esp_http_client_close(client);
+        if (err == ESP_OK || err == ESP_ERR_INVALID_SIZE)
+        {
+            break;
+        }
+        if (err == ESP_ERR_INVALID_STATE)
+        {
+            continue;
+        }
+
+        if (s.cp.offset > offset)
+        {
+            failures = 0;
+            backoff_ms = FIRST_BACKOFF_MS;
+        }
+        failures++;
+        if (s.cp.offset > s.saved)
+        {
+            ota_resume_save(&s);
+        }
+        if (failures >= CONFIG_OTA_RESUME_ATTEMPTS || esp_timer_get_time() + backoff_ms * 1000LL > s.deadline_us)
+        {
+            ESP_LOGW(TAG, "giving up at %" PRIu32 " of %" PRIu32 " bytes: %s", s.cp.offset, s.cp.image_size,
+                     esp_err_to_name(err));
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        ESP_LOGW(TAG, "stopped at %" PRIu32 " of %" PRIu32 " bytes: %s, retrying in %" PRIu32 " ms", s.cp.offset,
+                 s.cp.image_size, esp_err_to_name(err), backoff_ms);
+        vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+        backoff_ms = backoff_ms * 2 < MAX_BACKOFF_MS ? backoff_ms * 2 : MAX_BACKOFF_MS;
+    }
+    esp_http_client_cleanup(client);
+    mbedtls_sha256_free(&s.sha);
+
+    if (err == ESP_OK)
+    {
+        // checks the image before it is set to boot; one that does not pass
+        // is downloaded again from the start
+        ota_resume_clear();
+        err = esp_ota_set_boot_partition(s.partition);
+    }
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(TAG, "%" PRIu32 " byte image in %s, %" PRIu32 " bytes from %" PRIu32 " in %d requests, %" PRId64 " ms",
+                 stats.image_size, s.partition->label, stats.downloaded, stats.resumed_from, stats.requests,
+                 (esp_timer_get_time() - start_us) / 1000);
+    }
+    else if (err != ESP_ERR_TIMEOUT)
+    {
+        ESP_LOGE(TAG, "update failed: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+void ota_resume_clear(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK)
+    {
+        nvs_erase_key(nvs, OTA_RESUME_NVS_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+void ota_resume_get_stats(ota_resume_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
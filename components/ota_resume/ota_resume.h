@@ -0,0 +1,55 @@
+/*
+ * ota_resume.h
+ *
+ * Firmware update over HTTP(S) that survives dropped connections and
+ * reboots. The image is downloaded with Range requests into the next OTA
+ * partition, one flash sector at a time. Every CONFIG_OTA_RESUME_CHECKPOINT_KB
+ * the offset reached and the SHA-256 of the bytes written are stored in NVS.
+ * After a drop the download goes on from the last sector written. After a
+ * reboot it goes on from the checkpoint, once the partition is checked to
+ * still hold those bytes. Retries back off, and the update gives up after
+ * CONFIG_OTA_RESUME_ATTEMPTS failures in a row or CONFIG_OTA_RESUME_DEADLINE_S.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct
+{
+    const char *url;
+    const char *cert_pem; // NULL for plain http
+} ota_resume_config_t;
+
+typedef struct
+{
+    uint32_t image_size;
+    uint32_t resumed_from; // offset the update started from, 0 for a fresh one
+    uint32_t downloaded;   // bytes received, including those received again
+    uint16_t requests;
+    uint16_t restarts; // the download started over: new image, or no Range support
+} ota_resume_stats_t;
+
+/**
+ * Downloads the image at url and sets it to boot on the next restart. NVS
+ * must be initialized.
+ *
+ * @return ESP_OK when the image is ready to boot,
+ *         ESP_ERR_TIMEOUT when the attempts or the time ran out, the next
+ *         update of the same url resumes,
+ *         ESP_ERR_INVALID_SIZE when the image does not fit the partition,
+ *         ESP_ERR_OTA_VALIDATE_FAILED when the image downloaded is not
+ *         valid, the next update starts over.
+ */
+esp_err_t ota_resume_update(const ota_resume_config_t *config);
+
+/**
+ * Drops the checkpoint, the next update starts from the beginning.
+ */
+void ota_resume_clear(void);
+
+/**
+ * Stats of the last update.
+ */
+void ota_resume_get_stats(ota_resume_stats_t *stats);
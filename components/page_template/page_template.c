@@ -0,0 +1,202 @@
+/*
+ * page_template.c
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "page_template.h"
+
+static const char *TAG = "page_template";
+
+static bool is_slot_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static int slot_index(page_template_t *tpl, const char *name, size_t len)
+{
+    for (size_t i = 0; i < tpl->slot_count; i++)
+    {
+        if (strlen(tpl->slot_names[i]) == len && memcmp(tpl->slot_names[i], name, len) == 0)
+        {
+            return i;
+        }
+    }
+
+    if (tpl->slot_count == PAGE_TEMPLATE_MAX_SLOTS)
+    {
+        return -1;
+    }
+    memcpy(tpl->slot_names[tpl->slot_count], name, len);
+    tpl->slot_names[tpl->slot_count][len] = '\0';
+    return tpl->slot_count++;
+}
+
+static esp_err_t add_segment(page_template_t *tpl, const char *ptr, size_t len, int slot)
+{
+    if (slot < 0 && len == 0)
+    {
+        return ESP_OK;
+    }
+    if (tpl->segment_count == PAGE_TEMPLATE_MAX_SEGMENTS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    page_segment_t *seg = &tpl->segments[tpl->segment_count++];
+    seg->ptr = ptr;
+    seg->len = len;
+    seg->slot = slot;
+    if (slot < 0)
+    {
+        tpl->literal_len += len;
+    }
+    return ESP_OK;
+}
+
+// length of a valid slot name at p, 0 if p does not start "name}}"
+static size_t slot_name_len(const char *p, const char *end)
+{
+    const char *q = p;
+    while (q < end && is_slot_char(*q))
+    {
+        q++;
+    }
+
+    size_t len = q - p;
+    if (len == 0 || len >= PAGE_TEMPLATE_MAX_SLOT_NAME || end - q < 2 || q[0] != '}' || q[1] != '}')
+    {
+        return 0;
+    }
+    return len;
+}
+
+esp_err_t page_template_parse(page_template_t *tpl, const char *src, size_t len)
+{
+    if (tpl == NULL || src == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(tpl, 0, sizeof(*tpl));
+
+    const char *end = src + len;
+    const char *literal = src;
+    const char *p = src;
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK && end - p >= 2)
+    {
+        size_t name_len;
+        if (p[0] != '{' || p[1] != '{' || (name_len = slot_name_len(p + 2, end)) == 0)
+        {
+            p++;
+            continue;
+        }
+
+        int slot = slot_index(tpl, p + 2, name_len);
+        if (slot < 0)
+        {
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        err = add_segment(tpl, literal, p - literal, -1);
+        if (err == ESP_OK)
+        {
+            err = add_segment(tpl, NULL, 0, slot);
+        }
+        p += 2 + name_len + 2;
+        literal = p;
+    }
+
+    if (err == ESP_OK)
+    {
+        err = add_segment(tpl, literal, end - literal, -1);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "template too complex (max %d segments, %d slots)",
+                 PAGE_TEMPLATE_MAX_SEGMENTS, PAGE_TEMPLATE_MAX_SLOTS);
+        tpl->segment_count = 0;
+        return err;
+    }
+
+    ESP_LOGI(TAG, "parsed %d bytes: %d segments, %d slots",
+             (int)len, (int)tpl->segment_count, (int)tpl->slot_count);
+    return ESP_OK;
+}
+
+void page_template_invalidate(page_template_t *tpl)
+{
+    for (size_t i = 0; i < PAGE_TEMPLATE_CACHE_SIZE; i++)
+    {
+        tpl->cache[i].valid = false;
+    }
+}
+
+static const page_render_t *page_template_render(page_template_t *tpl, uint32_t version,
+                                                 page_template_resolve_t resolve, void *ctx)
+{
+    for (size_t i = 0; i < PAGE_TEMPLATE_CACHE_SIZE; i++)
+    {
+        if (tpl->cache[i].valid && tpl->cache[i].version == version)
+        {
+            return &tpl->cache[i];
+        }
+    }
+
+    // miss: resolve every slot once and evict the oldest variant
+    page_render_t *render = &tpl->cache[tpl->cache_next];
+    tpl->cache_next = (tpl->cache_next + 1) % PAGE_TEMPLATE_CACHE_SIZE;
+
+    for (size_t i = 0; i < tpl->slot_count; i++)
+    {
+        const char *value = resolve ? resolve(tpl->slot_names[i], ctx) : NULL;
+        render->values[i] = value ? value : "";
+        render->values_len[i] = strlen(render->values[i]);
+    }
+
+    render->length = tpl->literal_len;
+    for (size_t i = 0; i < tpl->segment_count; i++)
+    {
+        if (tpl->segments[i].slot >= 0)
+        {
+            render->length += render->values_len[tpl->segments[i].slot];
+        }
+    }
+    render->version = version;
+    render->valid = true;
+    return render;
+}
+
+esp_err_t page_template_send(page_template_t *tpl, httpd_req_t *req, uint32_t version,
+                             page_template_resolve_t resolve, void *ctx)
+{
+    if (tpl->segment_count == 0)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "page not loaded");
+    }
+
+    const page_render_t *render = page_template_render(tpl, version, resolve, ctx);
+
+    httpd_resp_set_type(req, "text/html");
+    for (size_t i = 0; i < tpl->segment_count; i++)
+    {
+        const page_segment_t *seg = &tpl->segments[i];
+        const char *ptr = seg->slot < 0 ? seg->ptr : render->values[seg->slot];
+        size_t len = seg->slot < 0 ? seg->len : render->values_len[seg->slot];
+
+        // an empty chunk would terminate the response early
+        if (len == 0)
+        {
+            continue;
+        }
+
+        esp_err_t err = httpd_resp_send_chunk(req, ptr, len);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
@@ -0,0 +1,83 @@
+/*
+ * page_template.h
+ *
+ * Pre-parsed html templates served straight from their literal segments.
+ *
+ * The source page is scanned once at boot and split into literal segments
+ * and named slots written as {{name}}. Everything else in the page, '%'
+ * included, is sent verbatim. Rendering never copies the page: each request
+ * walks the segment list and hands every piece to httpd_resp_send_chunk().
+ *
+ * Slot values are resolved through a callback and cached per state version,
+ * so the callback only runs again after the caller bumps the version.
+ * A template is meant to be used from the httpd task only (uri handlers and
+ * httpd_queue_work jobs), which serializes all accesses.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+#define PAGE_TEMPLATE_MAX_SEGMENTS 32
+#define PAGE_TEMPLATE_MAX_SLOTS 8
+#define PAGE_TEMPLATE_MAX_SLOT_NAME 16
+#define PAGE_TEMPLATE_CACHE_SIZE 2
+
+/**
+ * Returns the value of a slot for the current state. The returned string
+ * must stay valid as long as the version it was resolved for is cached,
+ * string literals are the expected case.
+ */
+typedef const char *(*page_template_resolve_t)(const char *slot, void *ctx);
+
+typedef struct
+{
+    const char *ptr; // literal text, or NULL for a slot
+    size_t len;
+    int slot; // slot index, -1 for literals
+} page_segment_t;
+
+typedef struct
+{
+    bool valid;
+    uint32_t version;
+    const char *values[PAGE_TEMPLATE_MAX_SLOTS];
+    size_t values_len[PAGE_TEMPLATE_MAX_SLOTS];
+    size_t length; // total rendered length, for logging and stats
+} page_render_t;
+
+typedef struct
+{
+    page_segment_t segments[PAGE_TEMPLATE_MAX_SEGMENTS];
+    size_t segment_count;
+    char slot_names[PAGE_TEMPLATE_MAX_SLOTS][PAGE_TEMPLATE_MAX_SLOT_NAME];
+    size_t slot_count;
+    size_t literal_len;
+    page_render_t cache[PAGE_TEMPLATE_CACHE_SIZE];
+    size_t cache_next;
+} page_template_t;
+
+/**
+ * Parses src into segments. src is not copied, it must outlive the template.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM when the page has
+ *         more segments or slots than the static tables can hold.
+ */
+esp_err_t page_template_parse(page_template_t *tpl, const char *src, size_t len);
+
+/**
+ * Drops every cached render. Needed only if the resolver changes meaning
+ * without a version bump.
+ */
+void page_template_invalidate(page_template_t *tpl);
+
+/**
+ * Sends the page rendered for the given state version as a chunked response.
+ * Slots are resolved through resolve only when version is not cached yet.
+ */
+esp_err_t page_template_send(page_template_t *tpl, httpd_req_t *req, uint32_t version,
+                             page_template_resolve_t resolve, void *ctx);
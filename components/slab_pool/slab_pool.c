@@ -0,0 +1,66 @@
+/*
+ * slab_pool.c
+ */
+
+#include <stdlib.h>
+#include "slab_pool.h"
+
+void slab_pool_init(slab_pool_t *pool, void *storage, size_t block_size, size_t count)
+{
+    pool->storage = storage;
+    pool->block_size = SLAB_POOL_BLOCK_SIZE(block_size);
+    pool->count = count;
+    pool->free_list = NULL;
+    pool->hits = pool->misses = 0;
+    pool->in_use = pool->peak = 0;
+    portMUX_INITIALIZE(&pool->lock);
+
+    // free blocks hold the pointer to the next one in their first word
+    for (size_t i = count; i > 0; i--)
+    {
+        void **block = (void **)(pool->storage + (i - 1) * pool->block_size);
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+}
+
+void *slab_pool_alloc(slab_pool_t *pool, size_t size)
+{
+    void **block = NULL;
+
+    taskENTER_CRITICAL(&pool->lock);
+    if (size <= pool->block_size && pool->free_list != NULL)
+    {
+        block = pool->free_list;
+        pool->free_list = *block;
+        pool->hits++;
+        if (++pool->in_use > pool->peak)
+        {
+            pool->peak = pool->in_use;
+        }
+    }
+    else
+    {
+        pool->misses++;
+    }
+    taskEXIT_CRITICAL(&pool->lock);
+
+    return block != NULL ? (void *)block : malloc(size);
+}
+
+void slab_pool_free(slab_pool_t *pool, void *block)
+{
+    uint8_t *p = block;
+
+    if (p < pool->storage || p >= pool->storage + pool->count * pool->block_size)
+    {
+        free(block);
+        return;
+    }
+
+    taskENTER_CRITICAL(&pool->lock);
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+    taskEXIT_CRITICAL(&pool->lock);
+}
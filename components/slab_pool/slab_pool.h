@@ -0,0 +1,46 @@
+/*
+ * slab_pool.h
+ *
+ * Fixed-size block pool over a static buffer. Blocks are handed out from a
+ * free list in O(1) and never touch the heap; requests larger than the block
+ * size, or made while the pool is empty, fall back to malloc and are counted
+ * as misses so the pool can be sized from the counters.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct
+{
+    uint8_t *storage;
+    size_t block_size; // rounded up to a multiple of 4
+    size_t count;
+    void *free_list;
+    uint32_t hits;   // allocations served by the pool
+    uint32_t misses; // allocations that went to the heap
+    uint16_t in_use;
+    uint16_t peak;
+    portMUX_TYPE lock;
+} slab_pool_t;
+
+#define SLAB_POOL_BLOCK_SIZE(size) (((size) + 3) & ~(size_t)3)
+
+/** Static storage for count blocks of block_size bytes */
+#define SLAB_POOL_STORAGE(name, block_size, count) \
+    static uint32_t name[SLAB_POOL_BLOCK_SIZE(block_size) / 4 * (count)]
+
+void slab_pool_init(slab_pool_t *pool, void *storage, size_t block_size, size_t count);
+
+/**
+ * Returns a block of at least size bytes, from the pool when possible.
+ * Contents are not cleared.
+ */
+void *slab_pool_alloc(slab_pool_t *pool, size_t size);
+
+/**
+ * Gives back a block from slab_pool_alloc, NULL is ignored.
+ */
+void slab_pool_free(slab_pool_t *pool, void *block);
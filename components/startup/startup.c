@@ -0,0 +1,132 @@
+/*
+ * startup.c
+ */
+
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "boot_prof.h"
+#include "startup.h"
+
+#define STARTUP_ALL_BITS ((1UL << STARTUP_MAX_BITS) - 1)
+
+static const char *TAG = "startup";
+
+static EventGroupHandle_t startup_group;
+static portMUX_TYPE startup_lock = portMUX_INITIALIZER_UNLOCKED;
+// provides bits of the failed stages, set in startup_group as well so that waiters wake up
+static EventBits_t failed;
+// provides bits of all stages, startup is complete once they are all set
+static EventBits_t expected;
+static bool complete;
+
+static void startup_check_complete(EventBits_t bits)
+{
+    bool done = false;
+
+    taskENTER_CRITICAL(&startup_lock);
+    if (!complete && (bits & expected) == expected)
+    {
+        complete = true;
+        done = true;
+    }
+    taskEXIT_CRITICAL(&startup_lock);
+
+    if (done)
+    {
+        boot_prof_mark("startup complete");
+        ESP_LOGI(TAG, "startup complete %" PRId64 " ms after boot%s", esp_timer_get_time() / 1000,
+                 failed ? ", with failed stages" : "");
+        boot_prof_dump();
+    }
+}
+
+void startup_signal(EventBits_t bits)
+{
+    startup_check_complete(xEventGroupSetBits(startup_group, bits));
+}
+
+bool startup_wait(EventBits_t bits, TickType_t timeout)
+{
+    EventBits_t set = xEventGroupWaitBits(startup_group, bits, pdFALSE, pdTRUE, timeout);
+    return (set & bits) == bits && (failed & bits) == 0;
+}
+
+static void startup_task(void *arg)
+{
+    const startup_stage_t *stage = arg;
+    int64_t wait_us = esp_timer_get_time();
+    esp_err_t err;
+
+    if (stage->requires)
+    {
+        xEventGroupWaitBits(startup_group, stage->requires, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    if (failed & stage->requires)
+    {
+        ESP_LOGE(TAG, "%s skipped, a stage it needs failed", stage->name);
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else
+    {
+        int span = boot_prof_begin(stage->name);
+        err = stage->run(stage->ctx);
+        boot_prof_end(span);
+        if (err == ESP_OK)
+        {
+            ESP_LOGI(TAG, "%s done in %" PRId64 " ms, after waiting %" PRId64 " ms", stage->name,
+                     (esp_timer_get_time() - start_us) / 1000, (start_us - wait_us) / 1000);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "%s failed: %s", stage->name, esp_err_to_name(err));
+        }
+    }
+
+    if (err != ESP_OK)
+    {
+        taskENTER_CRITICAL(&startup_lock);
+        failed |= stage->provides;
+        taskEXIT_CRITICAL(&startup_lock);
+        startup_signal(stage->provides);
+    }
+    else if (!stage->async)
+    {
+        startup_signal(stage->provides);
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t startup_run(const startup_stage_t *stages, size_t count)
+{
+    boot_prof_mark("startup");
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((stages[i].requires | stages[i].provides) & ~STARTUP_ALL_BITS)
+        {
+            ESP_LOGE(TAG, "%s uses bits above %d", stages[i].name, STARTUP_MAX_BITS);
+            return ESP_ERR_INVALID_ARG;
+        }
+        expected |= stages[i].provides;
+    }
+
+    startup_group = xEventGroupCreate();
+    if (startup_group == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t stack_size = stages[i].stack_size ? stages[i].stack_size : STARTUP_STACK_SIZE;
+        if (xTaskCreate(startup_task, stages[i].name, stack_size, (void *)&stages[i], 5, NULL) != pdPASS)
+        {
+            ESP_LOGE(TAG, "no memory for the %s task", stages[i].name);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,61 @@
+/*
+ * startup.h
+ *
+ * Startup as a dependency graph instead of a sequence of fixed delays. Each
+ * stage names the bits it needs and the bits it provides, all stages are
+ * started at once in their own task and each one runs as soon as the bits
+ * it needs are set in a shared event group. Independent stages, such as
+ * mapping flash and bringing the network up, overlap.
+ *
+ * A stage that returns ESP_OK sets its provides bits. An async stage only
+ * kicks something off, and the event handler that sees it complete sets the
+ * bits with startup_signal. When a stage fails, the stages that need it are
+ * skipped and fail in turn, instead of waiting forever.
+ *
+ * Every stage run is a boot_prof span named after the stage, and the boot
+ * profile is dumped on the console when the startup completes.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+// event groups carry 24 bits with 32 bit ticks
+#define STARTUP_MAX_BITS 24
+
+typedef struct
+{
+    const char *name;
+    EventBits_t requires;   // all of these before run
+    EventBits_t provides;   // set when run returns ESP_OK, unless async
+    bool async;             // provides is set later with startup_signal
+    esp_err_t (*run)(void *ctx);
+    void *ctx;
+    uint32_t stack_size;    // 0 for STARTUP_STACK_SIZE
+} startup_stage_t;
+
+#define STARTUP_STACK_SIZE 4096
+
+/**
+ * Starts every stage, returns right away. stages must stay valid until the
+ * startup completes, "startup complete" is logged once every provides bit
+ * is set or failed.
+ */
+esp_err_t startup_run(const startup_stage_t *stages, size_t count);
+
+/**
+ * Sets bits on behalf of an async stage. Can be called from any task once
+ * startup_run was called.
+ */
+void startup_signal(EventBits_t bits);
+
+/**
+ * Waits for all of bits.
+ *
+ * @return false on timeout, or if a stage providing one of them failed.
+ */
+bool startup_wait(EventBits_t bits, TickType_t timeout);
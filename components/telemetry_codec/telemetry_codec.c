@@ -0,0 +1,245 @@
+/*
+ * telemetry_codec.c
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "telemetry_codec.h"
+
+#define TELEMETRY_MAX_DECIMALS 9
+
+static const char *type_names[] = {
+    [TELEMETRY_UINT] = "uint",
+    [TELEMETRY_SINT] = "sint",
+    [TELEMETRY_FIXED] = "fixed",
+    [TELEMETRY_FLOAT] = "float",
+    [TELEMETRY_BOOL] = "bool",
+    [TELEMETRY_STRING] = "string",
+};
+
+static const double pow10_table[TELEMETRY_MAX_DECIMALS + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool overflow;
+} telemetry_writer_t;
+
+static void put_byte(telemetry_writer_t *w, uint8_t b)
+{
+    if (w->pos < w->len)
+    {
+        w->buf[w->pos++] = b;
+    }
+    else
+    {
+        w->overflow = true;
+    }
+}
+
+static void put_varint(telemetry_writer_t *w, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        put_byte(w, (uint8_t)v | 0x80);
+        v >>= 7;
+    }
+    put_byte(w, (uint8_t)v);
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static uint8_t telemetry_decimals(const telemetry_field_t *field)
+{
+    return field->decimals > TELEMETRY_MAX_DECIMALS ? TELEMETRY_MAX_DECIMALS : field->decimals;
+}
+
+size_t telemetry_encode(const telemetry_schema_t *schema, const telemetry_value_t *values, uint8_t *buf,
+                        size_t len)
+{
+    telemetry_writer_t w = {
+        .buf = buf,
+        .len = len};
+
+    put_byte(&w, TELEMETRY_FORMAT);
+    put_varint(&w, schema->id);
+
+    for (size_t i = 0; i < schema->field_count && !w.overflow; i++)
+    {
+        const telemetry_value_t *v = &values[i];
+        switch (schema->fields[i].type)
+        {
+        case TELEMETRY_UINT:
+            put_varint(&w, v->u);
+            break;
+        case TELEMETRY_SINT:
+            put_varint(&w, zigzag(v->i));
+            break;
+        case TELEMETRY_FIXED:
+            put_varint(&w, zigzag(llround(v->f * pow10_table[telemetry_decimals(&schema->fields[i])])));
+            break;
+        case TELEMETRY_FLOAT:
+        {
+            float f = v->f;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            for (int b = 0; b < 4; b++)
+            {
+                put_byte(&w, bits >> (8 * b));
+            }
+            break;
+        }
+        case TELEMETRY_BOOL:
+            put_byte(&w, v->b);
+            break;
+        case TELEMETRY_STRING:
+        {
+            size_t n = v->s ? strlen(v->s) : 0;
+            put_varint(&w, n);
+            for (size_t c = 0; c < n; c++)
+            {
+                put_byte(&w, v->s[c]);
+            }
+            break;
+        }
+        }
+    }
+    return w.overflow ? 0 : w.pos;
+}
+
+bool telemetry_peek_schema(const void *buf, size_t len, uint32_t *id)
+{
+    const uint8_t *p = buf;
+    if (len < 2 || p[0] != TELEMETRY_FORMAT)
+    {
+        return false;
+    }
+
+    uint32_t v = 0;
+    for (size_t i = 1; i < len && i <= 5; i++)
+    {
+        v |= (uint32_t)(p[i] & 0x7f) << (7 * (i - 1));
+        if ((p[i] & 0x80) == 0)
+        {
+            *id = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// where the next snprintf goes once total bytes were asked for
+static size_t text_offset(int total, size_t len)
+{
+    return (size_t)total < len ? (size_t)total : len;
+}
+
+int telemetry_to_text(const telemetry_schema_t *schema, const telemetry_value_t *values, char *buf, size_t len)
+{
+    int total = 0;
+
+    for (size_t i = 0; i < schema->field_count; i++)
+    {
+        const telemetry_field_t *field = &schema->fields[i];
+        const telemetry_value_t *v = &values[i];
+        size_t off = text_offset(total, len);
+        size_t room = len - off;
+        char *out = buf + off;
+        const char *sep = i ? " " : "";
+        int n = 0;
+
+        switch (field->type)
+        {
+        case TELEMETRY_UINT:
+            n = snprintf(out, room, "%s%s=%" PRIu64, sep, field->name, v->u);
+            break;
+        case TELEMETRY_SINT:
+            n = snprintf(out, room, "%s%s=%" PRId64, sep, field->name, v->i);
+            break;
+        case TELEMETRY_FIXED:
+            n = snprintf(out, room, "%s%s=%.*f", sep, field->name, telemetry_decimals(field), v->f);
+            break;
+        case TELEMETRY_FLOAT:
+            n = snprintf(out, room, "%s%s=%g", sep, field->name, v->f);
+            break;
+        case TELEMETRY_BOOL:
+            n = snprintf(out, room, "%s%s=%d", sep, field->name, v->b);
+            break;
+        case TELEMETRY_STRING:
+            n = snprintf(out, room, "%s%s=%s", sep, field->name, v->s ? v->s : "");
+            break;
+        }
+        total += n;
+    }
+    if (len > 0 && schema->field_count == 0)
+    {
+        buf[0] = '\0';
+    }
+    return total;
+}
+
+int telemetry_describe(const telemetry_schema_t *schema, char *buf, size_t len)
+{
+    int total = snprintf(buf, len, "{\"id\":%" PRIu32 ",\"name\":\"%s\",\"fields\":[", schema->id, schema->name);
+
+    for (size_t i = 0; i < schema->field_count; i++)
+    {
+        const telemetry_field_t *field = &schema->fields[i];
+        size_t off = text_offset(total, len);
+        total += snprintf(buf + off, len - off, "%s{\"name\":\"%s\",\"type\":\"%s\"", i ? "," : "", field->name,
+                          type_names[field->type]);
+        off = text_offset(total, len);
+        if (field->type == TELEMETRY_FIXED)
+        {
+            total += snprintf(buf + off, len - off, ",\"decimals\":%d}", telemetry_decimals(field));
+        }
+        else
+        {
+            total += snprintf(buf + off, len - off, "}");
+        }
+    }
+    size_t off = text_offset(total, len);
+    total += snprintf(buf + off, len - off, "]}");
+    return total;
+}
+
+void telemetry_bench(const telemetry_schema_t *schema, const telemetry_value_t *values, uint32_t iterations,
+                     telemetry_bench_t *result)
+{
+    uint8_t binary[128];
+    char text[256];
+    volatile size_t sink = 0;
+
+    memset(result, 0, sizeof(*result));
+    result->iterations = iterations;
+    if (iterations == 0)
+    {
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sink += telemetry_encode(schema, values, binary, sizeof(binary));
+    }
+    int64_t mid = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sink += telemetry_to_text(schema, values, text, sizeof(text));
+    }
+    int64_t end = esp_timer_get_time();
+
+    result->binary_size = telemetry_encode(schema, values, binary, sizeof(binary));
+    result->text_size = telemetry_to_text(schema, values, text, sizeof(text));
+    result->binary_ns = (mid - start) * 1000 / iterations;
+    result->text_ns = (end - mid) * 1000 / iterations;
+    (void)sink;
+}
@@ -0,0 +1,108 @@
+/*
+ * telemetry_codec.h
+ *
+ * Compact binary encoding for telemetry payloads. A schema lists the fields
+ * of a message with their types, and a message carries only the values, in
+ * schema order, after a one byte format tag and the schema id:
+ *
+ *   0xA1 | id (varint) | field 0 | field 1 | ...
+ *
+ *   UINT    varint (LEB128)
+ *   SINT    zigzag varint
+ *   FIXED   value * 10^decimals rounded, as a zigzag varint
+ *   FLOAT   IEEE 754 single, little endian
+ *   BOOL    one byte
+ *   STRING  varint length, then the bytes
+ *
+ * Field names and types never go over the air. Decoders look the schema up
+ * by id: bench/telemetry.py on the host, with the descriptions from
+ * bench/telemetry_schemas.json, which telemetry_describe prints from the
+ * schema the firmware actually uses.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_FORMAT 0xA1
+
+typedef enum
+{
+    TELEMETRY_UINT,
+    TELEMETRY_SINT,
+    TELEMETRY_FIXED,
+    TELEMETRY_FLOAT,
+    TELEMETRY_BOOL,
+    TELEMETRY_STRING,
+} telemetry_type_t;
+
+typedef struct
+{
+    const char *name;
+    telemetry_type_t type;
+    uint8_t decimals; // FIXED only
+} telemetry_field_t;
+
+typedef struct
+{
+    uint32_t id;
+    const char *name;
+    const telemetry_field_t *fields;
+    size_t field_count;
+} telemetry_schema_t;
+
+/** One value per schema field, the member matching its type */
+typedef union
+{
+    uint64_t u;    // UINT
+    int64_t i;     // SINT
+    double f;      // FIXED, FLOAT
+    bool b;        // BOOL
+    const char *s; // STRING, NUL terminated
+} telemetry_value_t;
+
+typedef struct
+{
+    uint32_t iterations;
+    size_t binary_size;
+    size_t text_size;
+    uint32_t binary_ns; // per message
+    uint32_t text_ns;
+} telemetry_bench_t;
+
+/**
+ * Encodes values into buf.
+ *
+ * @return the encoded length, 0 when it does not fit len.
+ */
+size_t telemetry_encode(const telemetry_schema_t *schema, const telemetry_value_t *values, uint8_t *buf,
+                        size_t len);
+
+/**
+ * Reads the schema id of an encoded message.
+ *
+ * @return false when buf does not hold one.
+ */
+bool telemetry_peek_schema(const void *buf, size_t len, uint32_t *id);
+
+/**
+ * Renders values as "name=value name=value", the text form the binary one
+ * replaces. Truncates like snprintf.
+ *
+ * @return the length the full text needs.
+ */
+int telemetry_to_text(const telemetry_schema_t *schema, const telemetry_value_t *values, char *buf, size_t len);
+
+/**
+ * Writes the schema as JSON, the format of bench/telemetry_schemas.json.
+ * Truncates like snprintf.
+ */
+int telemetry_describe(const telemetry_schema_t *schema, char *buf, size_t len);
+
+/**
+ * Times iterations encodings of values in both forms.
+ */
+void telemetry_bench(const telemetry_schema_t *schema, const telemetry_value_t *values, uint32_t iterations,
+                     telemetry_bench_t *result);
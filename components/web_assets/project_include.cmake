@@ -0,0 +1,49 @@
+# web_assets_create_partition_image
+#
+# Minifies and gzips every file in base_dir and packs them, sorted by path,
+# into a read-only image for partition (see web_assets.py for the layout).
+# Files listed after TEMPLATES are rendered on the device, so they are
+# minified but stored uncompressed.
+set(WEB_ASSETS_TOOL ${CMAKE_CURRENT_LIST_DIR}/web_assets.py)
+
+function(web_assets_create_partition_image partition base_dir)
+    cmake_parse_arguments(arg "FLASH_IN_PROJECT" "" "TEMPLATES" "${ARGN}")
+
+    idf_build_get_property(python PYTHON)
+    idf_build_get_property(build_dir BUILD_DIR)
+    get_filename_component(base_dir_full_path ${base_dir} ABSOLUTE)
+    set(image_file ${build_dir}/${partition}.bin)
+
+    partition_table_get_partition_info(size "--partition-name ${partition}" "size")
+    partition_table_get_partition_info(offset "--partition-name ${partition}" "offset")
+    if(NOT size OR NOT offset)
+        message(FATAL_ERROR "Unable to resolve size and offset of partition '${partition}'")
+    endif()
+
+    set(template_args)
+    foreach(template ${arg_TEMPLATES})
+        list(APPEND template_args --template ${template})
+    endforeach()
+
+    file(GLOB_RECURSE asset_files ${base_dir_full_path}/*)
+    add_custom_command(OUTPUT ${image_file}
+        COMMAND ${python} ${WEB_ASSETS_TOOL} ${base_dir_full_path} ${image_file}
+                --max-size ${size} ${template_args}
+        DEPENDS ${asset_files} ${WEB_ASSETS_TOOL}
+        COMMENT "Packing web assets for partition ${partition}"
+        VERBATIM)
+    add_custom_target(web_assets_${partition}_bin ALL DEPENDS ${image_file})
+    set_property(DIRECTORY "${CMAKE_CURRENT_SOURCE_DIR}" APPEND PROPERTY
+        ADDITIONAL_CLEAN_FILES ${image_file})
+
+    idf_component_get_property(main_args esptool_py FLASH_ARGS)
+    idf_component_get_property(sub_args esptool_py FLASH_SUB_ARGS)
+    esptool_py_flash_target(${partition}-flash "${main_args}" "${sub_args}")
+    esptool_py_flash_to_partition(${partition}-flash "${partition}" "${image_file}")
+    add_dependencies(${partition}-flash web_assets_${partition}_bin)
+
+    if(arg_FLASH_IN_PROJECT)
+        esptool_py_flash_to_partition(flash "${partition}" "${image_file}")
+        add_dependencies(flash web_assets_${partition}_bin)
+    endif()
+endfunction()
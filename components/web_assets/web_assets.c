@@ -0,0 +1,215 @@
+/*
+ * web_assets.c
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "web_assets.h"
+
+#define WEB_ASSETS_MAGIC "WAPK"
+#define WEB_ASSETS_VERSION 1
+
+static const char *TAG = "web_assets";
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t size; // whole pack, header included
+    uint32_t crc32; // of everything after the header
+} web_assets_header_t;
+
+static const char *pack;
+static const web_asset_t *assets;
+static size_t asset_count;
+static esp_partition_mmap_handle_t pack_handle;
+// changes the etag of rendered pages across reboots, when versions restart at 0
+static uint32_t boot_nonce;
+
+static esp_err_t web_assets_check(const web_assets_header_t *header, const esp_partition_t *partition)
+{
+    if (memcmp(header->magic, WEB_ASSETS_MAGIC, sizeof(header->magic)) != 0)
+    {
+        ESP_LOGE(TAG, "no asset pack in partition %s", partition->label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (header->version != WEB_ASSETS_VERSION)
+    {
+        ESP_LOGE(TAG, "asset pack version %d, expected %d", header->version, WEB_ASSETS_VERSION);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (header->size > partition->size ||
+        header->size < sizeof(*header) + header->count * sizeof(web_asset_t))
+    {
+        ESP_LOGE(TAG, "asset pack size %" PRIu32 " does not fit partition %s", header->size, partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t web_assets_init(const char *partition_label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "partition %s not found", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    web_assets_header_t header;
+    esp_err_t err = esp_partition_read(partition, 0, &header, sizeof(header));
+    if (err == ESP_OK)
+    {
+        err = web_assets_check(&header, partition);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    const void *ptr;
+    err = esp_partition_mmap(partition, 0, header.size, ESP_PARTITION_MMAP_DATA, &ptr, &pack_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "mmap of %s failed: %s", partition->label, esp_err_to_name(err));
+        return err;
+    }
+
+    const char *body = (const char *)ptr + sizeof(header);
+    if (esp_rom_crc32_le(0, (const uint8_t *)body, header.size - sizeof(header)) != header.crc32)
+    {
+        ESP_LOGE(TAG, "asset pack crc mismatch");
+        esp_partition_munmap(pack_handle);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    pack = ptr;
+    assets = (const web_asset_t *)body;
+    asset_count = header.count;
+    boot_nonce = esp_random();
+
+    ESP_LOGI(TAG, "%d assets, %" PRIu32 " bytes mapped from %s", (int)asset_count, header.size, partition->label);
+    return ESP_OK;
+}
+
+// orders like strcmp(path, uri) with uri cut at len
+static int web_assets_path_cmp(const char *path, const char *uri, size_t len)
+{
+    int cmp = strncmp(path, uri, len);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return path[len] == '\0' ? 0 : 1;
+}
+
+const web_asset_t *web_assets_find(const char *uri)
+{
+    size_t len = strcspn(uri, "?");
+    if (len >= WEB_ASSETS_PATH_LEN)
+    {
+        return NULL;
+    }
+
+    size_t lo = 0;
+    size_t hi = asset_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = web_assets_path_cmp(assets[mid].path, uri, len);
+        if (cmp == 0)
+        {
+            return &assets[mid];
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+const char *web_assets_data(const web_asset_t *asset)
+{
+    return pack + asset->offset;
+}
+
+void web_assets_versioned_etag(const web_asset_t *asset, uint32_t version, char *etag, size_t len)
+{
+    const char *hash = asset ? asset->etag + 1 : "0";
+    int hash_len = asset ? WEB_ASSETS_HASH_LEN : 1;
+
+    snprintf(etag, len, "\"%.*s-%08" PRIx32 "-%" PRIu32 "\"", hash_len, hash, boot_nonce, version);
+}
+
+bool web_assets_not_modified(httpd_req_t *req, const char *etag)
+{
+    char if_none_match[96];
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    // always revalidate, with the etag that costs a bodiless round trip
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) != ESP_OK ||
+        strstr(if_none_match, etag) == NULL)
+    {
+        return false;
+    }
+
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_send(req, NULL, 0);
+    return true;
+}
+
+static const char *web_assets_content_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+
+    if (ext == NULL)
+        return "application/octet-stream";
+    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
+        return "text/html";
+    if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    if (strcmp(ext, ".js") == 0)
+        return "application/javascript";
+    if (strcmp(ext, ".json") == 0)
+        return "application/json";
+    if (strcmp(ext, ".svg") == 0)
+        return "image/svg+xml";
+    if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    if (strcmp(ext, ".ico") == 0)
+        return "image/x-icon";
+    return "application/octet-stream";
+}
+
+esp_err_t web_assets_get_handler(httpd_req_t *req)
+{
+    // templates are only reachable through the handler that renders them
+    const web_asset_t *asset = web_assets_find(req->uri);
+    if (asset == NULL || asset->kind == WEB_ASSET_TEMPLATE)
+    {
+        return httpd_resp_send_404(req);
+    }
+
+    if (web_assets_not_modified(req, asset->etag))
+    {
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, web_assets_content_type(asset->path));
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, web_assets_data(asset), asset->size);
+}
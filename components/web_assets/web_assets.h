@@ -0,0 +1,76 @@
+/*
+ * web_assets.h
+ *
+ * Serves the asset pack built by web_assets.py straight from flash. The pack
+ * partition is mapped once with esp_partition_mmap, lookups are a binary
+ * search over its sorted index and bodies are sent from the mapping without
+ * a RAM copy: gzipped with Content-Encoding: gzip, with an ETag from the
+ * pack and a 304 answer when the browser already holds the same content.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+#define WEB_ASSETS_PATH_LEN 32
+#define WEB_ASSETS_HASH_LEN 16
+// quoted hash plus the "-<boot>-<version>" suffix of versioned etags
+#define WEB_ASSETS_ETAG_LEN (WEB_ASSETS_HASH_LEN + 24)
+
+typedef enum
+{
+    WEB_ASSET_GZIP = 0,
+    WEB_ASSET_TEMPLATE = 1,
+} web_asset_kind_t;
+
+/** Index entry as laid out in flash, see web_assets.py */
+typedef struct
+{
+    char path[WEB_ASSETS_PATH_LEN]; // uri path, e.g. "/index.html"
+    char etag[20];                  // quoted hash, ready for the ETag header
+    uint32_t offset;                // from the start of the pack
+    uint32_t size;
+    uint8_t kind; // web_asset_kind_t
+    uint8_t reserved[3];
+} web_asset_t;
+
+_Static_assert(sizeof(web_asset_t) == 64, "web_asset_t must match the pack index layout");
+
+/**
+ * Maps the asset pack stored in the data partition with the given label.
+ */
+esp_err_t web_assets_init(const char *partition_label);
+
+/**
+ * Looks up an asset by uri path, the query string is ignored.
+ */
+const web_asset_t *web_assets_find(const char *uri);
+
+/**
+ * Contents of an asset, valid for as long as the pack stays mapped.
+ */
+const char *web_assets_data(const web_asset_t *asset);
+
+/**
+ * Builds an etag for content rendered from an asset: the asset hash, a
+ * per-boot nonce and the caller's state version.
+ */
+void web_assets_versioned_etag(const web_asset_t *asset, uint32_t version, char *etag, size_t len);
+
+/**
+ * Sets the caching headers for etag and, if If-None-Match carries it,
+ * answers 304 Not Modified. etag must stay valid until the response is sent.
+ *
+ * @return true when the 304 was sent and the handler is done.
+ */
+bool web_assets_not_modified(httpd_req_t *req, const char *etag);
+
+/**
+ * Uri handler serving any asset in the pack. Register it last, on a
+ * wildcard uri matched with httpd_uri_match_wildcard.
+ */
+esp_err_t web_assets_get_handler(httpd_req_t *req);
@@ -0,0 +1,138 @@
+#!/usr/bin/env python
+#
+# Builds the read-only asset pack served by the web_assets component from
+# the files of a data/ directory.
+#
+# Every file is minified and gzipped, except templates, which are rendered
+# on the device and must stay plain text. The pack is flashed as is into a
+# data partition and mapped by the firmware, little endian:
+#
+#   header   magic "WAPK", u16 version, u16 count, u32 size, u32 crc32
+#   index    count entries sorted by path, 64 bytes each:
+#            char path[32], char etag[20], u32 offset, u32 size,
+#            u8 kind (0 gzip, 1 template), u8 reserved[3]
+#   blobs    file contents, each starting on a 4 byte boundary
+#
+# path and etag are NUL padded. The etag is the quoted, truncated sha256 of
+# the stored bytes and the crc32 covers everything after the header.
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import struct
+import sys
+import zlib
+
+MAGIC = b'WAPK'
+VERSION = 1
+HEADER = struct.Struct('<4sHHII')
+ENTRY = struct.Struct('<32s20sIIB3x')
+PATH_LEN = 32
+HASH_LEN = 16
+KIND_GZIP = 0
+KIND_TEMPLATE = 1
+
+
+def minify_html(text):
+    text = re.sub(r'<!--.*?-->', '', text, flags=re.S)
+    lines = (line.strip() for line in text.splitlines())
+    return '\n'.join(line for line in lines if line)
+
+
+def minify_css(text):
+    text = re.sub(r'/\*.*?\*/', '', text, flags=re.S)
+    text = re.sub(r'\s+', ' ', text)
+    text = re.sub(r'\s*([{};:,>])\s*', r'\1', text)
+    return text.replace(';}', '}').strip()
+
+
+def minify_js(text):
+    # conservative: keep line breaks so automatic semicolon insertion still
+    # sees the same statements, only drop indentation and comment lines
+    lines = (line.strip() for line in text.splitlines())
+    return '\n'.join(line for line in lines if line and not line.startswith('//'))
+
+
+MINIFIERS = {
+    '.html': minify_html,
+    '.htm': minify_html,
+    '.css': minify_css,
+    '.js': minify_js,
+}
+
+
+def build_asset(src, name, templates):
+    with open(src, 'rb') as f:
+        data = f.read()
+
+    minify = MINIFIERS.get(os.path.splitext(name)[1].lower())
+    if minify is not None:
+        data = minify(data.decode('utf-8')).encode('utf-8')
+
+    if name in templates:
+        return data, KIND_TEMPLATE
+    # mtime=0 keeps the output, and so the etag, reproducible across builds
+    return gzip.compress(data, compresslevel=9, mtime=0), KIND_GZIP
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def build_pack(assets):
+    assets = sorted(assets, key=lambda a: a[0].encode('utf-8'))
+    offset = HEADER.size + ENTRY.size * len(assets)
+
+    index = b''
+    blobs = b''
+    for path, kind, data in assets:
+        etag = '"{}"'.format(hashlib.sha256(data).hexdigest()[:HASH_LEN])
+        index += ENTRY.pack(path.encode('utf-8'), etag.encode('ascii'), offset, len(data), kind)
+        blob = data + b'\0' * (align4(len(data)) - len(data))
+        blobs += blob
+        offset += len(blob)
+
+    body = index + blobs
+    header = HEADER.pack(MAGIC, VERSION, len(assets), HEADER.size + len(body), zlib.crc32(body) & 0xffffffff)
+    return header + body
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a web asset pack')
+    parser.add_argument('src_dir', help='directory with the original assets')
+    parser.add_argument('output', help='pack image to write')
+    parser.add_argument('--template', action='append', default=[],
+                        help='file rendered on the device, minified but not compressed')
+    parser.add_argument('--max-size', type=lambda x: int(x, 0),
+                        help='size of the target partition')
+    args = parser.parse_args()
+
+    assets = []
+    total_in = 0
+    for root, _, files in os.walk(args.src_dir):
+        for filename in sorted(files):
+            src = os.path.join(root, filename)
+            name = os.path.relpath(src, args.src_dir).replace(os.sep, '/')
+            path = '/' + name
+            if len(path.encode('utf-8')) >= PATH_LEN:
+                sys.exit('{}: path longer than {} bytes'.format(path, PATH_LEN - 1))
+
+            data, kind = build_asset(src, name, args.template)
+            assets.append((path, kind, data))
+            total_in += os.path.getsize(src)
+            print('{}: {} -> {} bytes ({})'.format(path, os.path.getsize(src), len(data),
+                                                   'template' if kind == KIND_TEMPLATE else 'gzip'))
+
+    pack = build_pack(assets)
+    if args.max_size is not None and len(pack) > args.max_size:
+        sys.exit('asset pack is {} bytes, partition holds {}'.format(len(pack), args.max_size))
+
+    with open(args.output, 'wb') as f:
+        f.write(pack)
+    print('web assets: {} files, {} -> {} bytes'.format(len(assets), total_in, len(pack)))
+
+
+if __name__ == '__main__':
+    main()
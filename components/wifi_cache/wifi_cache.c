@@ -0,0 +1,277 @@
+/*
+ * wifi_cache.c
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "wifi_cache.h"
+
+#define WIFI_CACHE_MAGIC 0x57434331 // "WCC1"
+#define WIFI_CACHE_NVS_NAMESPACE "wifi_cache"
+#define WIFI_CACHE_NVS_KEY "ap"
+
+static const char *TAG = "wifi_cache";
+
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t has_lease;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+    int64_t leased_at; // time(), which keeps counting through deep sleep
+} wifi_cache_entry_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint8_t has_ap;
+    wifi_cache_entry_t entry;
+    wifi_cache_stats_t stats;
+    uint32_t crc32; // of everything above
+} wifi_cache_rtc_t;
+
+// not cleared on reset, only trusted when magic and crc match
+static RTC_NOINIT_ATTR wifi_cache_rtc_t rtc;
+// what NVS holds, to write flash only when the access point or address changes
+static wifi_cache_entry_t stored;
+static bool stored_valid;
+
+static wifi_cache_path_t path = WIFI_CACHE_MISS;
+static int64_t start_us;
+static bool connected;
+
+static const char *path_names[WIFI_CACHE_PATH_COUNT] = {
+    [WIFI_CACHE_MISS] = "full scan",
+    [WIFI_CACHE_AP] = "cached ap",
+    [WIFI_CACHE_LEASE] = "cached ap and lease",
+};
+
+static uint32_t wifi_cache_crc(void)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&rtc, offsetof(wifi_cache_rtc_t, crc32));
+}
+
+static void wifi_cache_seal(void)
+{
+    rtc.magic = WIFI_CACHE_MAGIC;
+    rtc.crc32 = wifi_cache_crc();
+}
+
+static bool wifi_cache_same_ap(const wifi_cache_entry_t *a, const wifi_cache_entry_t *b)
+{
+    return memcmp(a->bssid, b->bssid, sizeof(a->bssid)) == 0 && a->channel == b->channel &&
+           a->ip_info.ip.addr == b->ip_info.ip.addr && a->ip_info.gw.addr == b->ip_info.gw.addr &&
+           a->ip_info.netmask.addr == b->ip_info.netmask.addr;
+}
+
+static void wifi_cache_load_nvs(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return;
+    }
+    size_t len = sizeof(stored);
+    stored_valid = nvs_get_blob(nvs, WIFI_CACHE_NVS_KEY, &stored, &len) == ESP_OK && len == sizeof(stored);
+    nvs_close(nvs);
+}
+
+static void wifi_cache_store_nvs(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, WIFI_CACHE_NVS_KEY, &rtc.entry, sizeof(rtc.entry));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "could not store the access point: %s", esp_err_to_name(err));
+        return;
+    }
+    stored = rtc.entry;
+    stored_valid = true;
+}
+
+esp_err_t wifi_cache_init(void)
+{
+    wifi_cache_load_nvs();
+
+    if (rtc.magic == WIFI_CACHE_MAGIC && rtc.crc32 == wifi_cache_crc())
+    {
+        ESP_LOGI(TAG, "cache kept in rtc memory");
+        return ESP_OK;
+    }
+
+    // power on: only the access point survives, the clock the lease was timed with did not
+    memset(&rtc, 0, sizeof(rtc));
+    if (stored_valid)
+    {
+        rtc.has_ap = true;
+        rtc.entry = stored;
+        rtc.entry.has_lease = false;
+    }
+    wifi_cache_seal();
+    ESP_LOGI(TAG, "cache %s from nvs", stored_valid ? "loaded" : "not found");
+    return ESP_OK;
+}
+
+static bool wifi_cache_lease_fresh(void)
+{
+    if (CONFIG_WIFI_CACHE_LEASE_REUSE_S == 0 || !rtc.entry.has_lease)
+    {
+        return false;
+    }
+    int64_t age = (int64_t)time(NULL) - rtc.entry.leased_at;
+    return age >= 0 && age < CONFIG_WIFI_CACHE_LEASE_REUSE_S;
+}
+
+wifi_cache_path_t wifi_cache_apply(wifi_config_t *config, esp_netif_t *netif)
+{
+    start_us = esp_timer_get_time();
+    connected = false;
+    path = WIFI_CACHE_MISS;
+
+    if (!rtc.has_ap)
+    {
+        config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+        return path;
+    }
+
+    // a fast scan limited to one channel stops at the first match
+    memcpy(config->sta.bssid, rtc.entry.bssid, sizeof(config->sta.bssid));
+    config->sta.bssid_set = true;
+    config->sta.channel = rtc.entry.channel;
+    config->sta.scan_method = WIFI_FAST_SCAN;
+    path = WIFI_CACHE_AP;
+
+    if (wifi_cache_lease_fresh())
+    {
+        esp_err_t err = esp_netif_dhcpc_stop(netif);
+        if (err == ESP_OK || err == ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED)
+        {
+            err = esp_netif_set_ip_info(netif, &rtc.entry.ip_info);
+        }
+        if (err == ESP_OK)
+        {
+            esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &rtc.entry.dns);
+            path = WIFI_CACHE_LEASE;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "cached lease not applied: %s", esp_err_to_name(err));
+            esp_netif_dhcpc_start(netif);
+        }
+    }
+
+    ESP_LOGI(TAG, "connecting to " MACSTR " on channel %d", MAC2STR(rtc.entry.bssid), rtc.entry.channel);
+    if (path == WIFI_CACHE_LEASE)
+    {
+        ESP_LOGI(TAG, "reusing lease " IPSTR, IP2STR(&rtc.entry.ip_info.ip));
+    }
+    return path;
+}
+
+bool wifi_cache_fallback(wifi_config_t *config, esp_netif_t *netif)
+{
+    if (connected || path == WIFI_CACHE_MISS)
+    {
+        return false;
+    }
+
+    ESP_LOGW(TAG, "cached ap " MACSTR " not reachable, scanning", MAC2STR(rtc.entry.bssid));
+    if (path == WIFI_CACHE_LEASE)
+    {
+        esp_netif_dhcpc_start(netif);
+    }
+
+    rtc.stats.fallbacks++;
+    rtc.has_ap = false;
+    wifi_cache_seal();
+
+    config->sta.bssid_set = false;
+    config->sta.channel = 0;
+    config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    esp_wifi_set_config(WIFI_IF_STA, config);
+
+    // the time spent on the cached attempt is charged to the full scan
+    path = WIFI_CACHE_MISS;
+    return true;
+}
+
+void wifi_cache_connected(esp_netif_t *netif)
+{
+    if (connected)
+    {
+        return;
+    }
+    connected = true;
+
+    int64_t now_us = esp_timer_get_time();
+    uint32_t ms = (now_us - start_us) / 1000;
+    uint32_t n = ++rtc.stats.count[path];
+    rtc.stats.avg_ms[path] += ((int64_t)ms - rtc.stats.avg_ms[path]) / (int64_t)n;
+
+    ESP_LOGI(TAG, "connected via %s in %" PRIu32 " ms, %" PRIu32 " ms after wake, mean %" PRIu32 " ms over %" PRIu32,
+             path_names[path], ms, (uint32_t)(now_us / 1000), rtc.stats.avg_ms[path], n);
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+    {
+        memcpy(rtc.entry.bssid, ap.bssid, sizeof(rtc.entry.bssid));
+        rtc.entry.channel = ap.primary;
+        rtc.has_ap = true;
+    }
+    esp_netif_get_ip_info(netif, &rtc.entry.ip_info);
+    esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &rtc.entry.dns);
+    if (path != WIFI_CACHE_LEASE)
+    {
+        // the address just came from DHCP
+        rtc.entry.has_lease = true;
+        rtc.entry.leased_at = time(NULL);
+    }
+    wifi_cache_seal();
+
+    if (rtc.has_ap && (!stored_valid || !wifi_cache_same_ap(&stored, &rtc.entry)))
+    {
+        wifi_cache_store_nvs();
+    }
+}
+
+void wifi_cache_clear(void)
+{
+    memset(&rtc.entry, 0, sizeof(rtc.entry));
+    rtc.has_ap = false;
+    wifi_cache_seal();
+
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK)
+    {
+        nvs_erase_key(nvs, WIFI_CACHE_NVS_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    stored_valid = false;
+}
+
+void wifi_cache_get_stats(wifi_cache_stats_t *stats)
+{
+    *stats = rtc.stats;
+}
@@ -0,0 +1,77 @@
+/*
+ * wifi_cache.h
+ *
+ * Fast Wi-Fi reconnect for nodes that wake, publish and sleep again. The
+ * BSSID and channel of the last access point and the last DHCP lease are
+ * kept in RTC memory, which survives deep sleep and software resets, and
+ * mirrored in NVS when they change, so a power cycle only loses the lease.
+ *
+ * With a cached access point the station connects straight to its BSSID on
+ * its channel instead of scanning every channel, and a lease younger than
+ * WIFI_CACHE_LEASE_REUSE_S is configured statically instead of running DHCP.
+ * When the cached access point is gone or refuses the connection the cache
+ * is dropped and the station falls back to a full scan and DHCP.
+ *
+ * Wake to connected times are kept in RTC memory too, per path, so the
+ * effect can be read off the log of any node.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+
+typedef enum
+{
+    WIFI_CACHE_MISS = 0, // full scan and DHCP
+    WIFI_CACHE_AP,       // directed connect, DHCP
+    WIFI_CACHE_LEASE,    // directed connect, cached lease
+    WIFI_CACHE_PATH_COUNT,
+} wifi_cache_path_t;
+
+typedef struct
+{
+    uint32_t count[WIFI_CACHE_PATH_COUNT];       // connections per path
+    uint32_t avg_ms[WIFI_CACHE_PATH_COUNT];      // mean wifi start to ip
+    uint32_t fallbacks;                          // cached connects that failed
+} wifi_cache_stats_t;
+
+/**
+ * Loads the cache, from RTC memory or else from NVS. Call after
+ * nvs_flash_init().
+ */
+esp_err_t wifi_cache_init(void);
+
+/**
+ * Points config at the cached access point and, if the lease is fresh,
+ * configures it on netif with DHCP stopped. Call before esp_wifi_set_config,
+ * it marks the start of the measured connect.
+ *
+ * @return the path taken.
+ */
+wifi_cache_path_t wifi_cache_apply(wifi_config_t *config, esp_netif_t *netif);
+
+/**
+ * Call on WIFI_EVENT_STA_DISCONNECTED before reconnecting. If the connect
+ * was using the cache, drops it, restores a full scan in config, restarts
+ * DHCP on netif and applies the new config.
+ *
+ * @return true when it fell back and a reconnect is due.
+ */
+bool wifi_cache_fallback(wifi_config_t *config, esp_netif_t *netif);
+
+/**
+ * Call on IP_EVENT_STA_GOT_IP: records the connect time and stores the
+ * access point and lease in use.
+ */
+void wifi_cache_connected(esp_netif_t *netif);
+
+/**
+ * Forgets the cached access point and lease.
+ */
+void wifi_cache_clear(void);
+
+void wifi_cache_get_stats(wifi_cache_stats_t *stats);
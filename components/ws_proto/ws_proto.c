@@ -0,0 +1,81 @@
+/*
+ * ws_proto.c
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "ws_proto.h"
+
+static const char *TAG = "ws_proto";
+
+_Static_assert(sizeof(ws_proto_header_t) == 4, "header layout is part of the protocol");
+_Static_assert(sizeof(ws_proto_state_t) == 5, "state report layout is part of the protocol");
+_Static_assert(sizeof(ws_proto_telemetry_t) == 8, "telemetry report layout is part of the protocol");
+
+size_t ws_proto_encode(uint8_t *buf, size_t len, uint8_t opcode, uint16_t seq, const void *payload,
+                       size_t payload_len)
+{
+    ws_proto_header_t header = {
+        .version = WS_PROTO_VERSION,
+        .opcode = opcode,
+        .seq = seq};
+
+    if (len < sizeof(header) + payload_len)
+    {
+        return 0;
+    }
+    memcpy(buf, &header, sizeof(header));
+    if (payload_len > 0)
+    {
+        memcpy(buf + sizeof(header), payload, payload_len);
+    }
+    return sizeof(header) + payload_len;
+}
+
+static esp_err_t ws_proto_reject(httpd_req_t *req, const ws_proto_header_t *header, uint8_t code)
+{
+    ws_proto_error_t error = {
+        .code = code,
+        .opcode = header->opcode};
+    uint8_t buf[sizeof(ws_proto_header_t) + sizeof(error)];
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = buf,
+        .len = ws_proto_encode(buf, sizeof(buf), WS_OP_ERROR, header->seq, &error, sizeof(error))};
+
+    ESP_LOGW(TAG, "rejected opcode 0x%02x seq %u: error %d", header->opcode, header->seq, code);
+    return httpd_ws_send_frame(req, &frame);
+}
+
+esp_err_t ws_proto_dispatch(httpd_req_t *req, const ws_proto_command_t *commands, size_t count,
+                            const uint8_t *frame, size_t len)
+{
+    ws_proto_header_t header = {0};
+
+    if (len < sizeof(header))
+    {
+        return ws_proto_reject(req, &header, WS_PROTO_ERR_LENGTH);
+    }
+    memcpy(&header, frame, sizeof(header));
+
+    if (header.version != WS_PROTO_VERSION)
+    {
+        return ws_proto_reject(req, &header, WS_PROTO_ERR_VERSION);
+    }
+    if (header.opcode >= count || commands[header.opcode].handler == NULL)
+    {
+        return ws_proto_reject(req, &header, WS_PROTO_ERR_OPCODE);
+    }
+
+    const ws_proto_command_t *command = &commands[header.opcode];
+    if (len - sizeof(header) != command->payload_len)
+    {
+        return ws_proto_reject(req, &header, WS_PROTO_ERR_LENGTH);
+    }
+    if (command->handler(req, &header, frame + sizeof(header)) != ESP_OK)
+    {
+        return ws_proto_reject(req, &header, WS_PROTO_ERR_FAILED);
+    }
+    return ESP_OK;
+}
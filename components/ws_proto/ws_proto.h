@@ -0,0 +1,111 @@
+/*
+ * ws_proto.h
+ *
+ * Binary WebSocket protocol between the dashboard and the device. Every
+ * frame is a binary WebSocket message starting with a 4 byte header,
+ * followed by a payload whose layout is fixed by the opcode. Multi-byte
+ * fields are little endian. The JS side of the codec is in data/app.js.
+ *
+ *   0        1        2        4
+ *   +--------+--------+--------+------------------
+ *   | version| opcode |  seq   | payload ...
+ *   +--------+--------+--------+------------------
+ *
+ * Commands (client to server) carry the client's sequence number. The
+ * reply to a command, a state report for GET_STATE or an error report when
+ * it is rejected, echoes it. State reports pushed on a change carry the
+ * server's own push counter instead.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+#define WS_PROTO_VERSION 1
+
+typedef enum
+{
+    // commands
+    WS_OP_TOGGLE = 0x01,    // no payload
+    WS_OP_SET = 0x02,       // ws_proto_set_t
+    WS_OP_GET_STATE = 0x03, // no payload, answered with a state report
+    WS_OP_TELEMETRY_SUBSCRIBE = 0x04, // ws_proto_subscribe_t
+    WS_OP_COMMAND_COUNT,
+
+    // reports
+    WS_OP_STATE = 0x81,     // ws_proto_state_t
+    WS_OP_TELEMETRY = 0x82, // ws_proto_telemetry_t, then count int16_t samples
+    WS_OP_ERROR = 0xFF, // ws_proto_error_t
+} ws_proto_opcode_t;
+
+typedef enum
+{
+    WS_PROTO_ERR_VERSION = 1,
+    WS_PROTO_ERR_OPCODE = 2,
+    WS_PROTO_ERR_LENGTH = 3,
+    WS_PROTO_ERR_FAILED = 4, // the handler returned an error
+} ws_proto_error_code_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t seq;
+} ws_proto_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t led;
+} ws_proto_set_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t uptime_ms;
+    uint8_t led;
+} ws_proto_state_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t enable;
+} ws_proto_subscribe_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t first;   // stream position of the first sample
+    uint16_t count;   // samples that follow
+    uint16_t dropped; // samples lost to a full ring since the previous frame
+} ws_proto_telemetry_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t code; // ws_proto_error_code_t
+    uint8_t opcode;
+} ws_proto_error_t;
+
+typedef esp_err_t (*ws_proto_handler_t)(httpd_req_t *req, const ws_proto_header_t *header, const void *payload);
+
+typedef struct
+{
+    ws_proto_handler_t handler; // NULL for unknown opcodes
+    uint8_t payload_len;        // exact payload size the handler expects
+} ws_proto_command_t;
+
+/**
+ * Writes header and payload into buf.
+ *
+ * @return frame length, 0 if buf is too small.
+ */
+size_t ws_proto_encode(uint8_t *buf, size_t len, uint8_t opcode, uint16_t seq, const void *payload,
+                       size_t payload_len);
+
+/**
+ * Validates a received frame and calls the handler that commands[opcode]
+ * holds for it. Rejected frames are answered with an error report.
+ *
+ * @param commands table indexed by opcode, count entries long
+ */
+esp_err_t ws_proto_dispatch(httpd_req_t *req, const ws_proto_command_t *commands, size_t count,
+                            const uint8_t *frame, size_t len);
@@ -0,0 +1,30 @@
+/*
+ * esp_err.h
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_STATE 0x103
+
+static inline const char *esp_err_to_name(esp_err_t err)
+{
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+#define ESP_ERROR_CHECK(x)                                     \
+    do                                                         \
+    {                                                          \
+        if ((x) != ESP_OK)                                     \
+        {                                                      \
+            fprintf(stderr, "%s failed at line %d\n", #x, __LINE__); \
+            abort();                                           \
+        }                                                      \
+    } while (0)
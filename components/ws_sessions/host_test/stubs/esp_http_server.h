@@ -0,0 +1,70 @@
+/*
+ * esp_http_server.h
+ *
+ * The part of the http server ws_sessions uses. Frames are sent the way
+ * httpd does it, header and payload through the send override of the
+ * session.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "esp_err.h"
+
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_INVALID -2
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+#define HTTPD_RESP_USE_STRLEN -1
+
+typedef void *httpd_handle_t;
+
+typedef struct
+{
+    httpd_handle_t handle;
+    int fd; // host test only, what httpd_req_to_sockfd returns
+} httpd_req_t;
+
+typedef esp_err_t (*httpd_open_func_t)(httpd_handle_t hd, int sockfd);
+typedef void (*httpd_close_func_t)(httpd_handle_t hd, int sockfd);
+typedef int (*httpd_send_func_t)(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags);
+typedef int (*httpd_recv_func_t)(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags);
+typedef void (*httpd_work_fn_t)(void *arg);
+
+typedef struct
+{
+    uint16_t max_open_sockets;
+    bool lru_purge_enable;
+    httpd_open_func_t open_fn;
+    httpd_close_func_t close_fn;
+} httpd_config_t;
+
+typedef enum
+{
+    HTTPD_WS_TYPE_CONTINUE = 0x0,
+    HTTPD_WS_TYPE_TEXT = 0x1,
+    HTTPD_WS_TYPE_BINARY = 0x2,
+    HTTPD_WS_TYPE_CLOSE = 0x8,
+    HTTPD_WS_TYPE_PING = 0x9,
+    HTTPD_WS_TYPE_PONG = 0xA
+} httpd_ws_type_t;
+
+typedef struct
+{
+    bool final;
+    bool fragmented;
+    httpd_ws_type_t type;
+    uint8_t *payload;
+    size_t len;
+} httpd_ws_frame_t;
+
+int httpd_req_to_sockfd(httpd_req_t *req);
+esp_err_t httpd_sess_set_send_override(httpd_handle_t hd, int sockfd, httpd_send_func_t send_func);
+esp_err_t httpd_sess_set_recv_override(httpd_handle_t hd, int sockfd, httpd_recv_func_t recv_func);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t hd, int sockfd);
+esp_err_t httpd_queue_work(httpd_handle_t hd, httpd_work_fn_t work, void *arg);
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame);
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t buf_len);
@@ -0,0 +1,13 @@
+/*
+ * freertos/FreeRTOS.h
+ *
+ * The host test runs on one thread, critical sections are no-ops.
+ */
+
+#pragma once
+
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZE(mux) (*(mux) = 0)
+#define taskENTER_CRITICAL(mux) ((void)(mux))
+#define taskEXIT_CRITICAL(mux) ((void)(mux))
@@ -0,0 +1,11 @@
+/*
+ * lwip/sockets.h
+ *
+ * The host socket api, send and recv are replaced by the test.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
@@ -0,0 +1,19 @@
+/*
+ * sdkconfig.h
+ *
+ * Kconfig defaults of ws_sessions for the host test.
+ */
+
+#pragma once
+
+#define CONFIG_LWIP_MAX_SOCKETS 10
+#define CONFIG_WS_SESSIONS_MAX_OPEN 4
+#define CONFIG_WS_SESSIONS_HTTP_RESERVE 1
+#define CONFIG_WS_SESSIONS_HTTP_IDLE_MS 1000
+#define CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS 20
+#define CONFIG_WS_SESSIONS_SEND_BUDGET 256
+#define CONFIG_WS_SESSIONS_SLOW_DROP_MS 3000
+#define CONFIG_WS_SESSIONS_PING_INTERVAL_MS 2000
+#define CONFIG_WS_SESSIONS_PING_MISSES 2
+#define CONFIG_WS_SESSIONS_FRAME_POOL_COUNT 2
+#define CONFIG_WS_SESSIONS_FRAME_BUF_SIZE 128
@@ -0,0 +1,324 @@
+/*
+ * test_ws_sessions.c
+ *
+ * Host test of the WebSocket send path of ws_sessions. The client socket
+ * takes a set number of bytes, then would block, so a frame can be left
+ * half sent in the backlog of its session. Timers fire when the test says
+ * so and httpd_queue_work runs the job right away, the test plays the
+ * httpd task.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_http_server.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include "ws_sessions.h"
+
+#define SERVER ((httpd_handle_t)0x5e)
+#define CLIENT_FD 54
+
+#define CHECK(cond)                                                          \
+    do                                                                       \
+    {                                                                        \
+        if (!(cond))                                                         \
+        {                                                                    \
+            printf("%s:%d: %s failed\n", __func__, __LINE__, #cond);         \
+            return 1;                                                        \
+        }                                                                    \
+    } while (0)
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    bool active;
+    bool periodic;
+};
+
+static struct esp_timer timers[4];
+static int timer_count;
+static int64_t now_us = 1000000;
+
+// the client socket
+static size_t room; // bytes it takes before it would block
+static uint8_t wire[4096];
+static size_t wire_len;
+static httpd_send_func_t send_override;
+
+// body of the last /stats response
+static char stats_body[2048];
+static size_t stats_len;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+    struct esp_timer *t = &timers[timer_count++];
+    t->callback = args->callback;
+    t->arg = args->arg;
+    t->name = args->name;
+    *out = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->active)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = true;
+    timer->periodic = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    timer->active = true;
+    timer->periodic = true;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    return timer->active;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return now_us;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 200000;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    if (fd != CLIENT_FD)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    size_t n = len < room ? len : room;
+    if (n == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(wire + wire_len, buf, n);
+    wire_len += n;
+    room -= n;
+    return n;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *req)
+{
+    return req->fd;
+}
+
+esp_err_t httpd_sess_set_send_override(httpd_handle_t hd, int sockfd, httpd_send_func_t send_func)
+{
+    send_override = send_func;
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_set_recv_override(httpd_handle_t hd, int sockfd, httpd_recv_func_t recv_func)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t hd, int sockfd)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t hd, httpd_work_fn_t work, void *arg)
+{
+    work(arg);
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame)
+{
+    uint8_t header[4] = {(frame->final ? 0x80 : 0) | frame->type};
+    size_t header_len = 2;
+    if (frame->len < 126)
+    {
+        header[1] = frame->len;
+    }
+    else
+    {
+        header[1] = 126;
+        header[2] = frame->len >> 8;
+        header[3] = frame->len & 0xff;
+        header_len = 4;
+    }
+
+    if (send_override(hd, fd, (const char *)header, header_len, 0) < 0)
+    {
+        return ESP_FAIL;
+    }
+    if (frame->len > 0 && send_override(hd, fd, (const char *)frame->payload, frame->len, 0) < 0)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t buf_len)
+{
+    if (buf == NULL)
+    {
+        return ESP_OK;
+    }
+    size_t n = buf_len == HTTPD_RESP_USE_STRLEN ? strlen(buf) : (size_t)buf_len;
+    memcpy(stats_body + stats_len, buf, n);
+    stats_len += n;
+    stats_body[stats_len] = '\0';
+    return ESP_OK;
+}
+
+static struct esp_timer *timer(const char *name)
+{
+    for (int i = 0; i < timer_count; i++)
+    {
+        if (strcmp(timers[i].name, name) == 0)
+        {
+            return &timers[i];
+        }
+    }
+    return NULL;
+}
+
+static void fire(struct esp_timer *t)
+{
+    t->active = t->periodic;
+    t->callback(t->arg);
+}
+
+// backlog of the client session, as /stats reports it
+static int backlog(void)
+{
+    httpd_req_t req = {.handle = SERVER};
+    stats_len = 0;
+    ws_sessions_stats_handler(&req);
+    const char *p = strstr(stats_body, "\"backlog\":");
+    return p != NULL ? atoi(p + strlen("\"backlog\":")) : -1;
+}
+
+// a fresh server with the client connected to /ws, subscribed to channel 0
+static void setup(void)
+{
+    httpd_config_t config = {0};
+    httpd_req_t req = {.handle = SERVER, .fd = CLIENT_FD};
+
+    for (int i = 0; i < timer_count; i++)
+    {
+        timers[i].active = false;
+    }
+    ws_sessions_configure(&config);
+    ws_sessions_start(SERVER);
+    config.open_fn(SERVER, CLIENT_FD);
+    ws_sessions_set_websocket(&req);
+    ws_sessions_subscribe(&req, 0, true);
+    timer("ws_keepalive")->active = false; // out of the way unless a test fires it
+    wire_len = 0;
+    room = sizeof(wire);
+}
+
+static int test_published_frame_drained(void)
+{
+    uint8_t payload[100];
+    httpd_ws_frame_t frame = {.final = true, .type = HTTPD_WS_TYPE_TEXT, .payload = payload, .len = sizeof(payload)};
+    int lagging;
+
+    setup();
+    for (size_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i;
+    }
+
+    // nothing else is going on, no state change and no push on its way
+    room = 10;
+    CHECK(ws_sessions_publish(SERVER, 0, &frame, 1, &lagging) == 1);
+    CHECK(wire_len == 10);
+    CHECK(backlog() == 2 + sizeof(payload) - 10);
+    CHECK(timer("ws_push")->active);
+
+    room = sizeof(wire);
+    fire(timer("ws_push"));
+    CHECK(backlog() == 0);
+    CHECK(wire_len == 2 + sizeof(payload));
+    CHECK(wire[0] == 0x81 && wire[1] == sizeof(payload));
+    CHECK(memcmp(wire + 2, payload, sizeof(payload)) == 0);
+    CHECK(!timer("ws_push")->active); // caught up, nothing left to drain
+
+    // caught up, so the next frame is not skipped
+    CHECK(ws_sessions_publish(SERVER, 0, &frame, 1, &lagging) == 1);
+    CHECK(lagging == 0);
+    CHECK(wire_len == 2 * (2 + sizeof(payload)));
+    return 0;
+}
+
+static int test_ping_drained(void)
+{
+    setup();
+
+    // silent for a whole interval, the keepalive pings it
+    now_us += CONFIG_WS_SESSIONS_PING_INTERVAL_MS * 1000LL + 1;
+    room = 1;
+    fire(timer("ws_keepalive"));
+    CHECK(wire_len == 1);
+    CHECK(backlog() == 1);
+    CHECK(timer("ws_push")->active);
+
+    room = sizeof(wire);
+    fire(timer("ws_push"));
+    CHECK(backlog() == 0);
+    CHECK(wire_len == 2);
+    CHECK(wire[0] == 0x89 && wire[1] == 0);
+    return 0;
+}
+
+static int test_slow_session_dropped(void)
+{
+    uint8_t payload[16] = {0};
+    httpd_ws_frame_t frame = {.final = true, .type = HTTPD_WS_TYPE_BINARY, .payload = payload, .len = sizeof(payload)};
+    ws_sessions_stats_t st;
+    int lagging;
+
+    setup();
+
+    // the drain keeps coming while the client takes nothing
+    room = 0;
+    ws_sessions_publish(SERVER, 0, &frame, 1, &lagging);
+    for (int i = 0; i < 1000 && timer("ws_push")->active; i++)
+    {
+        now_us += CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS * 1000LL;
+        fire(timer("ws_push"));
+    }
+    ws_sessions_get_stats(&st);
+    CHECK(st.dropped == 1);
+    CHECK(!timer("ws_push")->active);
+    return 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+    failed += test_published_frame_drained();
+    failed += test_ping_drained();
+    failed += test_slow_session_dropped();
+    printf("%s\n", failed ? "FAIL" : "OK");
+    return failed ? 1 : 0;
+}
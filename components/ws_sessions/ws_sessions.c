@@ -0,0 +1,645 @@
+/*
+ * ws_sessions.c
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <lwip/sockets.h>
+#include "slab_pool.h"
+#include "ws_sessions.h"
+
+// listening socket plus the two control sockets of the httpd task
+#if CONFIG_WS_SESSIONS_MAX_OPEN > CONFIG_LWIP_MAX_SOCKETS - 3
+#error "WS_SESSIONS_MAX_OPEN must not exceed LWIP_MAX_SOCKETS - 3"
+#endif
+
+static const char *TAG = "ws_sessions";
+
+typedef struct
+{
+    int fd; // -1 when the slot is free
+    bool websocket;
+    bool closing; // eviction requested, waiting for close_fn
+    bool stale;   // skipped a state push while lagging, owed the latest state
+    uint32_t channels; // bit n set when subscribed to channel n
+    uint8_t missed_pings;
+    int64_t opened_us;
+    int64_t active_us;
+    int64_t lagging_us; // when the backlog last went from empty to not empty
+    int64_t ping_us;    // last keepalive ping
+    uint16_t backlog_len;
+    // bytes of WebSocket frames the socket did not take yet, the send budget
+    uint8_t backlog[CONFIG_WS_SESSIONS_SEND_BUDGET];
+} ws_session_t;
+
+static ws_session_t sessions[CONFIG_WS_SESSIONS_MAX_OPEN];
+// the WebSocket sessions, packed at the front, broadcasts walk only these
+static ws_session_t *subscribers[CONFIG_WS_SESSIONS_MAX_OPEN];
+static ws_sessions_stats_t stats;
+static httpd_handle_t server_handle;
+
+#if CONFIG_WS_SESSIONS_PING_INTERVAL_MS > 0
+static esp_timer_handle_t keepalive_timer;
+#endif
+
+// coalesced state push, see ws_sessions_state_changed
+static esp_timer_handle_t push_timer;
+static volatile bool state_dirty;
+static int64_t last_push_us;
+static ws_sessions_render_t state_render;
+static httpd_ws_type_t state_type;
+static void *state_ctx;
+static uint8_t state_buf[CONFIG_WS_SESSIONS_FRAME_BUF_SIZE];
+static size_t state_len;
+
+SLAB_POOL_STORAGE(frame_storage, CONFIG_WS_SESSIONS_FRAME_BUF_SIZE, CONFIG_WS_SESSIONS_FRAME_POOL_COUNT);
+static slab_pool_t frame_pool;
+
+// free heap while no session is open, the reference for heap_per_session
+static uint32_t heap_baseline;
+
+static void ws_sessions_unsubscribe(ws_session_t *session)
+{
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        if (subscribers[i] == session)
+        {
+            // order does not matter, move the last one into the hole
+            subscribers[i] = subscribers[--stats.websocket];
+            return;
+        }
+    }
+}
+
+static ws_session_t *ws_sessions_find(int fd)
+{
+    for (int i = 0; i < CONFIG_WS_SESSIONS_MAX_OPEN; i++)
+    {
+        if (sessions[i].fd == fd)
+        {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// same as the default httpd recv, plus the activity timestamp used for lru
+static int ws_sessions_recv(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags)
+{
+    if (buf == NULL)
+    {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+
+    ws_session_t *session = ws_sessions_find(sockfd);
+    if (session != NULL)
+    {
+        session->active_us = esp_timer_get_time();
+    }
+
+    int ret = recv(sockfd, buf, buf_len, flags);
+    if (ret < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    return ret;
+}
+
+static void ws_sessions_drop(httpd_handle_t hd, ws_session_t *session, const char *why)
+{
+    if (session->closing)
+    {
+        return;
+    }
+    ESP_LOGW(TAG, "dropping slow session %d: %s", session->fd, why);
+    session->closing = true;
+    stats.dropped++;
+    httpd_sess_trigger_close(hd, session->fd);
+}
+
+// WebSocket sessions only: never blocks the httpd task on a slow client,
+// what the socket does not take right away waits in the session backlog
+static int ws_sessions_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags)
+{
+    if (buf == NULL)
+    {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+
+    ws_session_t *session = ws_sessions_find(sockfd);
+    if (session == NULL)
+    {
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+
+    size_t sent = 0;
+    // anything queued behind a backlog would reorder the stream
+    if (session->backlog_len == 0)
+    {
+        int ret = send(sockfd, buf, buf_len, flags | MSG_DONTWAIT);
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return HTTPD_SOCK_ERR_FAIL;
+        }
+        sent = ret > 0 ? ret : 0;
+    }
+
+    size_t rest = buf_len - sent;
+    if (rest == 0)
+    {
+        return buf_len;
+    }
+    if (session->backlog_len + rest > sizeof(session->backlog))
+    {
+        ws_sessions_drop(hd, session, "send budget exceeded");
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+
+    if (session->backlog_len == 0)
+    {
+        session->lagging_us = esp_timer_get_time();
+        // pushes drain the backlogs, make sure one comes whatever sent the
+        // frame, an armed timer already brings one
+        if (push_timer != NULL && !esp_timer_is_active(push_timer))
+        {
+            esp_timer_start_once(push_timer, CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS * 1000ULL);
+        }
+    }
+    memcpy(session->backlog + session->backlog_len, buf + sent, rest);
+    session->backlog_len += rest;
+    return buf_len;
+}
+
+static void ws_sessions_make_room(httpd_handle_t hd, int new_fd)
+{
+    int64_t now = esp_timer_get_time();
+    ws_session_t *lru = NULL;
+
+    for (int i = 0; i < CONFIG_WS_SESSIONS_MAX_OPEN; i++)
+    {
+        ws_session_t *s = &sessions[i];
+        if (s->fd < 0 || s->fd == new_fd || s->websocket || s->closing ||
+            now - s->active_us < CONFIG_WS_SESSIONS_HTTP_IDLE_MS * 1000LL)
+        {
+            continue;
+        }
+        if (lru == NULL || s->active_us < lru->active_us)
+        {
+            lru = s;
+        }
+    }
+
+    if (lru != NULL)
+    {
+        ESP_LOGI(TAG, "evicting http session %d, idle %d ms", lru->fd, (int)((now - lru->active_us) / 1000));
+        lru->closing = true;
+        stats.evicted++;
+        httpd_sess_trigger_close(hd, lru->fd);
+    }
+    else if (stats.open == stats.max_open)
+    {
+        ESP_LOGW(TAG, "session table full: %d open, %d websocket", stats.open, stats.websocket);
+        stats.saturated++;
+    }
+}
+
+static esp_err_t ws_sessions_open(httpd_handle_t hd, int sockfd)
+{
+    ws_session_t *session = ws_sessions_find(-1);
+    if (session == NULL)
+    {
+        // httpd never opens more than max_open_sockets, so this is a bug
+        ESP_LOGE(TAG, "no free slot for session %d", sockfd);
+        return ESP_FAIL;
+    }
+
+    session->fd = sockfd;
+    session->websocket = false;
+    session->closing = false;
+    session->stale = false;
+    session->channels = 0;
+    session->missed_pings = 0;
+    session->ping_us = 0;
+    session->backlog_len = 0;
+    session->opened_us = session->active_us = esp_timer_get_time();
+    stats.open++;
+    stats.accepted++;
+    httpd_sess_set_recv_override(hd, sockfd, ws_sessions_recv);
+
+    if (stats.max_open - stats.open < CONFIG_WS_SESSIONS_HTTP_RESERVE)
+    {
+        ws_sessions_make_room(hd, sockfd);
+    }
+    return ESP_OK;
+}
+
+static void ws_sessions_close(httpd_handle_t hd, int sockfd)
+{
+    ws_session_t *session = ws_sessions_find(sockfd);
+    if (session != NULL)
+    {
+        if (session->websocket)
+        {
+            ws_sessions_unsubscribe(session);
+        }
+        session->fd = -1;
+        stats.open--;
+    }
+
+    // a custom close_fn owns closing the socket
+    close(sockfd);
+
+    if (stats.open == 0)
+    {
+        heap_baseline = esp_get_free_heap_size();
+    }
+}
+
+void ws_sessions_configure(httpd_config_t *config)
+{
+    for (int i = 0; i < CONFIG_WS_SESSIONS_MAX_OPEN; i++)
+    {
+        sessions[i].fd = -1;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.max_open = CONFIG_WS_SESSIONS_MAX_OPEN;
+
+    slab_pool_init(&frame_pool, frame_storage, CONFIG_WS_SESSIONS_FRAME_BUF_SIZE,
+                   CONFIG_WS_SESSIONS_FRAME_POOL_COUNT);
+
+    config->max_open_sockets = CONFIG_WS_SESSIONS_MAX_OPEN;
+    // the built-in lru purge would evict WebSocket sessions as well
+    config->lru_purge_enable = false;
+    config->open_fn = ws_sessions_open;
+    config->close_fn = ws_sessions_close;
+}
+
+// runs in the httpd task: renders and broadcasts the state if it changed,
+// then lets lagging sessions catch up
+static void ws_sessions_push(void *arg)
+{
+    bool lagging = false;
+    int64_t now = esp_timer_get_time();
+
+    if (state_dirty && state_render != NULL)
+    {
+        state_dirty = false;
+        state_len = state_render(state_buf, sizeof(state_buf), state_ctx);
+        last_push_us = now;
+
+        httpd_ws_frame_t frame = {
+            .final = true,
+            .type = state_type,
+            .payload = state_buf,
+            .len = state_len};
+        ws_sessions_broadcast(server_handle, &frame, 1);
+        stats.pushes++;
+    }
+
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        ws_session_t *s = subscribers[i];
+        if (s->closing || (s->backlog_len == 0 && !s->stale))
+        {
+            continue;
+        }
+
+        int ret = s->backlog_len ? send(s->fd, s->backlog, s->backlog_len, MSG_DONTWAIT) : 0;
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            ws_sessions_drop(server_handle, s, "send failed");
+            continue;
+        }
+        if (ret > 0)
+        {
+            s->backlog_len -= ret;
+            memmove(s->backlog, s->backlog + ret, s->backlog_len);
+        }
+
+        if (s->backlog_len == 0)
+        {
+            if (s->stale && state_len > 0)
+            {
+                // one compacted frame instead of every push it missed
+                s->stale = false;
+                httpd_ws_frame_t frame = {
+                    .final = true,
+                    .type = state_type,
+                    .payload = state_buf,
+                    .len = state_len};
+                httpd_ws_send_frame_async(server_handle, s->fd, &frame);
+            }
+        }
+        else if (now - s->lagging_us > CONFIG_WS_SESSIONS_SLOW_DROP_MS * 1000LL)
+        {
+            ws_sessions_drop(server_handle, s, "lagging");
+        }
+        lagging = lagging || s->backlog_len > 0;
+    }
+
+    if (lagging)
+    {
+        esp_timer_start_once(push_timer, CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS * 1000ULL);
+    }
+}
+
+static void ws_sessions_push_timer(void *arg)
+{
+    if (httpd_queue_work(server_handle, ws_sessions_push, NULL) != ESP_OK)
+    {
+        esp_timer_start_once(push_timer, CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS * 1000ULL);
+    }
+}
+
+#if CONFIG_WS_SESSIONS_PING_INTERVAL_MS > 0
+// runs in the httpd task. httpd answers pings and swallows pongs without
+// calling the handler, but every pong goes through ws_sessions_recv, so a
+// session that was active since its last ping is alive
+static void ws_sessions_keepalive(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    httpd_ws_frame_t ping = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_PING};
+
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        ws_session_t *s = subscribers[i];
+        if (s->closing)
+        {
+            continue;
+        }
+
+        if (s->active_us > s->ping_us)
+        {
+            s->missed_pings = 0;
+            if (now - s->active_us < CONFIG_WS_SESSIONS_PING_INTERVAL_MS * 1000LL)
+            {
+                continue; // heard from it within the interval, no ping needed
+            }
+        }
+        else if (++s->missed_pings >= CONFIG_WS_SESSIONS_PING_MISSES)
+        {
+            ESP_LOGI(TAG, "reaping session %d, silent for %d ms", s->fd, (int)((now - s->active_us) / 1000));
+            s->closing = true;
+            stats.reaped++;
+            httpd_sess_trigger_close(server_handle, s->fd);
+            continue;
+        }
+
+        s->ping_us = now;
+        if (httpd_ws_send_frame_async(server_handle, s->fd, &ping) == ESP_OK)
+        {
+            stats.pings++;
+        }
+    }
+}
+
+static void ws_sessions_keepalive_timer(void *arg)
+{
+    httpd_queue_work(server_handle, ws_sessions_keepalive, NULL);
+}
+#endif
+
+void ws_sessions_start(httpd_handle_t server)
+{
+    const esp_timer_create_args_t push_timer_args = {
+        .callback = ws_sessions_push_timer,
+        .name = "ws_push"};
+
+    server_handle = server;
+    if (push_timer == NULL)
+    {
+        ESP_ERROR_CHECK(esp_timer_create(&push_timer_args, &push_timer));
+    }
+#if CONFIG_WS_SESSIONS_PING_INTERVAL_MS > 0
+    const esp_timer_create_args_t keepalive_timer_args = {
+        .callback = ws_sessions_keepalive_timer,
+        .name = "ws_keepalive"};
+    if (keepalive_timer == NULL)
+    {
+        ESP_ERROR_CHECK(esp_timer_create(&keepalive_timer_args, &keepalive_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(keepalive_timer, CONFIG_WS_SESSIONS_PING_INTERVAL_MS * 1000ULL));
+    }
+#endif
+
+    heap_baseline = esp_get_free_heap_size();
+    ESP_LOGI(TAG, "capacity %d sessions, %d kept free for new clients, %" PRIu32 " bytes heap free",
+             CONFIG_WS_SESSIONS_MAX_OPEN, CONFIG_WS_SESSIONS_HTTP_RESERVE, heap_baseline);
+}
+
+void ws_sessions_set_websocket(httpd_req_t *req)
+{
+    ws_session_t *session = ws_sessions_find(httpd_req_to_sockfd(req));
+    if (session == NULL || session->websocket)
+    {
+        return;
+    }
+
+    session->websocket = true;
+    subscribers[stats.websocket++] = session;
+    httpd_sess_set_send_override(req->handle, session->fd, ws_sessions_send);
+    if (stats.websocket > stats.peak_websocket)
+    {
+        stats.peak_websocket = stats.websocket;
+    }
+}
+
+int ws_sessions_broadcast(httpd_handle_t hd, httpd_ws_frame_t *frames, size_t count)
+{
+    int sent = 0;
+
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        ws_session_t *s = subscribers[i];
+        int fd = s->fd;
+        esp_err_t err = ESP_OK;
+
+        if (s->closing)
+        {
+            continue;
+        }
+        if (s->backlog_len > 0)
+        {
+            // still behind, it gets the latest state once it catches up
+            s->stale = true;
+            stats.skipped++;
+            continue;
+        }
+
+        for (size_t f = 0; f < count && err == ESP_OK; f++)
+        {
+            err = httpd_ws_send_frame_async(hd, fd, &frames[f]);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGW(TAG, "broadcast to %d failed: %s", fd, esp_err_to_name(err));
+            continue;
+        }
+        sent++;
+    }
+    stats.broadcasts++;
+    return sent;
+}
+
+void ws_sessions_subscribe(httpd_req_t *req, uint8_t channel, bool subscribe)
+{
+    ws_session_t *session = ws_sessions_find(httpd_req_to_sockfd(req));
+    if (session == NULL || !session->websocket)
+    {
+        return;
+    }
+
+    if (subscribe)
+    {
+        session->channels |= 1UL << channel;
+    }
+    else
+    {
+        session->channels &= ~(1UL << channel);
+    }
+}
+
+int ws_sessions_channel_subscribers(uint8_t channel)
+{
+    int count = 0;
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        if (subscribers[i]->channels & (1UL << channel) && !subscribers[i]->closing)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+int ws_sessions_publish(httpd_handle_t hd, uint8_t channel, httpd_ws_frame_t *frames, size_t count,
+                        int *lagging)
+{
+    int sent = 0;
+    *lagging = 0;
+
+    for (int i = 0; i < stats.websocket; i++)
+    {
+        ws_session_t *s = subscribers[i];
+        esp_err_t err = ESP_OK;
+
+        if (s->closing || !(s->channels & (1UL << channel)))
+        {
+            continue;
+        }
+        if (s->backlog_len > 0)
+        {
+            // a stream has no latest state to catch up with, the frame is lost for it
+            (*lagging)++;
+            continue;
+        }
+
+        for (size_t f = 0; f < count && err == ESP_OK; f++)
+        {
+            err = httpd_ws_send_frame_async(hd, s->fd, &frames[f]);
+        }
+        if (err == ESP_OK)
+        {
+            sent++;
+        }
+    }
+    return sent;
+}
+
+void ws_sessions_set_state_render(ws_sessions_render_t render, httpd_ws_type_t type, void *ctx)
+{
+    state_render = render;
+    state_type = type;
+    state_ctx = ctx;
+}
+
+void ws_sessions_state_changed(void)
+{
+    stats.state_changes++;
+    state_dirty = true;
+    if (push_timer == NULL)
+    {
+        return; // not started yet, the first push picks the change up
+    }
+
+    // push right away unless the last push was less than an interval ago,
+    // an armed timer means a push is already on its way
+    int64_t wait = last_push_us + CONFIG_WS_SESSIONS_PUSH_INTERVAL_MS * 1000LL - esp_timer_get_time();
+    esp_timer_start_once(push_timer, wait > 0 ? wait : 0);
+}
+
+void *ws_sessions_frame_alloc(size_t len)
+{
+    return slab_pool_alloc(&frame_pool, len + 1);
+}
+
+void ws_sessions_frame_free(void *buf)
+{
+    slab_pool_free(&frame_pool, buf);
+}
+
+void ws_sessions_get_stats(ws_sessions_stats_t *out)
+{
+    *out = stats;
+    out->frame_pool_hits = frame_pool.hits;
+    out->frame_pool_misses = frame_pool.misses;
+    out->heap_free = esp_get_free_heap_size();
+    // amortized: lwip pcb, socket, buffers and anything the handlers hold
+    out->heap_per_session = (stats.open > 0 && heap_baseline > out->heap_free)
+                                ? (heap_baseline - out->heap_free) / stats.open
+                                : 0;
+}
+
+esp_err_t ws_sessions_stats_handler(httpd_req_t *req)
+{
+    ws_sessions_stats_t st;
+    char buf[512];
+    int64_t now = esp_timer_get_time();
+
+    ws_sessions_get_stats(&st);
+    httpd_resp_set_type(req, "application/json");
+
+    snprintf(buf, sizeof(buf),
+             "{\"max_open\":%u,\"open\":%u,\"websocket\":%u,\"peak_websocket\":%u,"
+             "\"accepted\":%" PRIu32 ",\"evicted\":%" PRIu32 ",\"saturated\":%" PRIu32 ","
+             "\"broadcasts\":%" PRIu32 ",\"state_changes\":%" PRIu32 ",\"pushes\":%" PRIu32 ","
+             "\"skipped\":%" PRIu32 ",\"dropped\":%" PRIu32 ",\"pings\":%" PRIu32 ",\"reaped\":%" PRIu32 ","
+             "\"frame_pool\":{\"hits\":%" PRIu32 ",\"misses\":%" PRIu32 "},"
+             "\"heap_free\":%" PRIu32 ",\"heap_per_session\":%" PRIu32 ",\"sessions\":[",
+             st.max_open, st.open, st.websocket, st.peak_websocket, st.accepted, st.evicted,
+             st.saturated, st.broadcasts, st.state_changes, st.pushes, st.skipped, st.dropped, st.pings, st.reaped,
+             st.frame_pool_hits, st.frame_pool_misses, st.heap_free, st.heap_per_session);
+    esp_err_t err = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+
+    bool first = true;
+    for (int i = 0; i < CONFIG_WS_SESSIONS_MAX_OPEN && err == ESP_OK; i++)
+    {
+        const ws_session_t *s = &sessions[i];
+        if (s->fd < 0)
+        {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "%s{\"fd\":%d,\"type\":\"%s\",\"age_ms\":%d,\"idle_ms\":%d,\"backlog\":%u}",
+                 first ? "" : ",", s->fd, s->websocket ? "ws" : "http",
+                 (int)((now - s->opened_us) / 1000), (int)((now - s->active_us) / 1000), s->backlog_len);
+        err = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+        first = false;
+    }
+
+    if (err == ESP_OK)
+    {
+        err = httpd_resp_send_chunk(req, "]}", HTTPD_RESP_USE_STRLEN);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
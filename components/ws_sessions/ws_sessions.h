@@ -0,0 +1,135 @@
+/*
+ * ws_sessions.h
+ *
+ * Connection capacity mode for the http server. The session table has an
+ * explicit size (WS_SESSIONS_MAX_OPEN), every session is tracked with its
+ * type and last activity, and when the table runs full the least recently
+ * used idle HTTP session is evicted so that WebSocket clients keep their
+ * slots and new dashboards can still connect.
+ *
+ * The WebSocket sessions are also kept as a subscriber list, maintained on
+ * handshake and close, so a broadcast costs one send per subscriber instead
+ * of a scan over every open socket.
+ *
+ * State changes are coalesced: the application marks its state dirty and a
+ * single frame rendered from the latest state goes out at most once per
+ * push interval. WebSocket sends never block the httpd task, bytes a slow
+ * client does not take are kept in a per-session backlog of bounded size.
+ * A lagging client skips pushes and gets one frame with the latest state
+ * when it catches up, or is dropped when it overruns its budget or stays
+ * behind for too long.
+ *
+ * WebSocket sessions that stay silent are pinged every
+ * WS_SESSIONS_PING_INTERVAL_MS and closed after WS_SESSIONS_PING_MISSES
+ * unanswered pings, so tabs that vanished without a close frame give their
+ * socket back within seconds.
+ *
+ * Besides the state every subscriber gets, sessions can subscribe to
+ * numbered channels carrying streams. Stream frames are simply not sent to a
+ * lagging session, the publisher counts them as lost.
+ *
+ * Inbound frame payloads come from a slab pool sized in Kconfig, so the
+ * WebSocket path does not allocate in steady state.
+ *
+ * All callbacks run in the httpd task. Readers outside of it must go
+ * through httpd_queue_work.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+typedef struct
+{
+    uint16_t max_open;      // session table size
+    uint16_t open;          // sessions open right now
+    uint16_t websocket;     // of which upgraded to WebSocket
+    uint16_t peak_websocket;
+    uint32_t accepted;      // sessions opened since start
+    uint32_t evicted;       // idle HTTP sessions closed to make room
+    uint32_t saturated;     // times the table filled up with nothing to evict
+    uint32_t broadcasts;
+    uint32_t state_changes;  // ws_sessions_state_changed calls
+    uint32_t pushes;         // frames they were coalesced into
+    uint32_t skipped;        // broadcasts not sent to a lagging session
+    uint32_t dropped;        // slow sessions closed
+    uint32_t pings;          // keepalive pings sent
+    uint32_t reaped;         // silent sessions closed by the keepalive
+    uint32_t frame_pool_hits;
+    uint32_t frame_pool_misses; // frame buffers that came from the heap
+    uint32_t heap_free;
+    uint32_t heap_per_session; // heap in use per open session, see ws_sessions.c
+} ws_sessions_stats_t;
+
+/**
+ * Writes the current state into buf, returns its length.
+ */
+typedef size_t (*ws_sessions_render_t)(uint8_t *buf, size_t len, void *ctx);
+
+/**
+ * Sets socket limits and session callbacks, call before httpd_start().
+ */
+void ws_sessions_configure(httpd_config_t *config);
+
+/**
+ * Records the heap baseline of the started server, call after httpd_start().
+ */
+void ws_sessions_start(httpd_handle_t server);
+
+/**
+ * Marks the session of req as a WebSocket, call on the handshake.
+ */
+void ws_sessions_set_websocket(httpd_req_t *req);
+
+/**
+ * Sends frames, in order, to every WebSocket subscriber that is not lagging.
+ * Must run in the httpd task, from a handler or a httpd_queue_work job.
+ *
+ * @return number of subscribers that got all the frames.
+ */
+int ws_sessions_broadcast(httpd_handle_t hd, httpd_ws_frame_t *frames, size_t count);
+
+/**
+ * Subscribes the WebSocket session of req to channel (0..31), or
+ * unsubscribes it. Closing the session unsubscribes it from everything.
+ */
+void ws_sessions_subscribe(httpd_req_t *req, uint8_t channel, bool subscribe);
+
+int ws_sessions_channel_subscribers(uint8_t channel);
+
+/**
+ * Sends frames to the sessions subscribed to channel, skipping the lagging
+ * ones. Must run in the httpd task.
+ *
+ * @param[out] lagging number of subscribers that were skipped
+ * @return number of subscribers that got all the frames.
+ */
+int ws_sessions_publish(httpd_handle_t hd, uint8_t channel, httpd_ws_frame_t *frames, size_t count,
+                        int *lagging);
+
+/**
+ * Sets how the state frame is rendered for pushes.
+ */
+void ws_sessions_set_state_render(ws_sessions_render_t render, httpd_ws_type_t type, void *ctx);
+
+/**
+ * Schedules a push of the state to every subscriber. Changes made within
+ * one push interval go out as a single frame. Can be called from any task.
+ */
+void ws_sessions_state_changed(void);
+
+/**
+ * Buffer for the payload of a received frame, len bytes plus a NUL.
+ */
+void *ws_sessions_frame_alloc(size_t len);
+void ws_sessions_frame_free(void *buf);
+
+void ws_sessions_get_stats(ws_sessions_stats_t *stats);
+
+/**
+ * Uri handler reporting the stats and the session table as JSON.
+ */
+esp_err_t ws_sessions_stats_handler(httpd_req_t *req);
@@ -0,0 +1,214 @@
+/*
+ * ws_telemetry.c
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "ws_proto.h"
+#include "ws_sessions.h"
+#include "ws_telemetry.h"
+
+#if (CONFIG_WS_TELEMETRY_RING_SIZE & (CONFIG_WS_TELEMETRY_RING_SIZE - 1)) != 0
+#error "WS_TELEMETRY_RING_SIZE must be a power of two"
+#endif
+
+// websocket header, protocol header, telemetry header and the samples
+#if 4 + 4 + 8 + 2 * CONFIG_WS_TELEMETRY_BATCH > CONFIG_WS_SESSIONS_SEND_BUDGET
+#error "a WS_TELEMETRY_BATCH frame does not fit WS_SESSIONS_SEND_BUDGET"
+#endif
+
+#define RING_MASK (CONFIG_WS_TELEMETRY_RING_SIZE - 1)
+
+static const char *TAG = "ws_telemetry";
+
+// single producer (sampler timer) and single consumer (httpd task): head is
+// only written by the producer, tail only by the consumer
+static int16_t ring[CONFIG_WS_TELEMETRY_RING_SIZE];
+static uint32_t head;
+static uint32_t tail;
+static uint32_t overflows_pending; // since the last frame, reset by the consumer
+
+static httpd_handle_t server_handle;
+static ws_telemetry_sample_t sample_fn;
+static void *sample_ctx;
+static esp_timer_handle_t sample_timer;
+static esp_timer_handle_t flush_timer;
+static bool sampling;
+static volatile bool started; // set by ws_telemetry_start, from another task than subscribe
+static volatile bool drain_queued;
+static ws_telemetry_stats_t stats;
+
+static uint8_t frame_buf[sizeof(ws_proto_header_t) + sizeof(ws_proto_telemetry_t) +
+                         CONFIG_WS_TELEMETRY_BATCH * sizeof(int16_t)];
+
+static void ws_telemetry_sample(void *arg)
+{
+    uint32_t h = head;
+    uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+    stats.samples++;
+    if (h - t == CONFIG_WS_TELEMETRY_RING_SIZE)
+    {
+        stats.overflows++;
+        __atomic_fetch_add(&overflows_pending, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring[h & RING_MASK] = sample_fn(sample_ctx);
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void ws_telemetry_set_sampling(bool enable)
+{
+    if (enable == sampling)
+    {
+        return;
+    }
+    sampling = enable;
+
+    if (enable)
+    {
+        // whatever is left from an earlier stream is stale
+        __atomic_store_n(&tail, __atomic_load_n(&head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&overflows_pending, 0, __ATOMIC_RELAXED);
+        esp_timer_start_periodic(sample_timer, 1000000ULL / CONFIG_WS_TELEMETRY_RATE_HZ);
+        esp_timer_start_periodic(flush_timer, CONFIG_WS_TELEMETRY_FLUSH_MS * 1000ULL);
+        ESP_LOGI(TAG, "streaming at %d Hz", CONFIG_WS_TELEMETRY_RATE_HZ);
+    }
+    else
+    {
+        esp_timer_stop(sample_timer);
+        esp_timer_stop(flush_timer);
+        ESP_LOGI(TAG, "no subscribers left, sampler stopped");
+    }
+}
+
+// runs in the httpd task
+static void ws_telemetry_drain(void *arg)
+{
+    drain_queued = false;
+
+    stats.subscribers = ws_sessions_channel_subscribers(WS_TELEMETRY_CHANNEL);
+    if (stats.subscribers == 0)
+    {
+        ws_telemetry_set_sampling(false);
+        return;
+    }
+
+    // samples arriving while draining go out with the next flush, which
+    // bounds the time spent here to one ring worth of frames
+    uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint32_t t = tail;
+    if (h - t > stats.max_fill)
+    {
+        stats.max_fill = h - t;
+    }
+
+    while (t != h)
+    {
+        uint16_t count = h - t < CONFIG_WS_TELEMETRY_BATCH ? h - t : CONFIG_WS_TELEMETRY_BATCH;
+        ws_proto_telemetry_t report = {
+            .first = t,
+            .count = count,
+            .dropped = __atomic_exchange_n(&overflows_pending, 0, __ATOMIC_RELAXED)};
+
+        size_t len = ws_proto_encode(frame_buf, sizeof(frame_buf), WS_OP_TELEMETRY, stats.frames, &report,
+                                     sizeof(report));
+        int16_t *samples = (int16_t *)(frame_buf + len);
+        for (uint16_t i = 0; i < count; i++)
+        {
+            samples[i] = ring[(t + i) & RING_MASK];
+        }
+        t += count;
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+
+        httpd_ws_frame_t frame = {
+            .final = true,
+            .type = HTTPD_WS_TYPE_BINARY,
+            .payload = frame_buf,
+            .len = len + count * sizeof(int16_t)};
+        int lagging;
+        ws_sessions_publish(server_handle, WS_TELEMETRY_CHANNEL, &frame, 1, &lagging);
+        stats.frames++;
+        stats.lagging += lagging;
+    }
+}
+
+static void ws_telemetry_flush(void *arg)
+{
+    if (drain_queued)
+    {
+        return; // the previous drain did not run yet
+    }
+    drain_queued = true;
+    if (httpd_queue_work(server_handle, ws_telemetry_drain, NULL) != ESP_OK)
+    {
+        drain_queued = false;
+    }
+}
+
+esp_err_t ws_telemetry_start(httpd_handle_t server, ws_telemetry_sample_t sample, void *ctx)
+{
+    const esp_timer_create_args_t sample_timer_args = {
+        .callback = ws_telemetry_sample,
+        .name = "telemetry"};
+    const esp_timer_create_args_t flush_timer_args = {
+        .callback = ws_telemetry_flush,
+        .name = "telemetry_flush"};
+
+    server_handle = server;
+    sample_fn = sample;
+    sample_ctx = ctx;
+
+    esp_err_t err = esp_timer_create(&sample_timer_args, &sample_timer);
+    if (err == ESP_OK)
+    {
+        err = esp_timer_create(&flush_timer_args, &flush_timer);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "timer create failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    started = true;
+    return ESP_OK;
+}
+
+void ws_telemetry_subscribe(httpd_req_t *req, bool enable)
+{
+    if (!started)
+    {
+        ESP_LOGW(TAG, "no stream, subscribe ignored");
+        return;
+    }
+    ws_sessions_subscribe(req, WS_TELEMETRY_CHANNEL, enable);
+    stats.subscribers = ws_sessions_channel_subscribers(WS_TELEMETRY_CHANNEL);
+    if (stats.subscribers > 0)
+    {
+        ws_telemetry_set_sampling(true);
+    }
+    // the last unsubscribe, or close, stops the sampler on the next drain
+}
+
+void ws_telemetry_get_stats(ws_telemetry_stats_t *out)
+{
+    *out = stats;
+}
+
+esp_err_t ws_telemetry_stats_handler(httpd_req_t *req)
+{
+    char buf[256];
+
+    httpd_resp_set_type(req, "application/json");
+    snprintf(buf, sizeof(buf),
+             "{\"rate_hz\":%d,\"ring_size\":%d,\"batch\":%d,\"streaming\":%s,\"subscribers\":%u,"
+             "\"samples\":%" PRIu32 ",\"overflows\":%" PRIu32 ",\"frames\":%" PRIu32 ",\"lagging\":%" PRIu32 ","
+             "\"max_fill\":%u}",
+             CONFIG_WS_TELEMETRY_RATE_HZ, CONFIG_WS_TELEMETRY_RING_SIZE, CONFIG_WS_TELEMETRY_BATCH,
+             sampling ? "true" : "false", stats.subscribers, stats.samples, stats.overflows, stats.frames,
+             stats.lagging, stats.max_fill);
+    return httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+}
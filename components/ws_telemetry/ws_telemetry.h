@@ -0,0 +1,55 @@
+/*
+ * ws_telemetry.h
+ *
+ * Streaming channel on top of /ws. A periodic esp_timer samples the
+ * application's source at WS_TELEMETRY_RATE_HZ into a single producer,
+ * single consumer ring buffer. A job queued on the httpd task every
+ * WS_TELEMETRY_FLUSH_MS drains the ring in batched WS_OP_TELEMETRY frames to
+ * the sessions subscribed to the channel. The sampler only runs while
+ * somebody is subscribed.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+// ws_sessions channel the stream is published on
+#define WS_TELEMETRY_CHANNEL 1
+
+/**
+ * Reads one sample, runs in the esp_timer task so it must be short.
+ */
+typedef int16_t (*ws_telemetry_sample_t)(void *ctx);
+
+typedef struct
+{
+    uint32_t samples;     // taken since start
+    uint32_t overflows;   // lost to a full ring
+    uint32_t frames;      // published
+    uint32_t lagging;     // frames not sent to a lagging subscriber
+    uint16_t subscribers;
+    uint16_t max_fill;    // highest ring fill seen by the drain
+} ws_telemetry_stats_t;
+
+/**
+ * Starts the stream on a running server, which can come up before the
+ * source does.
+ */
+esp_err_t ws_telemetry_start(httpd_handle_t server, ws_telemetry_sample_t sample, void *ctx);
+
+/**
+ * Adds or removes the WebSocket session of req to the stream, call from the
+ * WS_OP_TELEMETRY_SUBSCRIBE command handler. Ignored until the stream is
+ * started.
+ */
+void ws_telemetry_subscribe(httpd_req_t *req, bool enable);
+
+void ws_telemetry_get_stats(ws_telemetry_stats_t *stats);
+
+/**
+ * Uri handler reporting the stats as JSON.
+ */
+esp_err_t ws_telemetry_stats_handler(httpd_req_t *req);
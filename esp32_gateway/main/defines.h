@@ -8,8 +8,9 @@
 //
 #define TAG "MAIN"
 #define FIRMWARE_VERSION 1
+// links brought up by the network manager, the first one with an ip is used
 #define START_WIFI
-//#define START_ETH
+#define START_ETH
 
 
 // WIFI
@@ -17,14 +18,15 @@
 #define EXAMPLE_ESP_WIFI_PASS "straccidinebbialenti"
 // #define EXAMPLE_ESP_WIFI_SSID "Pixel_8801"
 // #define EXAMPLE_ESP_WIFI_PASS "franzogna"
-#define MAX_RETRY 10
+
+// MQTT
+#define MQTT_BROKER_URI "mqtt://broker.hivemq.com:1883"
+#define TELEMETRY_TOPIC "/emanuele_topic/gateway/telemetry"
+#define TELEMETRY_PERIOD_MS 10000
 
 // PINS
 #define OLIMEX_BUT_PIN 34
 
-// SPIFFS
-#define INDEX_HTML_PATH "/spiffs/index.html"
-
 // OTA
 #define OTA_URI_JSON "https://raw.githubusercontent.com/EmanueleFeola/espidf_examples/main/ota_folder/ota_fw_version.json"
 //#define OTA_URI_BIN "https://github.com/EmanueleFeola/rpc_ModuleB/raw/master/project-name.bin"
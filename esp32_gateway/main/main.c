@@ -21,81 +21,160 @@
 #include "driver/gpio.h"
 #include "rom/gpio.h"
 #include "esp_sleep.h"
-#include "esp_https_ota.h"
-#include "esp_spiffs.h"
-#include "cJSON.h"
+#include "esp_http_client.h"
+#include "boot_prof.h"
+#include "delta_ota.h"
+#include "json_stream.h"
+#include "mqtt_pipeline.h"
+#include "net_manager.h"
+#include "ota_resume.h"
+#include "startup.h"
+#include "telemetry_codec.h"
+#include "web_assets.h"
 #include "defines.h"
 
-static int retry_cnt = 0;
-
 bool conn_flag_on = false;
-bool connection_ok = false;
-bool wifi_status = false;
 bool mqtt_connected = false;
 TaskHandle_t publisher_task_handle = NULL;
 esp_mqtt_client_handle_t client = NULL;
 
-char index_html[4096];
-char rcv_buffer[1000];
-
-/// WIFI
-static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
+/// NETWORK
+static void net_event_handler(void *arg, esp_event_base_t event_base,
 		int32_t event_id, void *event_data) {
+	net_manager_event_t *event = (net_manager_event_t*) event_data;
+
 	switch (event_id) {
-	case WIFI_EVENT_STA_START:
-		esp_wifi_connect();
-		ESP_LOGI(TAG, "Trying to connect with Wi-Fi");
+	case NET_MANAGER_EVENT_READY:
+	case NET_MANAGER_EVENT_SWITCHED:
+		ESP_LOGI(TAG, "online over %s, ip " IPSTR,
+				net_manager_link_name(event->link), IP2STR(&event->ip_info.ip));
 		break;
 
-	case WIFI_EVENT_STA_CONNECTED:
-		ESP_LOGI(TAG, "Wi-Fi connected");
-		wifi_status = true;
+	case NET_MANAGER_EVENT_LOST:
+		ESP_LOGI(TAG, "offline, waiting for a link");
 		break;
 
-	case IP_EVENT_STA_GOT_IP:
-		ESP_LOGI(TAG, "Wi-Fi got ip");
-		connection_ok = true;
-
+	default:
 		break;
+	}
+}
 
-	case WIFI_EVENT_STA_DISCONNECTED:
-		ESP_LOGI(TAG, "disconnected: Retrying Wi-Fi\n");
-		if (retry_cnt++ < MAX_RETRY) {
-			esp_wifi_connect();
-		} else
-			ESP_LOGI(TAG, "Max Retry Failed: Wi-Fi Connection\n");
-		break;
+static esp_err_t network_init(void *ctx) {
+	printf("[network_init]\n");
+
+	net_manager_config_t config = NET_MANAGER_DEFAULT_CONFIG();
+#ifdef START_ETH
+	config.eth = true;
+#endif
+#ifdef START_WIFI
+	config.wifi = true;
+	config.wifi_ssid = EXAMPLE_ESP_WIFI_SSID;
+	config.wifi_password = EXAMPLE_ESP_WIFI_PASS;
+#endif
 
+	esp_event_loop_create_default();
+	esp_event_handler_register(NET_MANAGER_EVENT, ESP_EVENT_ANY_ID,
+			&net_event_handler, NULL);
+	esp_err_t err = net_manager_start(&config);
+	if (err == ESP_OK)
+		net_manager_wait_ready(portMAX_DELAY);
+	return err;
+}
+/// NETWORK END
+
+/// MQTT
+// schema 2 of bench/telemetry_schemas.json, fields in this order
+static const telemetry_field_t status_fields[] = {
+	{ .name = "uptime_ms", .type = TELEMETRY_UINT },
+	{ .name = "link", .type = TELEMETRY_STRING },
+	{ .name = "free_heap", .type = TELEMETRY_UINT },
+	{ .name = "min_free_heap", .type = TELEMETRY_UINT },
+	{ .name = "firmware", .type = TELEMETRY_UINT },
+};
+
+static const telemetry_schema_t status_schema = {
+	.id = 2,
+	.name = "esp32_gateway.status",
+	.fields = status_fields,
+	.field_count = sizeof(status_fields) / sizeof(status_fields[0]),
+};
+
+static mqtt_pipeline_topic_t telemetry_topic = MQTT_PIPELINE_TOPIC_INVALID;
+
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
+		int32_t event_id, void *event_data) {
+	switch ((esp_mqtt_event_id_t) event_id) {
+	case MQTT_EVENT_CONNECTED:
+		ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+		mqtt_connected = true;
+		break;
+	case MQTT_EVENT_DISCONNECTED:
+		ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+		mqtt_connected = false;
+		break;
 	default:
 		break;
 	}
-	return ESP_OK;
 }
 
-void wifi_init(void) {
-	printf("[wifi_init]\n");
+static void telemetry_task(void *params) {
+	telemetry_value_t values[sizeof(status_fields) / sizeof(status_fields[0])];
+
+	while (true) {
+		values[0].u = esp_timer_get_time() / 1000;
+		values[1].s = net_manager_link_name(net_manager_active_link());
+		values[2].u = esp_get_free_heap_size();
+		values[3].u = esp_get_minimum_free_heap_size();
+		values[4].u = FIRMWARE_VERSION;
+
+		// encoded in place in a queue slot, the pipeline enqueues it for the client
+		uint8_t *slot = mqtt_pipeline_claim(telemetry_topic);
+		if (slot != NULL) {
+			size_t len = telemetry_encode(&status_schema, values, slot,
+					CONFIG_MQTT_PIPELINE_SLOT_SIZE);
+			if (len > 0)
+				mqtt_pipeline_commit(slot, len);
+			else
+				mqtt_pipeline_cancel(slot);
+		}
 
-	esp_event_loop_create_default();
-	esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-			&wifi_event_handler, NULL);
-	esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
-			&wifi_event_handler, NULL);
-
-	wifi_config_t wifi_config = { .sta = { .ssid = EXAMPLE_ESP_WIFI_SSID,
-			.password = EXAMPLE_ESP_WIFI_PASS, .threshold.authmode =
-					WIFI_AUTH_WPA2_PSK, }, };
-	esp_netif_init();
-	esp_netif_create_default_wifi_sta();
-	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-	esp_wifi_init(&cfg);
-	esp_wifi_set_mode(WIFI_MODE_STA);
-	esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
-	esp_wifi_start();
+		vTaskDelay(TELEMETRY_PERIOD_MS / portTICK_PERIOD_MS);
+	}
 }
-/// WIFI END
+
+static esp_err_t mqtt_init(void *ctx) {
+	char description[256];
+	telemetry_describe(&status_schema, description, sizeof(description));
+	ESP_LOGI(TAG, "telemetry schema %s", description);
+
+	esp_err_t err = mqtt_pipeline_init();
+	if (err != ESP_OK)
+		return err;
+	telemetry_topic = mqtt_pipeline_register_topic(TELEMETRY_TOPIC, 1);
+
+	const esp_mqtt_client_config_t config = { .broker = { .address.uri =
+			MQTT_BROKER_URI, }, };
+	client = esp_mqtt_client_init(&config);
+	if (client == NULL)
+		return ESP_ERR_NO_MEM;
+	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler,
+			NULL);
+	mqtt_pipeline_attach(client);
+	err = esp_mqtt_client_start(client);
+	if (err != ESP_OK)
+		return err;
+
+	if (xTaskCreate(telemetry_task, "telemetry_task", 4096, NULL, 5,
+			&publisher_task_handle) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+/// MQTT END
 
 /// HTTP
+// the body is parsed as it arrives, chunked or not, whatever its size
 esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
+	json_stream_t *js = evt->user_data;
 
 	switch (evt->event_id) {
 	case HTTP_EVENT_ERROR:
@@ -107,9 +186,9 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
 	case HTTP_EVENT_ON_HEADER:
 		break;
 	case HTTP_EVENT_ON_DATA:
-		if (!esp_http_client_is_chunked_response(evt->client)) {
-			strncpy(rcv_buffer, (char*) evt->data, evt->data_len);
-		}
+		// not the body of a redirect or an error page
+		if (js != NULL && esp_http_client_get_status_code(evt->client) == 200)
+			json_stream_feed(js, evt->data, evt->data_len);
 		break;
 	case HTTP_EVENT_ON_FINISH:
 		break;
@@ -120,17 +199,37 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
 	}
 	return ESP_OK;
 }
+
+#define PATCH_MAX_REDIRECTS 5
+
+// opens the patch download, following redirects
+static esp_err_t patch_http_open(esp_http_client_handle_t client, int *status) {
+	for (int redirects = 0;; redirects++) {
+		esp_err_t err = esp_http_client_open(client, 0);
+		if (err != ESP_OK)
+			return err;
+		if (esp_http_client_fetch_headers(client) < 0)
+			return ESP_FAIL;
+		*status = esp_http_client_get_status_code(client);
+		if ((*status != 301 && *status != 302 && *status != 303
+				&& *status != 307 && *status != 308)
+				|| redirects == PATCH_MAX_REDIRECTS)
+			return ESP_OK;
+		esp_http_client_set_redirection(client);
+		esp_http_client_close(client);
+	}
+}
 /// HTTP END
 
 /// OTA START
-void start_ota_update(char *ota_uri_bin) {
+void start_ota_update(const char *ota_uri_bin) {
 	ESP_LOGI(TAG, "start_ota_update %s\n", ota_uri_bin);
 
-	esp_http_client_config_t config = { .url = ota_uri_bin, .cert_pem =
-			(char*) OTA_SERVER_ROOT_CA, .skip_cert_common_name_check = false };
-	esp_https_ota_config_t ota_config = { .http_config = &config, };
+	// resumes an interrupted download, see components/ota_resume
+	ota_resume_config_t config = { .url = ota_uri_bin, .cert_pem =
+			OTA_SERVER_ROOT_CA, };
 
-	esp_err_t ret = esp_https_ota(&ota_config);
+	esp_err_t ret = ota_resume_update(&config);
 	if (ret == ESP_OK) {
 		printf("OTA OK, restarting...\n");
 		esp_restart();
@@ -139,105 +238,193 @@ void start_ota_update(char *ota_uri_bin) {
 	}
 }
 
-char* ota_get_json() {
+// rebuilds the new image from the running one and a patch, see components/delta_ota
+static esp_err_t start_delta_update(const char *patch_uri) {
+	ESP_LOGI(TAG, "start_delta_update %s", patch_uri);
+
+	delta_ota_handle_t delta;
+	esp_err_t err = delta_ota_begin(&delta);
+	if (err != ESP_OK)
+		return err;
+
+	esp_http_client_config_t config = { .url = patch_uri, .cert_pem =
+			(char*) OTA_SERVER_ROOT_CA, };
+	esp_http_client_handle_t client = esp_http_client_init(&config);
+	if (client == NULL) {
+		// most likely out of heap next to the patcher, the full image is the fallback
+		ESP_LOGE(TAG, "unable to init the patch download");
+		delta_ota_abort(delta);
+		return ESP_ERR_NO_MEM;
+	}
+	int status = 0;
+	err = patch_http_open(client, &status);
+	if (err != ESP_OK || status != 200) {
+		ESP_LOGE(TAG, "unable to download patch: %s, status %d",
+				esp_err_to_name(err), status);
+		esp_http_client_cleanup(client);
+		delta_ota_abort(delta);
+		return err != ESP_OK ? err : ESP_FAIL;
+	}
+
+	// the patch is applied while it downloads, the rest of it is not
+	// downloaded once it fails to apply
+	char buf[1024];
+	esp_err_t apply_err = ESP_OK;
+	int n;
+	while ((n = esp_http_client_read(client, buf, sizeof(buf))) > 0) {
+		apply_err = delta_ota_write(delta, buf, n);
+		if (apply_err != ESP_OK)
+			break;
+	}
+	bool complete = n == 0 && esp_http_client_is_complete_data_received(client);
+	esp_http_client_close(client);
+	esp_http_client_cleanup(client);
+
+	if (apply_err != ESP_OK) {
+		ESP_LOGE(TAG, "cannot apply patch: %s", esp_err_to_name(apply_err));
+		delta_ota_abort(delta);
+		return apply_err;
+	}
+	if (!complete) {
+		ESP_LOGE(TAG, "patch download interrupted");
+		delta_ota_abort(delta);
+		return ESP_FAIL;
+	}
+	err = delta_ota_end(delta);
+	if (err != ESP_OK)
+		ESP_LOGE(TAG, "cannot apply patch: %s", esp_err_to_name(err));
+	return err;
+}
+
+// the fields of ota_fw_version.json in use
+typedef struct {
+	int version;
+	char uri[256];
+	char patch_uri[256]; // from FIRMWARE_VERSION
+	bool has_patch; // patch_uri was read whole, a truncated one is not used
+} ota_manifest_t;
+
+// "patches.<base version>.uri"
+#define MANIFEST_STR(x) #x
+#define MANIFEST_PATCH_URI(base) "patches." MANIFEST_STR(base) ".uri"
+
+static const json_stream_field_t manifest_fields[] = {
+	JSON_STREAM_FIELD("version", JSON_STREAM_INT, ota_manifest_t, version),
+	JSON_STREAM_FIELD("uri", JSON_STREAM_STRING, ota_manifest_t, uri),
+	JSON_STREAM_FIELD(MANIFEST_PATCH_URI(FIRMWARE_VERSION), JSON_STREAM_STRING,
+			ota_manifest_t, patch_uri),
+};
+
+static ota_manifest_t manifest;
+
+const char* ota_get_json() {
 	ESP_LOGI(TAG, "ota_get_json");
 
+	json_stream_t js;
+	json_stream_init(&js, manifest_fields,
+			sizeof(manifest_fields) / sizeof(manifest_fields[0]), &manifest);
+
 	// configure the esp_http_client
 	esp_http_client_config_t config = { .url = OTA_URI_JSON, .event_handler =
-			_http_event_handler, .cert_pem = (char*) OTA_SERVER_ROOT_CA, };
+			_http_event_handler, .user_data = &js, .cert_pem =
+			(char*) OTA_SERVER_ROOT_CA, };
 	esp_http_client_handle_t client = esp_http_client_init(&config);
 
 	// download json file (fw version and bin uri)
 	esp_err_t err = esp_http_client_perform(client);
+	int status = esp_http_client_get_status_code(client);
+	esp_http_client_cleanup(client);
 
-	if (err == ESP_OK) {
-		cJSON *json = cJSON_Parse(rcv_buffer);
-		if (json == NULL) {
-			ESP_LOGE(TAG, "cannot parse downloaded json file. abort");
-		} else {
-			cJSON *version = cJSON_GetObjectItemCaseSensitive(json, "version");
-			cJSON *file = cJSON_GetObjectItemCaseSensitive(json, "uri");
-
-			// check the version
-			if (!cJSON_IsNumber(version)) {
-				ESP_LOGE(TAG, "cannot read version field. abort");
-			} else {
-				int new_version = (int) version->valuedouble;
-				ESP_LOGI(TAG, "current fw ver %d, available fw ver %d",
-						FIRMWARE_VERSION, new_version);
-
-				if (new_version > FIRMWARE_VERSION) {
-					if (cJSON_IsString(file) && (file->valuestring != NULL)) {
-						ESP_LOGI(TAG, "upgrading. firmware uri: %s",
-								file->valuestring);
-
-						esp_http_client_cleanup(client);
-						return (char*) file->valuestring;
-					} else {
-						ESP_LOGE(TAG, "cannot read uri field. abort");
-					}
-				} else {
-					ESP_LOGI(TAG, "not upgrading. upgrade is not needed.");
-				}
-			}
-		}
-	} else {
-		ESP_LOGE(TAG, "unable to download json filen");
+	if (err != ESP_OK || status != 200) {
+		ESP_LOGE(TAG, "unable to download json file: %s, status %d",
+				esp_err_to_name(err), status);
+		return NULL;
+	}
+	if (json_stream_finish(&js) != ESP_OK) {
+		ESP_LOGE(TAG, "cannot parse downloaded json file. abort");
+		return NULL;
 	}
 
-	esp_http_client_cleanup(client);
-	return NULL;
+	// check the version
+	if (!json_stream_has(&js, 0)) {
+		ESP_LOGE(TAG, "cannot read version field. abort");
+		return NULL;
+	}
+	ESP_LOGI(TAG, "current fw ver %d, available fw ver %d", FIRMWARE_VERSION,
+			manifest.version);
+	if (manifest.version <= FIRMWARE_VERSION) {
+		ESP_LOGI(TAG, "not upgrading. upgrade is not needed.");
+		return NULL;
+	}
+	if (!json_stream_has(&js, 1)) {
+		ESP_LOGE(TAG, "cannot read uri field. abort");
+		return NULL;
+	}
+	manifest.has_patch = json_stream_has(&js, 2);
+	ESP_LOGI(TAG, "upgrading. firmware uri: %s", manifest.uri);
+	return manifest.uri;
 }
 
-static void task_ota(void *pvParameters) {
-	while (!connection_ok) {
-		// wait for connection
-		vTaskDelay(5000 / portTICK_PERIOD_MS);
-	}
+static esp_err_t task_ota(void *ctx) {
+	// runs once the network is ready, get json file and perform ota if necessary
+	const char *ota_uri_bin = ota_get_json();
+	if (ota_uri_bin == NULL)
+		return ESP_OK;
 
-	// once got connection, get json file and perform ota if necessary
-	char *ota_uri_bin = ota_get_json();
-	if (ota_uri_bin != NULL)
-		start_ota_update(ota_uri_bin);
+	// the patch is a fraction of the image, which stays the fallback
+	if (manifest.has_patch && start_delta_update(manifest.patch_uri) == ESP_OK) {
+		printf("OTA OK, restarting...\n");
+		esp_restart();
+	}
+	start_ota_update(ota_uri_bin);
 
-	vTaskDelete(NULL);
+	return ESP_OK;
 }
 /// OTA END
 
-static void initi_web_page_buffer(void) {
-	esp_vfs_spiffs_conf_t conf = { .base_path = "/spiffs", .partition_label =
-	NULL, .max_files = 5, .format_if_mount_failed = true };
-
-	ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
-
-	memset((void*) index_html, 0, sizeof(index_html));
-	struct stat st;
-	if (stat(INDEX_HTML_PATH, &st)) {
-		ESP_LOGE(TAG, "index.html not found");
-		return;
+static esp_err_t initi_web_page_buffer(void *ctx) {
+	esp_err_t err = web_assets_init("storage");
+	if (err != ESP_OK) {
+		return err;
 	}
 
-	FILE *fp = fopen(INDEX_HTML_PATH, "r");
-	if (fread(index_html, st.st_size, 1, fp) == 0) {
-		ESP_LOGE(TAG, "fread failed");
+	const web_asset_t *index = web_assets_find("/index.html");
+	if (index == NULL) {
+		ESP_LOGE(TAG, "index.html not found");
+		return ESP_ERR_NOT_FOUND;
 	}
-
-//	printf("html page:\n");
-//	printf("%s\n", index_html);
-	fclose(fp);
+	ESP_LOGI(TAG, "index.html: %d bytes gzipped in flash", (int) index->size);
+	return ESP_OK;
 }
 
-void app_main(void) {
-	esp_timer_early_init();
-	initi_web_page_buffer();
-
+static esp_err_t nvs_init(void *ctx) {
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
 		ESP_ERROR_CHECK(nvs_flash_erase());
 		ret = nvs_flash_init();
 	}
-	ESP_ERROR_CHECK(ret);
+	return ret;
+}
+
+// startup stages, each one runs as soon as the stages it requires are done
+#define STAGE_NVS BIT0
+#define STAGE_ASSETS BIT1
+#define STAGE_NETWORK BIT2
+#define STAGE_OTA BIT3
+#define STAGE_MQTT BIT4
+
+static const startup_stage_t stages[] = {
+	{ .name = "nvs", .provides = STAGE_NVS, .run = nvs_init },
+	{ .name = "assets", .provides = STAGE_ASSETS, .run = initi_web_page_buffer },
+	{ .name = "network", .requires = STAGE_NVS, .provides = STAGE_NETWORK, .run = network_init },
+	{ .name = "task_ota", .requires = STAGE_NETWORK, .provides = STAGE_OTA, .run = task_ota,
+			.stack_size = 8192 },
+	{ .name = "mqtt", .requires = STAGE_NETWORK, .provides = STAGE_MQTT, .run = mqtt_init },
+};
 
-	wifi_init();
-	xTaskCreate(&task_ota, "task_ota", 8192, NULL, 5, NULL);
+void app_main(void) {
+	int span = boot_prof_begin("esp_timer_early_init");
+	esp_timer_early_init();
+	boot_prof_end(span);
+	ESP_ERROR_CHECK(startup_run(stages, sizeof(stages) / sizeof(stages[0])));
 }
@@ -3,11 +3,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_netif.h"
-#include "esp_eth.h"
 #include "esp_event.h"
 #include "esp_log.h"
-#include "driver/gpio.h"
 #include "sdkconfig.h"
+#include "boot_prof.h"
+#include "net_manager.h"
 
 static const char *TAG = "eth_example";
 
@@ -16,80 +16,44 @@ static const char *TAG = "eth_example";
 #define PIN_ETH_RESET -1
 #define ETH_PHY_ADDR 0
 
-/** Event handler for Ethernet events */
-static void eth_event_handler(void *arg, esp_event_base_t event_base,
+/** Event handler for NET_MANAGER_EVENT */
+static void net_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data)
 {
-    uint8_t mac_addr[6] = {0};
-    /* we can get the ethernet driver handle from event data */
-    esp_eth_handle_t eth_handle = *(esp_eth_handle_t *)event_data;
+    net_manager_event_t *event = (net_manager_event_t *)event_data;
 
     switch (event_id)
     {
-    case ETHERNET_EVENT_CONNECTED:
-        esp_eth_ioctl(eth_handle, ETH_CMD_G_MAC_ADDR, mac_addr);
-        ESP_LOGI(TAG, "Ethernet Link Up");
-        ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
-                 mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+    case NET_MANAGER_EVENT_READY:
+        ESP_LOGI(TAG, "Ethernet Got IP Address");
+        ESP_LOGI(TAG, "~~~~~~~~~~~");
+        ESP_LOGI(TAG, "ETHIP:" IPSTR, IP2STR(&event->ip_info.ip));
+        ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&event->ip_info.netmask));
+        ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&event->ip_info.gw));
+        ESP_LOGI(TAG, "~~~~~~~~~~~");
+        // boot profile up to the first ip
+        boot_prof_dump();
         break;
-    case ETHERNET_EVENT_DISCONNECTED:
+    case NET_MANAGER_EVENT_LOST:
         ESP_LOGI(TAG, "Ethernet Link Down");
         break;
-    case ETHERNET_EVENT_START:
-        ESP_LOGI(TAG, "Ethernet Started");
-        break;
-    case ETHERNET_EVENT_STOP:
-        ESP_LOGI(TAG, "Ethernet Stopped");
-        break;
     default:
         break;
     }
 }
 
-/** Event handler for IP_EVENT_ETH_GOT_IP */
-static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
-                                 int32_t event_id, void *event_data)
-{
-    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-    const esp_netif_ip_info_t *ip_info = &event->ip_info;
-
-    ESP_LOGI(TAG, "Ethernet Got IP Address");
-    ESP_LOGI(TAG, "~~~~~~~~~~~");
-    ESP_LOGI(TAG, "ETHIP:" IPSTR, IP2STR(&ip_info->ip));
-    ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&ip_info->netmask));
-    ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&ip_info->gw));
-    ESP_LOGI(TAG, "~~~~~~~~~~~");
-}
-
 void app_main(void)
 {
-    /* ethernet */
-    eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG(); // apply default common MAC configuration
-    eth_esp32_emac_config_t esp32_emac_config = ETH_ESP32_EMAC_DEFAULT_CONFIG(); // apply default vendor-specific MAC configuration
-    esp32_emac_config.smi_mdc_gpio_num = PIN_ETH_MDC;                                    
-    esp32_emac_config.smi_mdio_gpio_num = PIN_ETH_MDIO;                                    
-    esp_eth_mac_t *mac = esp_eth_mac_new_esp32(&esp32_emac_config, &mac_config); // create MAC instance
-
-    eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG(); // apply default PHY configuration
-    phy_config.phy_addr = ETH_PHY_ADDR;
-    phy_config.reset_gpio_num = PIN_ETH_RESET;
-    esp_eth_phy_t *phy = esp_eth_phy_new_lan87xx(&phy_config); // create PHY instance
-
-    esp_eth_config_t config = ETH_DEFAULT_CONFIG(mac, phy); // apply default driver configuration
-    esp_eth_handle_t eth_handle = NULL;
-    ESP_ERROR_CHECK(esp_eth_driver_install(&config, &eth_handle)); // install driver
+    net_manager_config_t config = NET_MANAGER_DEFAULT_CONFIG();
+    config.eth = true;
+    config.eth_mdc_gpio = PIN_ETH_MDC;
+    config.eth_mdio_gpio = PIN_ETH_MDIO;
+    config.eth_phy_addr = ETH_PHY_ADDR;
+    config.eth_phy_reset_gpio = PIN_ETH_RESET;
 
-    /* TCP-IP stack */
-    ESP_ERROR_CHECK(esp_netif_init()); // Initialize TCP/IP network interface (should be called only once in application)
     ESP_ERROR_CHECK(esp_event_loop_create_default()); // Create default event loop that running in background
-    
-    esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH(); // Create new default instance of esp-netif for Ethernet
-    esp_netif_t *eth_netif = esp_netif_new(&cfg);
+    ESP_ERROR_CHECK(esp_event_handler_register(NET_MANAGER_EVENT, ESP_EVENT_ANY_ID, &net_event_handler, NULL));
 
-    ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handle))); // attach Ethernet driver to TCP/IP stack
-    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL)); // Register user defined event handers
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL)); // Register user defined event handers
-
-    /* start Ethernet driver state machine */
-    ESP_ERROR_CHECK(esp_eth_start(eth_handle)); 
-}
\ No newline at end of file
+    /* brings up the EMAC and the TCP-IP stack */
+    ESP_ERROR_CHECK(net_manager_start(&config));
+}
@@ -0,0 +1,126 @@
+var gateway = `ws://${window.location.hostname}/ws`;
+var websocket;
+window.addEventListener('load', onLoad);
+
+// binary protocol, see components/ws_proto/ws_proto.h
+var PROTO_VERSION = 1;
+var OP_TOGGLE = 0x01;
+var OP_SET = 0x02;
+var OP_GET_STATE = 0x03;
+var OP_TELEMETRY_SUBSCRIBE = 0x04;
+var OP_STATE = 0x81;
+var OP_TELEMETRY = 0x82;
+var OP_ERROR = 0xFF;
+var seq = 0;
+
+var streaming = false;
+var telemetry = { next: null, received: 0, lost: 0, windowStart: 0, windowCount: 0 };
+
+function encodeCommand(opcode, payload) {
+    payload = payload || [];
+    var frame = new Uint8Array(4 + payload.length);
+    var view = new DataView(frame.buffer);
+    view.setUint8(0, PROTO_VERSION);
+    view.setUint8(1, opcode);
+    view.setUint16(2, seq, true);
+    seq = (seq + 1) & 0xFFFF;
+    frame.set(payload, 4);
+    return frame;
+}
+
+function decodeReport(buffer) {
+    var view = new DataView(buffer);
+    if (view.byteLength < 4 || view.getUint8(0) != PROTO_VERSION) {
+        return null;
+    }
+    var report = { opcode: view.getUint8(1), seq: view.getUint16(2, true) };
+    if (report.opcode == OP_STATE && view.byteLength == 9) {
+        report.uptimeMs = view.getUint32(4, true);
+        report.led = view.getUint8(8);
+    }
+    else if (report.opcode == OP_TELEMETRY && view.byteLength >= 12) {
+        report.first = view.getUint32(4, true);
+        report.count = view.getUint16(8, true);
+        report.dropped = view.getUint16(10, true);
+        report.samples = new Int16Array(buffer.slice(12, 12 + 2 * report.count));
+    }
+    else if (report.opcode == OP_ERROR && view.byteLength == 6) {
+        report.code = view.getUint8(4);
+        report.command = view.getUint8(5);
+    }
+    return report;
+}
+
+function initWebSocket() {
+    console.log('Trying to open a WebSocket connection...');
+    websocket = new WebSocket(gateway);
+    websocket.binaryType = 'arraybuffer';
+    websocket.onopen = onOpen;
+    websocket.onclose = onClose;
+    websocket.onmessage = onMessage;
+}
+function onOpen(event) {
+    console.log('Connection opened');
+    // the page may be older than the connection after a reconnect
+    websocket.send(encodeCommand(OP_GET_STATE));
+    if (streaming) {
+        websocket.send(encodeCommand(OP_TELEMETRY_SUBSCRIBE, [1]));
+    }
+}
+function onClose(event) {
+    console.log('Connection closed');
+    setTimeout(initWebSocket, 2000);
+}
+function onMessage(event) {
+    var report = decodeReport(event.data);
+    if (report == null) {
+        console.log('unexpected frame', event.data);
+        return;
+    }
+    if (report.opcode == OP_STATE) {
+        document.getElementById('state').innerHTML = report.led ? "ON" : "OFF";
+    }
+    else if (report.opcode == OP_TELEMETRY) {
+        onTelemetry(report);
+    }
+    else if (report.opcode == OP_ERROR) {
+        console.log('command ' + report.command + ' seq ' + report.seq + ' rejected: ' + report.code);
+    }
+}
+function onTelemetry(report) {
+    // frames skipped while this client lagged show up as a gap in the stream position
+    if (telemetry.next != null && report.first != telemetry.next) {
+        telemetry.lost += (report.first - telemetry.next) >>> 0;
+    }
+    telemetry.next = (report.first + report.count) >>> 0;
+    telemetry.lost += report.dropped;
+    telemetry.windowCount += report.count;
+
+    var now = performance.now();
+    if (now - telemetry.windowStart >= 1000) {
+        document.getElementById('rate').innerHTML = Math.round(telemetry.windowCount * 1000 / (now - telemetry.windowStart));
+        telemetry.windowStart = now;
+        telemetry.windowCount = 0;
+    }
+    if (report.count > 0) {
+        document.getElementById('sample').innerHTML = report.samples[report.count - 1];
+    }
+    document.getElementById('lost').innerHTML = telemetry.lost;
+}
+function onLoad(event) {
+    initWebSocket();
+    initButton();
+}
+function initButton() {
+    document.getElementById('button').addEventListener('click', toggle);
+    document.getElementById('stream').addEventListener('click', toggleStream);
+}
+function toggle() {
+    websocket.send(encodeCommand(OP_TOGGLE));
+}
+function toggleStream() {
+    streaming = !streaming;
+    telemetry.next = null;
+    websocket.send(encodeCommand(OP_TELEMETRY_SUBSCRIBE, [streaming ? 1 : 0]));
+    document.getElementById('stream').innerHTML = streaming ? "Stop stream" : "Start stream";
+}
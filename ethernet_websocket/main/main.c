@@ -23,12 +23,20 @@ https://github.com/espressif/esp-idf/blob/master/examples/protocols/http_server/
 #include <esp_http_server.h>
 #include <stdlib.h>
 #include "esp_spi_flash.h"
-#include "esp_spiffs.h"
 #include "freertos/event_groups.h"
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/api.h>
 #include <lwip/netdb.h>
+#include "esp_adc/adc_oneshot.h"
+#include "boot_prof.h"
+#include "net_manager.h"
+#include "page_template.h"
+#include "startup.h"
+#include "web_assets.h"
+#include "ws_proto.h"
+#include "ws_sessions.h"
+#include "ws_telemetry.h"
 
 static const char *TAG = "ws_eth";
 
@@ -41,12 +49,16 @@ static const char *TAG = "ws_eth";
 #define STATIC_IP_ADDR_GATEWAY "192.168.178.1"
 #define STATIC_NETMASK "255.255.255.0"
 
-#define INDEX_HTML_PATH "/spiffs/index.html"
-char index_html[4096];
-char response_data[4096];
+static page_template_t index_page;
 
 bool led_state = false;
+// bumped on every led change, keys the rendered page cache
+static uint32_t state_version = 0;
 #define LED_PIN 32
+// GPIO36, streamed to the dashboards that subscribe to telemetry
+#define TELEMETRY_ADC_CHANNEL ADC_CHANNEL_0
+
+static adc_oneshot_unit_handle_t adc_handle;
 httpd_handle_t server = NULL;
 
 unsigned long millis()
@@ -54,102 +66,131 @@ unsigned long millis()
     return (unsigned long)(esp_timer_get_time() / 1000ULL);
 }
 
-static void initi_web_page_buffer(void)
+static esp_err_t initi_web_page_buffer(void *ctx)
 {
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = "/spiffs",
-        .partition_label = NULL,
-        .max_files = 5,
-        .format_if_mount_failed = true};
-
-    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
+    // without the pages the server still runs, with /ws and /stats
+    if (web_assets_init("storage") != ESP_OK)
+    {
+        return ESP_OK;
+    }
 
-    memset((void *)index_html, 0, sizeof(index_html));
-    struct stat st;
-    if (stat(INDEX_HTML_PATH, &st))
+    const web_asset_t *index = web_assets_find("/index.html");
+    if (index == NULL)
     {
         ESP_LOGE(TAG, "index.html not found");
-        return;
+        return ESP_OK;
     }
+    page_template_parse(&index_page, web_assets_data(index), index->size);
+    return ESP_OK;
+}
 
-    FILE *fp = fopen(INDEX_HTML_PATH, "r");
-    if (fread(index_html, st.st_size, 1, fp) == 0)
+static const char *index_page_slot(const char *slot, void *ctx)
+{
+    if (strcmp(slot, "state") == 0)
     {
-        ESP_LOGE(TAG, "fread failed");
+        return led_state ? "ON" : "OFF";
     }
-    fclose(fp);
+    return NULL;
 }
 
 esp_err_t get_req_handler(httpd_req_t *req)
 {
     printf("[get_req_handler] called");
-    int response;
-    if (led_state)
+    char etag[WEB_ASSETS_ETAG_LEN];
+    web_assets_versioned_etag(web_assets_find("/index.html"), state_version, etag, sizeof(etag));
+    if (web_assets_not_modified(req, etag))
     {
-        sprintf(response_data, index_html, "ON");
-    }
-    else
-    {
-        sprintf(response_data, index_html, "OFF");
+        return ESP_OK;
     }
-    response = httpd_resp_send(req, response_data, HTTPD_RESP_USE_STRLEN);
-    return response;
+    return page_template_send(&index_page, req, state_version, index_page_slot, NULL);
 }
 
-// Asynchronous response data structure
-struct async_resp_arg
+static size_t encode_state(uint8_t *buf, size_t len, uint16_t seq)
 {
-    httpd_handle_t hd; // Server instance
-    int fd;            // Session socket file descriptor
-};
+    ws_proto_state_t state = {
+        .uptime_ms = millis(),
+        .led = led_state};
+    return ws_proto_encode(buf, len, WS_OP_STATE, seq, &state, sizeof(state));
+}
 
-static void ws_async_send(void *arg)
+// state report pushed to every client, see ws_sessions_state_changed
+static size_t render_state(uint8_t *buf, size_t len, void *ctx)
 {
-    httpd_ws_frame_t ws_pkt;
-    struct async_resp_arg *resp_arg = arg;
-    httpd_handle_t hd = resp_arg->hd;
-    int fd = resp_arg->fd;
+    static uint16_t push_seq = 0;
+    return encode_state(buf, len, push_seq++);
+}
 
-    led_state = !led_state;
+static void set_led(bool state)
+{
+    if (state == led_state)
+    {
+        return;
+    }
+    led_state = state;
+    state_version++;
     gpio_set_level(LED_PIN, led_state);
+    ws_sessions_state_changed();
+}
 
-    char buff[4];
-    memset(buff, 0, sizeof(buff));
-    sprintf(buff, "%d %d", (int)millis(), led_state);
+static esp_err_t cmd_toggle(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    set_led(!led_state);
+    return ESP_OK;
+}
 
-    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.payload = (uint8_t *)buff;
-    ws_pkt.len = strlen(buff);
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+static esp_err_t cmd_set(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    const ws_proto_set_t *set = payload;
+    set_led(set->led != 0);
+    return ESP_OK;
+}
 
-    static size_t max_clients = CONFIG_LWIP_MAX_LISTENING_TCP;
-    size_t fds = max_clients;
-    int client_fds[max_clients];
+static esp_err_t cmd_get_state(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    uint8_t buf[sizeof(ws_proto_header_t) + sizeof(ws_proto_state_t)];
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = buf,
+        .len = encode_state(buf, sizeof(buf), header->seq)};
+    return httpd_ws_send_frame(req, &frame);
+}
 
-    esp_err_t ret = httpd_get_client_list(server, &fds, client_fds);
+static esp_err_t cmd_telemetry_subscribe(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    const ws_proto_subscribe_t *subscribe = payload;
+    ws_telemetry_subscribe(req, subscribe->enable != 0);
+    return ESP_OK;
+}
 
-    if (ret != ESP_OK)
-    {
-        return;
-    }
+static const ws_proto_command_t ws_commands[WS_OP_COMMAND_COUNT] = {
+    [WS_OP_TOGGLE] = {cmd_toggle, 0},
+    [WS_OP_SET] = {cmd_set, sizeof(ws_proto_set_t)},
+    [WS_OP_GET_STATE] = {cmd_get_state, 0},
+    [WS_OP_TELEMETRY_SUBSCRIBE] = {cmd_telemetry_subscribe, sizeof(ws_proto_subscribe_t)},
+};
 
-    for (int i = 0; i < fds; i++)
+static esp_err_t telemetry_init(void *ctx)
+{
+    adc_oneshot_unit_init_cfg_t unit_config = {
+        .unit_id = ADC_UNIT_1};
+    adc_oneshot_chan_cfg_t channel_config = {
+        .bitwidth = ADC_BITWIDTH_12,
+        .atten = ADC_ATTEN_DB_11};
+
+    esp_err_t err = adc_oneshot_new_unit(&unit_config, &adc_handle);
+    if (err != ESP_OK)
     {
-        int client_info = httpd_ws_get_fd_info(server, client_fds[i]);
-        if (client_info == HTTPD_WS_CLIENT_WEBSOCKET)
-        {
-            httpd_ws_send_frame_async(hd, client_fds[i], &ws_pkt);
-        }
+        return err;
     }
-    free(resp_arg);
+    return adc_oneshot_config_channel(adc_handle, TELEMETRY_ADC_CHANNEL, &channel_config);
 }
 
-static esp_err_t trigger_async_send(httpd_handle_t handle, httpd_req_t *req)
+static int16_t telemetry_sample(void *ctx)
 {
-    struct async_resp_arg *resp_arg = malloc(sizeof(struct async_resp_arg));
-    resp_arg->hd = req->handle;
-    resp_arg->fd = httpd_req_to_sockfd(req);
-    return httpd_queue_work(handle, ws_async_send, resp_arg);
+    int raw = 0;
+    adc_oneshot_read(adc_handle, TELEMETRY_ADC_CHANNEL, &raw);
+    return raw;
 }
 
 static esp_err_t handle_ws_req(httpd_req_t *req)
@@ -157,13 +198,13 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
     if (req->method == HTTP_GET)
     {
         ESP_LOGI(TAG, "Handshake done, the new connection was opened");
+        ws_sessions_set_websocket(req);
         return ESP_OK;
     }
 
     httpd_ws_frame_t ws_pkt;
     uint8_t *buf = NULL;
     memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
     esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
     if (ret != ESP_OK)
     {
@@ -173,10 +214,10 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
 
     if (ws_pkt.len)
     {
-        buf = calloc(1, ws_pkt.len + 1);
+        buf = ws_sessions_frame_alloc(ws_pkt.len);
         if (buf == NULL)
         {
-            ESP_LOGE(TAG, "Failed to calloc memory for buf");
+            ESP_LOGE(TAG, "Failed to alloc memory for buf");
             return ESP_ERR_NO_MEM;
         }
         ws_pkt.payload = buf;
@@ -184,26 +225,28 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
         if (ret != ESP_OK)
         {
             ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
-            free(buf);
+            ws_sessions_frame_free(buf);
             return ret;
         }
-        ESP_LOGI(TAG, "Got packet with message: %s", ws_pkt.payload);
     }
 
-    ESP_LOGI(TAG, "frame len is %d", ws_pkt.len);
-
-    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT &&
-        strcmp((char *)ws_pkt.payload, "toggle") == 0)
+    if (ws_pkt.type == HTTPD_WS_TYPE_BINARY)
     {
-        free(buf);
-        return trigger_async_send(req->handle, req);
+        ret = ws_proto_dispatch(req, ws_commands, WS_OP_COMMAND_COUNT, buf, ws_pkt.len);
     }
-    return ESP_OK;
+    else
+    {
+        ESP_LOGW(TAG, "ignoring websocket frame of type %d", ws_pkt.type);
+    }
+    ws_sessions_frame_free(buf);
+    return ret;
 }
 
-static void websocket_app_start(void)
+static esp_err_t websocket_app_start(void *ctx)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    ws_sessions_configure(&config);
 
     // Create URI (Uniform Resource Identifier)
     // for the server which is added to default gateway
@@ -220,119 +263,105 @@ static void websocket_app_start(void)
         .handler = get_req_handler,
         .user_ctx = NULL};
 
+    static const httpd_uri_t uri_stats = {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = ws_sessions_stats_handler,
+        .user_ctx = NULL};
+
+    static const httpd_uri_t uri_telemetry = {
+        .uri = "/telemetry",
+        .method = HTTP_GET,
+        .handler = ws_telemetry_stats_handler,
+        .user_ctx = NULL};
+
+    static const httpd_uri_t uri_boot = {
+        .uri = "/boot",
+        .method = HTTP_GET,
+        .handler = boot_prof_handler,
+        .user_ctx = NULL};
+
+    // css, js and anything else in data/, must stay the last handler
+    static const httpd_uri_t uri_assets = {
+        .uri = "/*",
+        .method = HTTP_GET,
+        .handler = web_assets_get_handler,
+        .user_ctx = NULL};
+
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK)
+    int span = boot_prof_begin("httpd start");
+    esp_err_t err = httpd_start(&server, &config);
+    boot_prof_end(span);
+    if (err == ESP_OK)
     {
         ESP_LOGI(TAG, "Registering URI handler");
+        ws_sessions_start(server);
+        ws_sessions_set_state_render(render_state, HTTPD_WS_TYPE_BINARY, NULL);
         httpd_register_uri_handler(server, &uri_handler);
         httpd_register_uri_handler(server, &uri_get);
+        httpd_register_uri_handler(server, &uri_stats);
+        httpd_register_uri_handler(server, &uri_telemetry);
+        httpd_register_uri_handler(server, &uri_boot);
+        httpd_register_uri_handler(server, &uri_assets);
     }
+    return err;
 }
 
-/** Event handler for Ethernet events */
-static void eth_event_handler(void *arg, esp_event_base_t event_base,
-                              int32_t event_id, void *event_data)
+static esp_err_t network_start(void *ctx)
 {
-    uint8_t mac_addr[6] = {0};
-    /* we can get the ethernet driver handle from event data */
-    esp_eth_handle_t eth_handle = *(esp_eth_handle_t *)event_data;
-
-    switch (event_id)
+    /* ethernet */
+    net_manager_config_t net_config = NET_MANAGER_DEFAULT_CONFIG();
+    net_config.eth = true;
+    net_config.eth_mdc_gpio = PIN_ETH_MDC;
+    net_config.eth_mdio_gpio = PIN_ETH_MDIO;
+    net_config.eth_phy_addr = ETH_PHY_ADDR;
+    net_config.eth_phy_reset_gpio = PIN_ETH_RESET;
+#if !CONFIG_ETH_USE_OPENETH
+    /* static ip address, under QEMU the user network hands one out with dhcp */
+    esp_netif_ip_info_t static_ip = {
+        .ip.addr = ipaddr_addr(STATIC_IP_ADDR),
+        .netmask.addr = ipaddr_addr(STATIC_NETMASK),
+        .gw.addr = ipaddr_addr(STATIC_IP_ADDR_GATEWAY)};
+    net_config.eth_static_ip = &static_ip;
+#endif
+    esp_err_t err = net_manager_start(&net_config);
+    if (err == ESP_OK)
     {
-    case ETHERNET_EVENT_CONNECTED:
-        esp_eth_ioctl(eth_handle, ETH_CMD_G_MAC_ADDR, mac_addr);
-        ESP_LOGI(TAG, "Ethernet Link Up");
-        ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
-                 mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-        break;
-    case ETHERNET_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "Ethernet Link Down");
-        break;
-    case ETHERNET_EVENT_START:
-        ESP_LOGI(TAG, "Ethernet Started");
-        break;
-    case ETHERNET_EVENT_STOP:
-        ESP_LOGI(TAG, "Ethernet Stopped");
-        break;
-    default:
-        break;
+        net_manager_wait_ready(portMAX_DELAY);
     }
+    return err;
 }
 
-/** Event handler for IP_EVENT_ETH_GOT_IP */
-static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
-                                 int32_t event_id, void *event_data)
+// the /ws stream, a failed adc leaves the rest of the server up
+static esp_err_t telemetry_stream_start(void *ctx)
 {
-    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-    const esp_netif_ip_info_t *ip_info = &event->ip_info;
-
-    ESP_LOGI(TAG, "Ethernet Got IP Address");
-    ESP_LOGI(TAG, "~~~~~~~~~~~");
-    ESP_LOGI(TAG, "ETHIP:" IPSTR, IP2STR(&ip_info->ip));
-    ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&ip_info->netmask));
-    ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&ip_info->gw));
-    ESP_LOGI(TAG, "~~~~~~~~~~~");
+    return ws_telemetry_start(server, telemetry_sample, NULL);
 }
 
-static void set_static_ip(esp_netif_t *netif)
-{
-    if (esp_netif_dhcpc_stop(netif) != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to stop dhcp client");
-        return;
-    }
-    esp_netif_ip_info_t ip;
-    memset(&ip, 0, sizeof(esp_netif_ip_info_t));
-    ip.ip.addr = ipaddr_addr(STATIC_IP_ADDR);
-    ip.netmask.addr = ipaddr_addr(STATIC_NETMASK);
-    ip.gw.addr = ipaddr_addr(STATIC_IP_ADDR_GATEWAY);
-    if (esp_netif_set_ip_info(netif, &ip) != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Failed to set ip info");
-        return;
-    }
-    ESP_LOGI(TAG, "Success to set static ip: %s, netmask: %s, gw: %s", STATIC_IP_ADDR, STATIC_NETMASK, STATIC_IP_ADDR_GATEWAY);
-}
+// startup stages, each one runs as soon as the stages it requires are done
+#define STAGE_ASSETS BIT0
+#define STAGE_TELEMETRY BIT1
+#define STAGE_NETWORK BIT2
+#define STAGE_SERVER BIT3
+#define STAGE_STREAM BIT4
+
+static const startup_stage_t stages[] = {
+    {.name = "assets", .provides = STAGE_ASSETS, .run = initi_web_page_buffer},
+    {.name = "telemetry", .provides = STAGE_TELEMETRY, .run = telemetry_init},
+    {.name = "network", .provides = STAGE_NETWORK, .run = network_start},
+    {.name = "server",
+     .requires = STAGE_ASSETS | STAGE_NETWORK,
+     .provides = STAGE_SERVER,
+     .run = websocket_app_start},
+    {.name = "stream",
+     .requires = STAGE_TELEMETRY | STAGE_SERVER,
+     .provides = STAGE_STREAM,
+     .run = telemetry_stream_start},
+};
 
 void app_main(void)
 {
     gpio_set_direction(LED_PIN, GPIO_MODE_OUTPUT);
-    initi_web_page_buffer();
-
-    /* ethernet */
-    eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();                      // apply default common MAC configuration
-    eth_esp32_emac_config_t esp32_emac_config = ETH_ESP32_EMAC_DEFAULT_CONFIG(); // apply default vendor-specific MAC configuration
-    esp32_emac_config.smi_mdc_gpio_num = PIN_ETH_MDC;
-    esp32_emac_config.smi_mdio_gpio_num = PIN_ETH_MDIO;
-    esp_eth_mac_t *mac = esp_eth_mac_new_esp32(&esp32_emac_config, &mac_config); // create MAC instance
-
-    eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG(); // apply default PHY configuration
-    phy_config.phy_addr = ETH_PHY_ADDR;
-    phy_config.reset_gpio_num = PIN_ETH_RESET;
-    esp_eth_phy_t *phy = esp_eth_phy_new_lan87xx(&phy_config); // create PHY instance
-
-    esp_eth_config_t config = ETH_DEFAULT_CONFIG(mac, phy); // apply default driver configuration
-    esp_eth_handle_t eth_handle = NULL;
-    ESP_ERROR_CHECK(esp_eth_driver_install(&config, &eth_handle)); // install driver
-
-    /* TCP-IP stack */
-    ESP_ERROR_CHECK(esp_netif_init());                // Initialize TCP/IP network interface (should be called only once in application)
-    ESP_ERROR_CHECK(esp_event_loop_create_default()); // Create default event loop that running in background
-
-    esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH(); // Create new default instance of esp-netif for Ethernet
-    esp_netif_t *eth_netif = esp_netif_new(&cfg);
-
-    /* static ip address */
-    set_static_ip(eth_netif);
-
-    ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handle)));                        // attach Ethernet driver to TCP/IP stack
-    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));      // Register user defined event handers
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL)); // Register user defined event handers
-
-    /* start Ethernet driver state machine */
-    ESP_ERROR_CHECK(esp_eth_start(eth_handle));
-
-    vTaskDelay(1500 / portTICK_PERIOD_MS);
-    websocket_app_start();
+    ESP_ERROR_CHECK(startup_run(stages, sizeof(stages) / sizeof(stages[0])));
 }
\ No newline at end of file
@@ -0,0 +1,37 @@
+# Benchmark gate for the QEMU build of ethernet_websocket, see bench/README.md
+#
+#   pytest --target esp32 --embedded-services idf,qemu --build-dir build_qemu
+
+import json
+import os
+import sys
+
+import pytest
+from pytest_embedded_qemu.dut import QemuDut
+
+BENCH_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'bench')
+sys.path.insert(0, BENCH_DIR)
+import baseline  # noqa: E402
+import ws_bench  # noqa: E402
+
+BENCH_PORT = 8080
+
+
+@pytest.mark.esp32
+@pytest.mark.host_test
+@pytest.mark.qemu
+@pytest.mark.parametrize(
+    'qemu_extra_args',
+    ['-nic user,model=open_eth,hostfwd=tcp:127.0.0.1:{}-:80'.format(BENCH_PORT)],
+    indirect=True,
+)
+def test_ethernet_websocket_bench(dut: QemuDut) -> None:
+    dut.expect('network ready on eth', timeout=60)
+    dut.expect('Registering URI handler', timeout=30)
+
+    scenarios = ws_bench.load_scenarios([os.path.join(BENCH_DIR, 'scenarios')])
+    results = ws_bench.run_scenarios(scenarios, '127.0.0.1', BENCH_PORT)
+    print(json.dumps(results, indent=2, sort_keys=True))
+
+    baseline.check('ethernet_websocket_qemu', results,
+                   lambda run, base: ws_bench.compare(run, base, tolerance=0.2))
@@ -0,0 +1,41 @@
+# Boot profile gate for the QEMU build of ethernet_websocket, see bench/README.md
+#
+#   pytest --target esp32 --embedded-services idf,qemu --build-dir build_qemu
+
+import json
+import os
+import sys
+
+import pytest
+from pytest_embedded_qemu.dut import QemuDut
+
+BENCH_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'bench')
+sys.path.insert(0, BENCH_DIR)
+import baseline  # noqa: E402
+import boot_prof  # noqa: E402
+
+BENCH_PORT = 8080
+
+
+@pytest.mark.esp32
+@pytest.mark.host_test
+@pytest.mark.qemu
+@pytest.mark.parametrize(
+    'qemu_extra_args',
+    ['-nic user,model=open_eth,hostfwd=tcp:127.0.0.1:{}-:80'.format(BENCH_PORT)],
+    indirect=True,
+)
+def test_ethernet_websocket_boot_profile(dut: QemuDut) -> None:
+    # up to the newline, the line arrives in pieces
+    match = dut.expect(rb'BOOT_PROF (\{.*\})\r?\n', timeout=60)
+    report = boot_prof.parse(match.group(1).decode())
+    print(json.dumps(report, indent=2, sort_keys=True))
+    assert 'time_to_serve_ms' in report, 'httpd start missing from the boot profile'
+
+    # /boot serves the same table, grown by whatever ran since
+    served = boot_prof.fetch('127.0.0.1', BENCH_PORT)
+    missing = set(report['spans']) - set(served['spans'])
+    assert not missing, 'spans missing from /boot: {}'.format(sorted(missing))
+
+    baseline.check('ethernet_websocket_qemu_boot', report,
+                   lambda run, base: boot_prof.compare(run, base, tolerance=0.2, slack_ms=50))
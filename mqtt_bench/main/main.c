@@ -0,0 +1,317 @@
+/*
+MQTT benchmark: publish rate per QoS, publish to subscribe latency and
+reconnect time against a broker on the host, see bench/README.md
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "nvs_flash.h"
+#include "sdkconfig.h"
+#include "net_manager.h"
+
+static const char *TAG = "mqtt_bench";
+
+#define PIN_ETH_MDC 23
+#define PIN_ETH_MDIO 18
+#define PIN_ETH_RESET -1
+#define ETH_PHY_ADDR 0
+
+#define BENCH_CONNECTED BIT0
+#define BENCH_SUBSCRIBED BIT1
+
+// a publish or a probe not answered within this counts as lost
+#define BENCH_TIMEOUT_MS 5000
+
+#define PUB_TOPIC CONFIG_MQTT_BENCH_TOPIC "/pub"
+#define ECHO_TOPIC CONFIG_MQTT_BENCH_TOPIC "/echo"
+
+typedef struct
+{
+    int qos;
+    uint32_t sent;
+    uint32_t failed;    // refused by the client or never acknowledged
+    int64_t elapsed_us; // first publish to last ack, to last write for QoS 0
+} bench_publish_t;
+
+typedef struct
+{
+    uint32_t seq;
+    int64_t rtt_us;
+} bench_echo_t;
+
+static esp_mqtt_client_handle_t client;
+static EventGroupHandle_t events;
+// one token per publish that may be in flight, given back on each ack
+static SemaphoreHandle_t window;
+static QueueHandle_t echoes;
+static uint8_t payload[CONFIG_MQTT_BENCH_PAYLOAD_SIZE];
+
+static bench_publish_t publish_results[3];
+static uint32_t latency_us[CONFIG_MQTT_BENCH_LATENCY_SAMPLES];
+static uint32_t latency_count;
+static uint32_t reconnect_us[CONFIG_MQTT_BENCH_RECONNECTS];
+static uint32_t reconnect_count;
+static int64_t connect_us;
+
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    switch ((esp_mqtt_event_id_t)event_id)
+    {
+    case MQTT_EVENT_CONNECTED:
+        xEventGroupSetBits(events, BENCH_CONNECTED);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        xEventGroupClearBits(events, BENCH_CONNECTED);
+        break;
+    case MQTT_EVENT_SUBSCRIBED:
+        xEventGroupSetBits(events, BENCH_SUBSCRIBED);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        // PUBACK for QoS 1, PUBCOMP for QoS 2
+        xSemaphoreGive(window);
+        break;
+    case MQTT_EVENT_DATA:
+        if (event->current_data_offset == 0 && event->data_len >= (int)(sizeof(int64_t) + sizeof(uint32_t)))
+        {
+            int64_t sent_us;
+            bench_echo_t echo;
+            memcpy(&sent_us, event->data, sizeof(sent_us));
+            memcpy(&echo.seq, event->data + sizeof(sent_us), sizeof(echo.seq));
+            echo.rtt_us = esp_timer_get_time() - sent_us;
+            xQueueSend(echoes, &echo, 0);
+        }
+        break;
+    case MQTT_EVENT_ERROR:
+        ESP_LOGW(TAG, "mqtt error, type %d", event->error_handle->error_type);
+        break;
+    default:
+        break;
+    }
+}
+
+// stamps the payload with the send time and a sequence number
+static void payload_stamp(uint32_t seq)
+{
+    int64_t now_us = esp_timer_get_time();
+    memcpy(payload, &now_us, sizeof(now_us));
+    memcpy(payload + sizeof(now_us), &seq, sizeof(seq));
+}
+
+static bool wait_connected(TickType_t timeout)
+{
+    return xEventGroupWaitBits(events, BENCH_CONNECTED, pdFALSE, pdTRUE, timeout) & BENCH_CONNECTED;
+}
+
+static void bench_publish(int qos, bench_publish_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->qos = qos;
+
+    // every token back in the window
+    while (xSemaphoreTake(window, 0) == pdTRUE)
+    {
+    }
+    for (int i = 0; i < CONFIG_MQTT_BENCH_WINDOW; i++)
+    {
+        xSemaphoreGive(window);
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < CONFIG_MQTT_BENCH_MESSAGES; i++)
+    {
+        if (qos > 0 && xSemaphoreTake(window, pdMS_TO_TICKS(BENCH_TIMEOUT_MS)) != pdTRUE)
+        {
+            ESP_LOGW(TAG, "qos %d: no ack within %d ms", qos, BENCH_TIMEOUT_MS);
+            result->failed += CONFIG_MQTT_BENCH_MESSAGES - i;
+            break;
+        }
+        payload_stamp(i);
+        if (esp_mqtt_client_publish(client, PUB_TOPIC, (const char *)payload, sizeof(payload), qos, 0) < 0)
+        {
+            result->failed++;
+            if (qos > 0)
+            {
+                xSemaphoreGive(window);
+            }
+            continue;
+        }
+        result->sent++;
+    }
+
+    // the run ends when the last publish in flight is acknowledged
+    int unacked = 0;
+    for (int i = 0; qos > 0 && i < CONFIG_MQTT_BENCH_WINDOW; i++)
+    {
+        if (xSemaphoreTake(window, pdMS_TO_TICKS(BENCH_TIMEOUT_MS)) != pdTRUE)
+        {
+            unacked = CONFIG_MQTT_BENCH_WINDOW - i;
+            break;
+        }
+    }
+    result->elapsed_us = esp_timer_get_time() - start_us;
+    result->failed += unacked;
+    result->sent -= unacked;
+
+    ESP_LOGI(TAG, "qos %d: %" PRIu32 " sent, %" PRIu32 " failed in %" PRId64 " ms", qos, result->sent,
+             result->failed, result->elapsed_us / 1000);
+}
+
+static void bench_latency(void)
+{
+    bench_echo_t echo;
+
+    xEventGroupClearBits(events, BENCH_SUBSCRIBED);
+    esp_mqtt_client_subscribe(client, ECHO_TOPIC, 0);
+    if (!(xEventGroupWaitBits(events, BENCH_SUBSCRIBED, pdFALSE, pdTRUE, pdMS_TO_TICKS(BENCH_TIMEOUT_MS)) &
+          BENCH_SUBSCRIBED))
+    {
+        ESP_LOGW(TAG, "subscribe to %s not acknowledged", ECHO_TOPIC);
+        return;
+    }
+
+    // one probe at a time, each one goes out once the previous came back
+    for (uint32_t i = 0; i < CONFIG_MQTT_BENCH_LATENCY_SAMPLES; i++)
+    {
+        payload_stamp(i);
+        esp_mqtt_client_publish(client, ECHO_TOPIC, (const char *)payload, sizeof(payload), 0, 0);
+        // a late echo of an earlier probe is skipped
+        while (xQueueReceive(echoes, &echo, pdMS_TO_TICKS(BENCH_TIMEOUT_MS)) == pdTRUE)
+        {
+            if (echo.seq == i)
+            {
+                latency_us[latency_count++] = echo.rtt_us;
+                break;
+            }
+        }
+    }
+    esp_mqtt_client_unsubscribe(client, ECHO_TOPIC);
+
+    ESP_LOGI(TAG, "latency: %" PRIu32 " of %d probes answered", latency_count, CONFIG_MQTT_BENCH_LATENCY_SAMPLES);
+}
+
+// stop and start: a fresh TCP connect and CONNECT/CONNACK, without the
+// client reconnect delay, which is a setting and not a cost
+static void bench_reconnect(void)
+{
+    for (int i = 0; i < CONFIG_MQTT_BENCH_RECONNECTS; i++)
+    {
+        esp_mqtt_client_stop(client);
+        xEventGroupClearBits(events, BENCH_CONNECTED);
+
+        int64_t start_us = esp_timer_get_time();
+        esp_mqtt_client_start(client);
+        if (wait_connected(pdMS_TO_TICKS(BENCH_TIMEOUT_MS)))
+        {
+            reconnect_us[reconnect_count++] = esp_timer_get_time() - start_us;
+        }
+    }
+
+    ESP_LOGI(TAG, "reconnect: %" PRIu32 " of %d", reconnect_count, CONFIG_MQTT_BENCH_RECONNECTS);
+}
+
+static void print_samples(const char *name, const uint32_t *samples, uint32_t count, uint32_t total)
+{
+    printf(",\"%s\":{\"lost\":%" PRIu32 ",\"us\":[", name, total - count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        printf("%s%" PRIu32, i ? "," : "", samples[i]);
+    }
+    printf("]}");
+}
+
+// one line, the host computes rates and percentiles, see bench/mqtt_bench.py
+static void print_results(void)
+{
+    printf("MQTT_BENCH {\"broker\":\"%s\",\"payload\":%d,\"messages\":%d,\"window\":%d,\"connect_us\":%" PRId64
+           ",\"publish\":[",
+           CONFIG_MQTT_BENCH_BROKER_URI, CONFIG_MQTT_BENCH_PAYLOAD_SIZE, CONFIG_MQTT_BENCH_MESSAGES,
+           CONFIG_MQTT_BENCH_WINDOW, connect_us);
+    for (int qos = 0; qos < 3; qos++)
+    {
+        const bench_publish_t *r = &publish_results[qos];
+        printf("%s{\"qos\":%d,\"sent\":%" PRIu32 ",\"failed\":%" PRIu32 ",\"elapsed_us\":%" PRId64 "}",
+               qos ? "," : "", r->qos, r->sent, r->failed, r->elapsed_us);
+    }
+    printf("]");
+    print_samples("latency", latency_us, latency_count, CONFIG_MQTT_BENCH_LATENCY_SAMPLES);
+    print_samples("reconnect", reconnect_us, reconnect_count, CONFIG_MQTT_BENCH_RECONNECTS);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void bench_task(void *params)
+{
+    const esp_mqtt_client_config_t config = {
+        .broker.address.uri = CONFIG_MQTT_BENCH_BROKER_URI,
+    };
+
+    client = esp_mqtt_client_init(&config);
+    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+
+    int64_t start_us = esp_timer_get_time();
+    esp_mqtt_client_start(client);
+    if (!wait_connected(pdMS_TO_TICKS(30000)))
+    {
+        ESP_LOGE(TAG, "no broker at %s", CONFIG_MQTT_BENCH_BROKER_URI);
+        vTaskDelete(NULL);
+    }
+    connect_us = esp_timer_get_time() - start_us;
+
+    for (int qos = 0; qos < 3; qos++)
+    {
+        bench_publish(qos, &publish_results[qos]);
+    }
+    bench_latency();
+    bench_reconnect();
+
+    esp_mqtt_client_stop(client);
+    print_results();
+    ESP_LOGI(TAG, "done");
+    vTaskDelete(NULL);
+}
+
+void app_main(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    events = xEventGroupCreate();
+    window = xSemaphoreCreateCounting(CONFIG_MQTT_BENCH_WINDOW, CONFIG_MQTT_BENCH_WINDOW);
+    echoes = xQueueCreate(4, sizeof(bench_echo_t));
+    memset(payload, 'x', sizeof(payload));
+
+    net_manager_config_t net_config = NET_MANAGER_DEFAULT_CONFIG();
+    net_config.eth = true;
+    net_config.eth_mdc_gpio = PIN_ETH_MDC;
+    net_config.eth_mdio_gpio = PIN_ETH_MDIO;
+    net_config.eth_phy_addr = ETH_PHY_ADDR;
+    net_config.eth_phy_reset_gpio = PIN_ETH_RESET;
+    if (strlen(CONFIG_MQTT_BENCH_WIFI_SSID) > 0)
+    {
+        net_config.wifi = true;
+        net_config.wifi_ssid = CONFIG_MQTT_BENCH_WIFI_SSID;
+        net_config.wifi_password = CONFIG_MQTT_BENCH_WIFI_PASSWORD;
+    }
+    ESP_ERROR_CHECK(net_manager_start(&net_config));
+    net_manager_wait_ready(portMAX_DELAY);
+    ESP_LOGI(TAG, "network ready on %s, broker %s", net_manager_link_name(net_manager_active_link()),
+             CONFIG_MQTT_BENCH_BROKER_URI);
+
+    xTaskCreate(bench_task, "bench_task", 1024 * 6, NULL, 5, NULL);
+}
@@ -0,0 +1,42 @@
+# Benchmark gate for the QEMU build of mqtt_bench, see bench/README.md
+#
+#   pytest --target esp32 --embedded-services idf,qemu --build-dir build_qemu
+#
+# Uses the broker listening on port 1883 of the host, or starts mosquitto.
+
+import json
+import os
+import sys
+
+import pytest
+from pytest_embedded_qemu.dut import QemuDut
+
+BENCH_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'bench')
+sys.path.insert(0, BENCH_DIR)
+import baseline  # noqa: E402
+import mqtt_bench  # noqa: E402
+
+BROKER_PORT = 1883
+
+
+@pytest.fixture(scope='module', autouse=True)
+def broker():
+    with mqtt_bench.local_broker(BROKER_PORT) as proc:
+        yield proc
+
+
+@pytest.mark.esp32
+@pytest.mark.host_test
+@pytest.mark.qemu
+@pytest.mark.parametrize('qemu_extra_args', ['-nic user,model=open_eth'], indirect=True)
+def test_mqtt_bench(dut: QemuDut) -> None:
+    dut.expect('network ready on eth', timeout=60)
+    # up to the newline, the line arrives in pieces
+    match = dut.expect(rb'MQTT_BENCH (\{.*\})\r?\n', timeout=600)
+    report = mqtt_bench.parse(match.group(1).decode())
+    print(json.dumps(report, indent=2, sort_keys=True))
+    for qos, run in report['publish'].items():
+        assert run['sent'] > 0, '{}: nothing published'.format(qos)
+
+    baseline.check('mqtt_bench_qemu', report,
+                   lambda run, base: mqtt_bench.compare(run, base, tolerance=0.2, slack_ms=2))
@@ -25,7 +25,9 @@
 #include "driver/gpio.h"
 #include "rom/gpio.h"
 #include "esp_sleep.h"
-#include "esp_https_ota.h"
+#include "boot_prof.h"
+#include "ota_resume.h"
+#include "startup.h"
 
 static const char *TAG = "MAIN";
 // #define EXAMPLE_ESP_WIFI_SSID "Pixel_8801"
@@ -36,6 +38,11 @@ static const char *TAG = "MAIN";
 static int retry_cnt = 0;
 #define OLIMEX_BUT_PIN 34
 
+// startup stages, each one runs as soon as the stages it requires are done
+#define STAGE_NVS BIT0
+#define STAGE_NETWORK BIT1 // set by the got ip event
+#define STAGE_OTA BIT2
+
 bool conn_flag_on = false;
 bool wifi_status = false;
 bool mqtt_connected = false;
@@ -71,19 +78,15 @@ unsigned long millis()
     return (unsigned long)(esp_timer_get_time() / 1000ULL);
 }
 
-void do_ota()
+static esp_err_t do_ota(void *ctx)
 {
-    // ota
-    esp_http_client_config_t config = {
+    // ota, an interrupted download resumes where it stopped, also after a reboot
+    ota_resume_config_t config = {
         .url = "https://github.com/EmanueleFeola/rpc_ModuleB/raw/master/project-name.bin",
         .cert_pem = test_root_ca,
-        // .skip_cert_common_name_check = false
-    };
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
     };
 
-    esp_err_t ret = esp_https_ota(&ota_config);
+    esp_err_t ret = ota_resume_update(&config);
     if (ret == ESP_OK)
     {
         printf("OTA OK, restarting...\n");
@@ -95,6 +98,7 @@ void do_ota()
     }
 
     printf("sono qua \n");
+    return ret;
 }
 
 static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
@@ -114,6 +118,7 @@ static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
 
     case IP_EVENT_STA_GOT_IP:
         ESP_LOGI(TAG, "Wi-Fi got ip\n");
+        startup_signal(STAGE_NETWORK);
         break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
@@ -132,7 +137,7 @@ static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
     return ESP_OK;
 }
 
-void wifi_init(void)
+static esp_err_t wifi_init(void *ctx)
 {
     printf("[wifi_init]\n");
 
@@ -153,23 +158,30 @@ void wifi_init(void)
     esp_wifi_init(&cfg);
     esp_wifi_set_mode(WIFI_MODE_STA);
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
-    esp_wifi_start();
+    return esp_wifi_start();
 }
 
-void app_main(void)
+static esp_err_t nvs_init(void *ctx)
 {
-    esp_timer_early_init();
-
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
-    ESP_ERROR_CHECK(ret);
+    return ret;
+}
 
-    wifi_init();
+static const startup_stage_t stages[] = {
+    {.name = "nvs", .provides = STAGE_NVS, .run = nvs_init},
+    {.name = "wifi", .requires = STAGE_NVS, .provides = STAGE_NETWORK, .run = wifi_init, .async = true},
+    {.name = "ota", .requires = STAGE_NETWORK, .provides = STAGE_OTA, .run = do_ota, .stack_size = 8192},
+};
 
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
-    do_ota();
-}
\ No newline at end of file
+void app_main(void)
+{
+    int span = boot_prof_begin("esp_timer_early_init");
+    esp_timer_early_init();
+    boot_prof_end(span);
+    ESP_ERROR_CHECK(startup_run(stages, sizeof(stages) / sizeof(stages[0])));
+}
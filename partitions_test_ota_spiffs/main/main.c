@@ -25,7 +25,9 @@
 #include "driver/gpio.h"
 #include "rom/gpio.h"
 #include "esp_sleep.h"
-#include "esp_https_ota.h"
+#include "boot_prof.h"
+#include "ota_resume.h"
+#include "startup.h"
 #include "esp_spiffs.h"
 
 static const char *TAG = "MAIN";
@@ -37,6 +39,12 @@ static const char *TAG = "MAIN";
 static int retry_cnt = 0;
 #define OLIMEX_BUT_PIN 34
 
+// startup stages, each one runs as soon as the stages it requires are done
+#define STAGE_NVS BIT0
+#define STAGE_NETWORK BIT1 // set by the got ip event
+#define STAGE_OTA BIT2
+#define STAGE_PAGE BIT3
+
 bool conn_flag_on = false;
 bool wifi_status = false;
 bool mqtt_connected = false;
@@ -71,7 +79,7 @@ const char *test_root_ca =
     "-----END CERTIFICATE-----\n";
 
 ///
-static void initi_web_page_buffer(void)
+static esp_err_t initi_web_page_buffer(void *ctx)
 {
     esp_vfs_spiffs_conf_t conf = {
         .base_path = "/spiffs",
@@ -79,14 +87,21 @@ static void initi_web_page_buffer(void)
         .max_files = 5,
         .format_if_mount_failed = true};
 
-    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
+    // formatting on a failed mount can take seconds, it no longer holds up the network
+    int span = boot_prof_begin("spiffs mount");
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
+    boot_prof_end(span);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
 
     memset((void *)index_html, 0, sizeof(index_html));
     struct stat st;
     if (stat(INDEX_HTML_PATH, &st))
     {
         ESP_LOGE(TAG, "index.html not found");
-        return;
+        return ESP_ERR_NOT_FOUND;
     }
 
     FILE *fp = fopen(INDEX_HTML_PATH, "r");
@@ -99,6 +114,7 @@ static void initi_web_page_buffer(void)
     printf("%s\n", index_html);
 
     fclose(fp);
+    return ESP_OK;
 }
 ///
 
@@ -107,19 +123,15 @@ unsigned long millis()
     return (unsigned long)(esp_timer_get_time() / 1000ULL);
 }
 
-void do_ota()
+static esp_err_t do_ota(void *ctx)
 {
-    // ota
-    esp_http_client_config_t config = {
+    // ota, an interrupted download resumes where it stopped, also after a reboot
+    ota_resume_config_t config = {
         .url = "https://github.com/EmanueleFeola/rpc_ModuleB/raw/master/project-name.bin",
         .cert_pem = test_root_ca,
-        // .skip_cert_common_name_check = false
-    };
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
     };
 
-    esp_err_t ret = esp_https_ota(&ota_config);
+    esp_err_t ret = ota_resume_update(&config);
     if (ret == ESP_OK)
     {
         printf("OTA OK, restarting...\n");
@@ -131,6 +143,7 @@ void do_ota()
     }
 
     printf("sono qua \n");
+    return ret;
 }
 
 static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
@@ -150,6 +163,7 @@ static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
 
     case IP_EVENT_STA_GOT_IP:
         ESP_LOGI(TAG, "Wi-Fi got ip\n");
+        startup_signal(STAGE_NETWORK);
         break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
@@ -168,7 +182,7 @@ static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
     return ESP_OK;
 }
 
-void wifi_init(void)
+static esp_err_t wifi_init(void *ctx)
 {
     printf("[wifi_init]\n");
 
@@ -189,24 +203,31 @@ void wifi_init(void)
     esp_wifi_init(&cfg);
     esp_wifi_set_mode(WIFI_MODE_STA);
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
-    esp_wifi_start();
+    return esp_wifi_start();
 }
 
-void app_main(void)
+static esp_err_t nvs_init(void *ctx)
 {
-    esp_timer_early_init();
-    initi_web_page_buffer();
-
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
-    ESP_ERROR_CHECK(ret);
+    return ret;
+}
 
-    wifi_init();
+static const startup_stage_t stages[] = {
+    {.name = "page", .provides = STAGE_PAGE, .run = initi_web_page_buffer},
+    {.name = "nvs", .provides = STAGE_NVS, .run = nvs_init},
+    {.name = "wifi", .requires = STAGE_NVS, .provides = STAGE_NETWORK, .run = wifi_init, .async = true},
+    {.name = "ota", .requires = STAGE_NETWORK, .provides = STAGE_OTA, .run = do_ota, .stack_size = 8192},
+};
 
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
-    do_ota();
-}
\ No newline at end of file
+void app_main(void)
+{
+    int span = boot_prof_begin("esp_timer_early_init");
+    esp_timer_early_init();
+    boot_prof_end(span);
+    ESP_ERROR_CHECK(startup_run(stages, sizeof(stages) / sizeof(stages[0])));
+}
@@ -22,7 +22,6 @@ gestisce comunicazione webspcket su /ws
 #include <string.h>
 #include "esp_spi_flash.h"
 #include <esp_http_server.h>
-#include "esp_spiffs.h"
 
 #include "esp_wifi.h"
 #include "esp_event.h"
@@ -34,18 +33,31 @@ gestisce comunicazione webspcket su /ws
 #include <lwip/sys.h>
 #include <lwip/api.h>
 #include <lwip/netdb.h>
+#include "esp_adc/adc_oneshot.h"
+#include "boot_prof.h"
+#include "net_manager.h"
+#include "page_template.h"
+#include "startup.h"
+#include "web_assets.h"
+#include "ws_proto.h"
+#include "ws_sessions.h"
+#include "ws_telemetry.h"
 
 #define SSID "Pixel_8801"
 #define PASS "franzogna"
 
 static const char *TAG = "MAIN";
 
-#define INDEX_HTML_PATH "/spiffs/index.html"
-char index_html[4096];
-char response_data[4096];
+static page_template_t index_page;
 
 bool led_state = false;
+// bumped on every led change, keys the rendered page cache
+static uint32_t state_version = 0;
 #define LED_PIN 32
+// GPIO36, streamed to the dashboards that subscribe to telemetry
+#define TELEMETRY_ADC_CHANNEL ADC_CHANNEL_0
+
+static adc_oneshot_unit_handle_t adc_handle;
 
 httpd_handle_t server = NULL;
 
@@ -54,147 +66,149 @@ unsigned long millis()
     return (unsigned long)(esp_timer_get_time() / 1000ULL);
 }
 
-static void initi_web_page_buffer(void)
+static esp_err_t initi_web_page_buffer(void *ctx)
 {
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = "/spiffs",
-        .partition_label = NULL,
-        .max_files = 5,
-        .format_if_mount_failed = true};
-
-    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
+    // without the pages the server still runs, with /ws and /stats
+    if (web_assets_init("storage") != ESP_OK)
+    {
+        return ESP_OK;
+    }
 
-    memset((void *)index_html, 0, sizeof(index_html));
-    struct stat st;
-    if (stat(INDEX_HTML_PATH, &st))
+    const web_asset_t *index = web_assets_find("/index.html");
+    if (index == NULL)
     {
         ESP_LOGE(TAG, "index.html not found");
-        return;
+        return ESP_OK;
     }
+    page_template_parse(&index_page, web_assets_data(index), index->size);
+    return ESP_OK;
+}
 
-    FILE *fp = fopen(INDEX_HTML_PATH, "r");
-    if (fread(index_html, st.st_size, 1, fp) == 0)
+static const char *index_page_slot(const char *slot, void *ctx)
+{
+    if (strcmp(slot, "state") == 0)
     {
-        ESP_LOGE(TAG, "fread failed");
+        return led_state ? "ON" : "OFF";
     }
-    fclose(fp);
+    return NULL;
 }
 
 esp_err_t get_req_handler(httpd_req_t *req)
 {
     printf("[get_req_handler] called");
-    int response;
-    if (led_state)
+    char etag[WEB_ASSETS_ETAG_LEN];
+    web_assets_versioned_etag(web_assets_find("/index.html"), state_version, etag, sizeof(etag));
+    if (web_assets_not_modified(req, etag))
     {
-        sprintf(response_data, index_html, "ON");
-    }
-    else
-    {
-        sprintf(response_data, index_html, "OFF");
+        return ESP_OK;
     }
-    response = httpd_resp_send(req, response_data, HTTPD_RESP_USE_STRLEN);
-    return response;
+    return page_template_send(&index_page, req, state_version, index_page_slot, NULL);
 }
 
-///
-static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+static esp_err_t wifi_connection(void *ctx)
 {
-    switch (event_id)
+    int span = boot_prof_begin("nvs_flash_init");
+    nvs_flash_init();
+    boot_prof_end(span);
+
+    net_manager_config_t config = NET_MANAGER_DEFAULT_CONFIG();
+    config.wifi = true;
+    config.wifi_ssid = SSID;
+    config.wifi_password = PASS;
+    esp_err_t err = net_manager_start(&config);
+    if (err == ESP_OK)
     {
-    case WIFI_EVENT_STA_START:
-        printf("WiFi connecting ... \n");
-        break;
-    case WIFI_EVENT_STA_CONNECTED:
-        printf("WiFi connected ... \n");
-        break;
-    case WIFI_EVENT_STA_DISCONNECTED:
-        printf("WiFi lost connection ... \n");
-        break;
-    case IP_EVENT_STA_GOT_IP:
-        printf("WiFi got IP ... \n\n");
-        break;
-    default:
-        break;
+        net_manager_wait_ready(portMAX_DELAY);
     }
+    return err;
 }
 
-void wifi_connection()
+static size_t encode_state(uint8_t *buf, size_t len, uint16_t seq)
 {
-    nvs_flash_init();
-    // 1 - Wi-Fi/LwIP Init Phase
-    esp_netif_init();                    // TCP/IP initiation 					s1.1
-    esp_event_loop_create_default();     // event loop 			                s1.2
-    esp_netif_create_default_wifi_sta(); // WiFi station 	                    s1.3
-    wifi_init_config_t wifi_initiation = WIFI_INIT_CONFIG_DEFAULT();
-    esp_wifi_init(&wifi_initiation); // 					                    s1.4
-    // 2 - Wi-Fi Configuration Phase
-    esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL);
-    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, wifi_event_handler, NULL);
-    wifi_config_t wifi_configuration = {
-        .sta = {
-            .ssid = SSID,
-            .password = PASS}};
-    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_configuration);
-    // 3 - Wi-Fi Start Phase
-    esp_wifi_start();
-    // 4- Wi-Fi Connect Phase
-    esp_wifi_connect();
+    ws_proto_state_t state = {
+        .uptime_ms = millis(),
+        .led = led_state};
+    return ws_proto_encode(buf, len, WS_OP_STATE, seq, &state, sizeof(state));
 }
 
-// Asynchronous response data structure
-struct async_resp_arg
+// state report pushed to every client, see ws_sessions_state_changed
+static size_t render_state(uint8_t *buf, size_t len, void *ctx)
 {
-    httpd_handle_t hd; // Server instance
-    int fd;            // Session socket file descriptor
-};
+    static uint16_t push_seq = 0;
+    return encode_state(buf, len, push_seq++);
+}
 
-static void ws_async_send(void *arg)
+static void set_led(bool state)
 {
-    httpd_ws_frame_t ws_pkt;
-    struct async_resp_arg *resp_arg = arg;
-    httpd_handle_t hd = resp_arg->hd;
-    int fd = resp_arg->fd;
-
-    led_state = !led_state;
+    if (state == led_state)
+    {
+        return;
+    }
+    led_state = state;
+    state_version++;
     gpio_set_level(LED_PIN, led_state);
+    ws_sessions_state_changed();
+}
 
-    char buff[4];
-    memset(buff, 0, sizeof(buff));
-    sprintf(buff, "%d %d", (int)millis(), led_state);
+static esp_err_t cmd_toggle(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    set_led(!led_state);
+    return ESP_OK;
+}
 
-    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.payload = (uint8_t *)buff;
-    ws_pkt.len = strlen(buff);
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+static esp_err_t cmd_set(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    const ws_proto_set_t *set = payload;
+    set_led(set->led != 0);
+    return ESP_OK;
+}
 
-    static size_t max_clients = CONFIG_LWIP_MAX_LISTENING_TCP;
-    size_t fds = max_clients;
-    int client_fds[max_clients];
+static esp_err_t cmd_get_state(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    uint8_t buf[sizeof(ws_proto_header_t) + sizeof(ws_proto_state_t)];
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = buf,
+        .len = encode_state(buf, sizeof(buf), header->seq)};
+    return httpd_ws_send_frame(req, &frame);
+}
 
-    esp_err_t ret = httpd_get_client_list(server, &fds, client_fds);
+static esp_err_t cmd_telemetry_subscribe(httpd_req_t *req, const ws_proto_header_t *header, const void *payload)
+{
+    const ws_proto_subscribe_t *subscribe = payload;
+    ws_telemetry_subscribe(req, subscribe->enable != 0);
+    return ESP_OK;
+}
 
-    if (ret != ESP_OK)
-    {
-        return;
-    }
+static const ws_proto_command_t ws_commands[WS_OP_COMMAND_COUNT] = {
+    [WS_OP_TOGGLE] = {cmd_toggle, 0},
+    [WS_OP_SET] = {cmd_set, sizeof(ws_proto_set_t)},
+    [WS_OP_GET_STATE] = {cmd_get_state, 0},
+    [WS_OP_TELEMETRY_SUBSCRIBE] = {cmd_telemetry_subscribe, sizeof(ws_proto_subscribe_t)},
+};
 
-    for (int i = 0; i < fds; i++)
+static esp_err_t telemetry_init(void *ctx)
+{
+    adc_oneshot_unit_init_cfg_t unit_config = {
+        .unit_id = ADC_UNIT_1};
+    adc_oneshot_chan_cfg_t channel_config = {
+        .bitwidth = ADC_BITWIDTH_12,
+        .atten = ADC_ATTEN_DB_11};
+
+    esp_err_t err = adc_oneshot_new_unit(&unit_config, &adc_handle);
+    if (err != ESP_OK)
     {
-        int client_info = httpd_ws_get_fd_info(server, client_fds[i]);
-        if (client_info == HTTPD_WS_CLIENT_WEBSOCKET)
-        {
-            httpd_ws_send_frame_async(hd, client_fds[i], &ws_pkt);
-        }
+        return err;
     }
-    free(resp_arg);
+    return adc_oneshot_config_channel(adc_handle, TELEMETRY_ADC_CHANNEL, &channel_config);
 }
 
-static esp_err_t trigger_async_send(httpd_handle_t handle, httpd_req_t *req)
+static int16_t telemetry_sample(void *ctx)
 {
-    struct async_resp_arg *resp_arg = malloc(sizeof(struct async_resp_arg));
-    resp_arg->hd = req->handle;
-    resp_arg->fd = httpd_req_to_sockfd(req);
-    return httpd_queue_work(handle, ws_async_send, resp_arg);
+    int raw = 0;
+    adc_oneshot_read(adc_handle, TELEMETRY_ADC_CHANNEL, &raw);
+    return raw;
 }
 
 static esp_err_t handle_ws_req(httpd_req_t *req)
@@ -202,13 +216,13 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
     if (req->method == HTTP_GET)
     {
         ESP_LOGI(TAG, "Handshake done, the new connection was opened");
+        ws_sessions_set_websocket(req);
         return ESP_OK;
     }
 
     httpd_ws_frame_t ws_pkt;
     uint8_t *buf = NULL;
     memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
     esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
     if (ret != ESP_OK)
     {
@@ -218,10 +232,10 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
 
     if (ws_pkt.len)
     {
-        buf = calloc(1, ws_pkt.len + 1);
+        buf = ws_sessions_frame_alloc(ws_pkt.len);
         if (buf == NULL)
         {
-            ESP_LOGE(TAG, "Failed to calloc memory for buf");
+            ESP_LOGE(TAG, "Failed to alloc memory for buf");
             return ESP_ERR_NO_MEM;
         }
         ws_pkt.payload = buf;
@@ -229,26 +243,28 @@ static esp_err_t handle_ws_req(httpd_req_t *req)
         if (ret != ESP_OK)
         {
             ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
-            free(buf);
+            ws_sessions_frame_free(buf);
             return ret;
         }
-        ESP_LOGI(TAG, "Got packet with message: %s", ws_pkt.payload);
     }
 
-    ESP_LOGI(TAG, "frame len is %d", ws_pkt.len);
-
-    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT &&
-        strcmp((char *)ws_pkt.payload, "toggle") == 0)
+    if (ws_pkt.type == HTTPD_WS_TYPE_BINARY)
     {
-        free(buf);
-        return trigger_async_send(req->handle, req);
+        ret = ws_proto_dispatch(req, ws_commands, WS_OP_COMMAND_COUNT, buf, ws_pkt.len);
     }
-    return ESP_OK;
+    else
+    {
+        ESP_LOGW(TAG, "ignoring websocket frame of type %d", ws_pkt.type);
+    }
+    ws_sessions_frame_free(buf);
+    return ret;
 }
 
-static void websocket_app_start(void)
+static esp_err_t websocket_app_start(void *ctx)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    ws_sessions_configure(&config);
 
     // Create URI (Uniform Resource Identifier)
     // for the server which is added to default gateway
@@ -265,27 +281,82 @@ static void websocket_app_start(void)
         .handler = get_req_handler,
         .user_ctx = NULL};
 
+    static const httpd_uri_t uri_stats = {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = ws_sessions_stats_handler,
+        .user_ctx = NULL};
+
+    static const httpd_uri_t uri_telemetry = {
+        .uri = "/telemetry",
+        .method = HTTP_GET,
+        .handler = ws_telemetry_stats_handler,
+        .user_ctx = NULL};
+
+    static const httpd_uri_t uri_boot = {
+        .uri = "/boot",
+        .method = HTTP_GET,
+        .handler = boot_prof_handler,
+        .user_ctx = NULL};
+
+    // css, js and anything else in data/, must stay the last handler
+    static const httpd_uri_t uri_assets = {
+        .uri = "/*",
+        .method = HTTP_GET,
+        .handler = web_assets_get_handler,
+        .user_ctx = NULL};
+
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK)
+    int span = boot_prof_begin("httpd start");
+    esp_err_t err = httpd_start(&server, &config);
+    boot_prof_end(span);
+    if (err == ESP_OK)
     {
         ESP_LOGI(TAG, "Registering URI handler");
+        ws_sessions_start(server);
+        ws_sessions_set_state_render(render_state, HTTPD_WS_TYPE_BINARY, NULL);
         httpd_register_uri_handler(server, &uri_handler);
         httpd_register_uri_handler(server, &uri_get);
+        httpd_register_uri_handler(server, &uri_stats);
+        httpd_register_uri_handler(server, &uri_telemetry);
+        httpd_register_uri_handler(server, &uri_boot);
+        httpd_register_uri_handler(server, &uri_assets);
     }
+    return err;
 }
 
-void app_main(void)
+// the /ws stream, a failed adc leaves the rest of the server up
+static esp_err_t telemetry_stream_start(void *ctx)
 {
-    gpio_set_direction(LED_PIN, GPIO_MODE_OUTPUT);
-
-    // get web page from spiffs
-    initi_web_page_buffer();
+    return ws_telemetry_start(server, telemetry_sample, NULL);
+}
 
-    // init wifi and connect
-    wifi_connection();
-    vTaskDelay(1500 / portTICK_PERIOD_MS);
+// startup stages, each one runs as soon as the stages it requires are done
+#define STAGE_ASSETS BIT0
+#define STAGE_TELEMETRY BIT1
+#define STAGE_NETWORK BIT2
+#define STAGE_SERVER BIT3
+#define STAGE_STREAM BIT4
+
+static const startup_stage_t stages[] = {
+    {.name = "assets", .provides = STAGE_ASSETS, .run = initi_web_page_buffer},
+    {.name = "telemetry", .provides = STAGE_TELEMETRY, .run = telemetry_init},
+    {.name = "network", .provides = STAGE_NETWORK, .run = wifi_connection},
+    {.name = "server",
+     .requires = STAGE_ASSETS | STAGE_NETWORK,
+     .provides = STAGE_SERVER,
+     .run = websocket_app_start},
+    {.name = "stream",
+     .requires = STAGE_TELEMETRY | STAGE_SERVER,
+     .provides = STAGE_STREAM,
+     .run = telemetry_stream_start},
+};
 
-    // start websocket
-    websocket_app_start();
+void app_main(void)
+{
+    gpio_set_direction(LED_PIN, GPIO_MODE_OUTPUT);
+    // assets, adc and network come up in parallel, the server once assets and
+    // network are done, the telemetry stream once the server and the adc are
+    ESP_ERROR_CHECK(startup_run(stages, sizeof(stages) / sizeof(stages[0])));
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <string.h>
 #include "esp_wifi.h"
@@ -25,6 +26,14 @@
 #include "driver/gpio.h"
 #include "rom/gpio.h"
 #include "esp_sleep.h"
+#include "esp_rom_crc.h"
+
+#include "duty_cycle.h"
+#include "mqtt_outbox.h"
+#include "mqtt_pipeline.h"
+#include "mqtt_router.h"
+#include "telemetry_codec.h"
+#include "wifi_cache.h"
 
 static const char *TAG = "MAIN";
 // #define EXAMPLE_ESP_WIFI_SSID "Pixel_8801"
@@ -34,15 +43,83 @@ static const char *TAG = "MAIN";
 #define MAX_RETRY 10
 static int retry_cnt = 0;
 #define OLIMEX_BUT_PIN 34
+// a session gives up on the broker after this, the samples stay buffered
+#define SESSION_CONNECT_TIMEOUT_MS 15000
+// and waits this long for the broker to ack what it was handed
+#define SESSION_ACK_TIMEOUT_MS 5000
 
-bool conn_flag_on = false;
 bool wifi_status = false;
 bool mqtt_connected = false;
+bool sleep_requested = false;
+duty_cycle_wake_t wake = DUTY_CYCLE_WAKE_POWER_ON;
 TaskHandle_t publisher_task_handle = NULL;
 esp_mqtt_client_handle_t client = NULL;
+esp_netif_t *sta_netif = NULL;
+mqtt_pipeline_topic_t telemetry_topic = MQTT_PIPELINE_TOPIC_INVALID;
+wifi_config_t wifi_config = {
+    .sta = {
+        .ssid = EXAMPLE_ESP_WIFI_SSID,
+        .password = EXAMPLE_ESP_WIFI_PASS,
+        .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+    },
+};
 
 static void mqtt_app_start(void);
 
+// schema 1 of bench/telemetry_schemas.json, fields in this order
+static const telemetry_field_t status_fields[] = {
+    {.name = "uptime_ms", .type = TELEMETRY_UINT},
+    {.name = "rssi", .type = TELEMETRY_SINT},
+    {.name = "free_heap", .type = TELEMETRY_UINT},
+    {.name = "outbox_pending", .type = TELEMETRY_UINT},
+    {.name = "pipeline_depth", .type = TELEMETRY_UINT},
+};
+
+static const telemetry_schema_t status_schema = {
+    .id = 1,
+    .name = "wifi_mqtt.status",
+    .fields = status_fields,
+    .field_count = sizeof(status_fields) / sizeof(status_fields[0]),
+};
+
+// schema 3, one per wake, buffered in rtc memory until a session
+static const telemetry_field_t sample_fields[] = {
+    {.name = "time_ms", .type = TELEMETRY_UINT},
+    {.name = "wake", .type = TELEMETRY_UINT},
+    {.name = "free_heap", .type = TELEMETRY_UINT},
+};
+
+static const telemetry_schema_t sample_schema = {
+    .id = 3,
+    .name = "wifi_mqtt.sample",
+    .fields = sample_fields,
+    .field_count = sizeof(sample_fields) / sizeof(sample_fields[0]),
+};
+
+// schema 4, the energy figures, sent once per session
+static const telemetry_field_t duty_fields[] = {
+    {.name = "wakes", .type = TELEMETRY_UINT},
+    {.name = "sessions", .type = TELEMETRY_UINT},
+    {.name = "samples", .type = TELEMETRY_UINT},
+    {.name = "sent", .type = TELEMETRY_UINT},
+    {.name = "dropped", .type = TELEMETRY_UINT},
+    {.name = "radio_on_ms", .type = TELEMETRY_UINT},
+    {.name = "radio_ms_per_sample", .type = TELEMETRY_FIXED, .decimals = 1},
+};
+
+static const telemetry_schema_t duty_schema = {
+    .id = 4,
+    .name = "wifi_mqtt.duty_cycle",
+    .fields = duty_fields,
+    .field_count = sizeof(duty_fields) / sizeof(duty_fields[0]),
+};
+
+// the pipeline sender hands every message to the outbox
+static esp_err_t outbox_sink(const char *topic, const void *data, size_t len, int qos, void *ctx)
+{
+    return mqtt_outbox_publish(topic, data, len);
+}
+
 unsigned long millis()
 {
     return (unsigned long)(esp_timer_get_time() / 1000ULL);
@@ -65,12 +142,19 @@ static esp_err_t wifi_event_handler(void *arg, esp_event_base_t event_base,
 
     case IP_EVENT_STA_GOT_IP:
         ESP_LOGI(TAG, "got ip: startibg MQTT Client\n");
+        wifi_cache_connected(sta_netif);
         mqtt_app_start();
         break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
         ESP_LOGI(TAG, "disconnected: Retrying Wi-Fi\n");
-        if (retry_cnt++ < MAX_RETRY)
+        if (wifi_cache_fallback(&wifi_config, sta_netif))
+        {
+            // the cached access point failed, the full scan gets its own retries
+            retry_cnt = 0;
+            esp_wifi_connect();
+        }
+        else if (retry_cnt++ < MAX_RETRY)
         {
             esp_wifi_connect();
         }
@@ -92,18 +176,15 @@ void wifi_init(void)
     esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL);
     esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL);
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = EXAMPLE_ESP_WIFI_SSID,
-            .password = EXAMPLE_ESP_WIFI_PASS,
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
     esp_netif_init();
-    esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     esp_wifi_init(&cfg);
+    // the config is rebuilt on every wake, do not wear flash saving it
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
     esp_wifi_set_mode(WIFI_MODE_STA);
+    // directed connect to the last access point, reusing its lease when fresh
+    wifi_cache_apply(&wifi_config, sta_netif);
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
     esp_wifi_start();
 }
@@ -122,16 +203,14 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 {
     // ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
     esp_mqtt_event_handle_t event = event_data;
-    esp_mqtt_client_handle_t client = event->client;
-    int msg_id;
+    mqtt_outbox_handle_event(event);
+    // subscribes the routes on connect and dispatches the data
+    mqtt_router_handle_event(event);
     switch ((esp_mqtt_event_id_t)event_id)
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
         mqtt_connected = true;
-
-        msg_id = esp_mqtt_client_subscribe(client, "/emanuele_topic/#", 0);
-        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
@@ -149,8 +228,6 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-        printf("DATA=%.*s\r\n", event->data_len, event->data);
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -161,6 +238,71 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
+static void print_handler(esp_mqtt_event_handle_t event, void *ctx)
+{
+    uint32_t schema_id;
+    printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
+    if (telemetry_peek_schema(event->data, event->data_len, &schema_id))
+    {
+        printf("DATA=%d bytes of telemetry, schema %d\r\n", event->data_len, (int)schema_id);
+    }
+    else
+    {
+        printf("DATA=%.*s\r\n", event->data_len, event->data);
+    }
+}
+
+static void sleep_handler(esp_mqtt_event_handle_t event, void *ctx)
+{
+    ESP_LOGI(TAG, "sleep requested over mqtt");
+    sleep_requested = true;
+}
+
+// checks a payload of any size as it streams in, nothing is buffered
+typedef struct
+{
+    uint32_t crc;
+    size_t len;
+} blob_check_t;
+
+static blob_check_t blob_check;
+
+static esp_err_t blob_begin(const char *topic, int topic_len, size_t total_len, void *ctx)
+{
+    blob_check_t *check = ctx;
+    check->crc = 0;
+    check->len = 0;
+    ESP_LOGI(TAG, "receiving %d bytes on %.*s", (int)total_len, topic_len, topic);
+    return ESP_OK;
+}
+
+static esp_err_t blob_data(const char *data, size_t len, size_t offset, void *ctx)
+{
+    blob_check_t *check = ctx;
+    check->crc = esp_rom_crc32_le(check->crc, (const uint8_t *)data, len);
+    check->len += len;
+    return ESP_OK;
+}
+
+static void blob_end(esp_err_t result, void *ctx)
+{
+    blob_check_t *check = ctx;
+    if (result == ESP_OK)
+    {
+        ESP_LOGI(TAG, "received %d bytes, crc32 %08" PRIx32, (int)check->len, check->crc);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "blob cut after %d bytes: %s", (int)check->len, esp_err_to_name(result));
+    }
+}
+
+static const mqtt_router_sink_t blob_sink = {
+    .begin = blob_begin,
+    .data = blob_data,
+    .end = blob_end,
+};
+
 static void mqtt_app_start(void)
 {
     ESP_LOGI(TAG, "STARTING MQTT");
@@ -173,6 +315,8 @@ static void mqtt_app_start(void)
 
     client = esp_mqtt_client_init(&mqttConfig);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
+    mqtt_outbox_attach(client);
+    mqtt_router_attach(client);
     esp_mqtt_client_start(client);
 }
 
@@ -191,44 +335,158 @@ void wifi_stop(void)
     wifi_status = false;
 }
 
-void publisher_task(void *params)
+static void status_sample(telemetry_value_t *values)
 {
-    while (true)
+    wifi_ap_record_t ap;
+    mqtt_outbox_stats_t outbox;
+    mqtt_pipeline_stats_t pipeline;
+
+    mqtt_outbox_get_stats(&outbox);
+    mqtt_pipeline_get_stats(&pipeline);
+    values[0].u = millis();
+    values[1].i = wifi_status && esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+    values[2].u = esp_get_free_heap_size();
+    values[3].u = outbox.pending;
+    values[4].u = pipeline.depth;
+}
+
+// prints the schema for the host decoder, and on power on what the binary form saves
+static void status_schema_report(void)
+{
+    char description[256];
+    telemetry_describe(&status_schema, description, sizeof(description));
+    ESP_LOGI(TAG, "telemetry schema %s", description);
+
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED)
     {
-        if (!wifi_status && conn_flag_on)
-        {
-            wifi_init();
-        }
-        else if (wifi_status && !conn_flag_on)
-        {
-            wifi_stop();
+        telemetry_value_t values[sizeof(status_fields) / sizeof(status_fields[0])];
+        telemetry_bench_t bench;
+        status_sample(values);
+        telemetry_bench(&status_schema, values, 1000, &bench);
+        ESP_LOGI(TAG, "telemetry: %d bytes in %d ns binary, %d bytes in %d ns as text", (int)bench.binary_size,
+                 (int)bench.binary_ns, (int)bench.text_size, (int)bench.text_ns);
+    }
+}
 
-            // Go to sleep now
-            printf("Going to sleep now\n");
-            esp_deep_sleep_start();
-            printf("This will never be printed\n");
-        }
-        else if (wifi_status && mqtt_connected)
-        {
-            char pub_str[100];
-            int max_len = sizeof(pub_str);
-            snprintf(pub_str, max_len, "hello world banana %d", (int)millis());
-            printf("sending %s\n", pub_str);
+// encodes straight into a queue slot, never waits on the broker
+static bool publish_telemetry(const telemetry_schema_t *schema, const telemetry_value_t *values)
+{
+    uint8_t *slot = mqtt_pipeline_claim(telemetry_topic);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    size_t len = telemetry_encode(schema, values, slot, CONFIG_MQTT_PIPELINE_SLOT_SIZE);
+    if (len == 0)
+    {
+        mqtt_pipeline_cancel(slot);
+        return false;
+    }
+    mqtt_pipeline_commit(slot, len);
+    return true;
+}
 
-            esp_mqtt_client_publish(client, "/emanuele_topic/test3/", pub_str, 0, 0, 0);
-        }
-        else
+static void take_sample(void)
+{
+    telemetry_value_t values[sizeof(sample_fields) / sizeof(sample_fields[0])];
+    uint8_t buf[32];
+
+    values[0].u = duty_cycle_time_ms();
+    values[1].u = wake;
+    values[2].u = esp_get_free_heap_size();
+    size_t len = telemetry_encode(&sample_schema, values, buf, sizeof(buf));
+    if (len > 0)
+    {
+        duty_cycle_add(buf, len);
+    }
+}
+
+// hands the buffered samples to the pipeline, returns how many it took
+static size_t send_samples(void)
+{
+    size_t n = duty_cycle_count();
+    size_t sent = 0;
+    for (; sent < n; sent++)
+    {
+        size_t len;
+        const void *sample = duty_cycle_get(sent, &len);
+        uint8_t *slot = mqtt_pipeline_claim(telemetry_topic);
+        if (slot == NULL)
         {
-            printf("doing nothing %d %d %d %d\n", wifi_status, conn_flag_on, mqtt_connected, (int)millis());
+            break;
         }
+        memcpy(slot, sample, len);
+        mqtt_pipeline_commit(slot, len);
+    }
 
-        vTaskDelay(5000 / portTICK_PERIOD_MS);
+    telemetry_value_t status[sizeof(status_fields) / sizeof(status_fields[0])];
+    status_sample(status);
+    publish_telemetry(&status_schema, status);
+
+    telemetry_value_t duty[sizeof(duty_fields) / sizeof(duty_fields[0])];
+    duty_cycle_stats_t stats;
+    duty_cycle_get_stats(&stats);
+    duty[0].u = stats.wakes;
+    duty[1].u = stats.sessions;
+    duty[2].u = stats.samples;
+    duty[3].u = stats.sent;
+    duty[4].u = stats.dropped;
+    duty[5].u = stats.radio_on_us / 1000;
+    duty[6].f = stats.radio_us_per_sample / 1000.0f;
+    publish_telemetry(&duty_schema, duty);
+    return sent;
+}
+
+static void radio_session(void)
+{
+    size_t sent = 0;
+
+    duty_cycle_radio_begin();
+    wifi_init();
+
+    int64_t start = millis();
+    while (!mqtt_connected && !sleep_requested && millis() - start < SESSION_CONNECT_TIMEOUT_MS)
+    {
+        vTaskDelay(50 / portTICK_PERIOD_MS);
     }
+
+    if (mqtt_connected)
+    {
+        sent = send_samples();
+        // once in the outbox a sample survives the sleep, the ack wait only
+        // saves a replay on the next session
+        mqtt_outbox_stats_t outbox;
+        mqtt_pipeline_drain(1000);
+        start = millis();
+        do
+        {
+            vTaskDelay(50 / portTICK_PERIOD_MS);
+            mqtt_outbox_get_stats(&outbox);
+        } while (outbox.pending > 0 && !sleep_requested && millis() - start < SESSION_ACK_TIMEOUT_MS);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "no broker within %d ms, keeping %d samples", SESSION_CONNECT_TIMEOUT_MS,
+                 (int)duty_cycle_count());
+    }
+
+    wifi_stop();
+    // what was not acked yet is replayed after the wake
+    mqtt_pipeline_drain(100);
+    mqtt_outbox_flush();
+    duty_cycle_radio_end(sent);
 }
 
-static void IRAM_ATTR gpio_isr_handler(void *arg)
+void publisher_task(void *params)
 {
-    conn_flag_on = !conn_flag_on;
+    take_sample();
+    if (duty_cycle_due())
+    {
+        radio_session();
+    }
+
+    printf("Going to sleep now\n");
+    duty_cycle_sleep();
 }
 
 void print_wakeup_reason()
@@ -271,17 +529,21 @@ void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    wake = duty_cycle_init();
+    wifi_cache_init();
+    ESP_ERROR_CHECK(mqtt_outbox_init("outbox"));
+    ESP_ERROR_CHECK(mqtt_pipeline_init());
+    mqtt_pipeline_set_sink(outbox_sink, NULL);
+    telemetry_topic = mqtt_pipeline_register_topic("/emanuele_topic/telemetry", 1);
+    status_schema_report();
+    mqtt_router_add("/emanuele_topic/#", 0, print_handler, NULL);
+    mqtt_router_add("/emanuele_topic/cmd/sleep", 1, sleep_handler, NULL);
+    mqtt_router_add_stream("/emanuele_topic/blob/#", 1, &blob_sink, &blob_check);
 
     // Print the wakeup reason for ESP32
     print_wakeup_reason();
+    // the button wakes the node for a session right away, besides the timer
     esp_sleep_enable_ext0_wakeup(GPIO_NUM_34, 0); // 1 = High, 0 = Low
 
-    // attach isr on button press
-    gpio_pad_select_gpio(OLIMEX_BUT_PIN);
-    gpio_set_direction(OLIMEX_BUT_PIN, GPIO_MODE_INPUT);
-    gpio_set_intr_type(OLIMEX_BUT_PIN, GPIO_INTR_POSEDGE);
-    gpio_install_isr_service(ESP_INTR_FLAG_LOWMED);
-    gpio_isr_handler_add(OLIMEX_BUT_PIN, gpio_isr_handler, 0);
-
     xTaskCreate(publisher_task, "publisher_task", 1024 * 5, NULL, 5, &publisher_task_handle);
 }
\ No newline at end of file